@@ -2,7 +2,6 @@
 
 require 'bundler/setup'
 require 'polyphony'
-require 'polyphony/core/sync'
 
 def loop_it(number, lock)
   loop do
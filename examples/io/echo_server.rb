@@ -6,7 +6,9 @@ require 'polyphony'
 server = TCPServer.open('127.0.0.1', 1234)
 puts "Pid: #{Process.pid}"
 puts 'Echoing on port 1234...'
-while (client = server.accept)
+loop do
+  # client is assigned inside a block, so each spun fiber gets its own copy
+  client = server.accept
   spin do
     while (data = client.gets)
       client.write('you said: ', data.chomp, "!\n")
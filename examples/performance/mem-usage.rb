@@ -54,3 +54,11 @@ calculate_memory_cost('polyphony fiber', 10000) do
   f.await
   f
 end
+
+Thread.current.fiber_pool = Polyphony::FiberPool.new(max_size: 10000)
+
+calculate_memory_cost('polyphony pooled fiber', 10000) do
+  f = spin { :foo }
+  f.await
+  f
+end
@@ -0,0 +1,22 @@
+# frozen_string_literal: true
+
+require 'bundler/setup'
+require 'polyphony'
+
+X = 100_000
+
+def spin_await
+  count0 = GC.stat(:total_allocated_objects)
+  t0 = Time.now
+  X.times { spin { :foo }.await }
+  dt = Time.now - t0
+  objs = (GC.stat(:total_allocated_objects) - count0) / X
+  puts format('%d/s (%d objects per spin)', (X / dt), objs)
+end
+
+STDOUT << 'spin:         '
+spin_await
+
+Thread.current.fiber_pool = Polyphony::FiberPool.new
+STDOUT << 'pooled spin:  '
+spin_await
@@ -3807,10 +3807,18 @@ rb_thread_unsafe_dangerous_crazy_blocking_region_end(...);
 #######################################################################
 */
 
-        poll_args.loop = loop;
-        poll_args.waittime = waittime;
+        /* A non-blocking poll (EVRUN_NOWAIT, or pending events) returns
+           immediately, so it is cheaper to keep holding the GVL than to
+           release it and then compete with other threads to reacquire it. */
+        if (waittime > 0.)
+          {
+            poll_args.loop = loop;
+            poll_args.waittime = waittime;
 
-        rb_thread_call_without_gvl(ev_backend_poll, (void *)&poll_args, RUBY_UBF_IO, 0);
+            rb_thread_call_without_gvl(ev_backend_poll, (void *)&poll_args, RUBY_UBF_IO, 0);
+          }
+        else
+          backend_poll (EV_A_ waittime);
 
         // backend_poll (EV_A_ waittime);
 /*
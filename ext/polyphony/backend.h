@@ -3,22 +3,34 @@
 
 #include "ruby.h"
 
-// backend interface function signatures 
+// backend interface function signatures (implemented by LibevBackend and
+// IOUringBackend, one of which is selected at build time)
 
-// VALUE LibevBackend_accept(VALUE self, VALUE sock);
-// VALUE LibevBackend_accept_loop(VALUE self, VALUE sock);
-// VALUE LibevBackend_connect(VALUE self, VALUE sock, VALUE host, VALUE port);
-// VALUE LibevBackend_finalize(VALUE self);
-// VALUE LibevBackend_post_fork(VALUE self);
-// VALUE LibevBackend_read(VALUE self, VALUE io, VALUE str, VALUE length, VALUE to_eof);
-// VALUE LibevBackend_read_loop(VALUE self, VALUE io);
-// VALUE LibevBackend_sleep(VALUE self, VALUE duration);
-// VALUE LibevBackend_wait_io(VALUE self, VALUE io, VALUE write);
-// VALUE LibevBackend_wait_pid(VALUE self, VALUE pid);
-// VALUE LibevBackend_write(int argc, VALUE *argv, VALUE self);
+// VALUE Backend_accept(VALUE self, VALUE sock);
+// VALUE Backend_accept_loop(int argc, VALUE *argv, VALUE self);
+// VALUE Backend_connect(VALUE self, VALUE sock, VALUE host, VALUE port);
+// VALUE Backend_finalize(VALUE self);
+// VALUE Backend_post_fork(VALUE self);
+// VALUE Backend_read(int argc, VALUE *argv, VALUE self);
+// VALUE Backend_read_loop(int argc, VALUE *argv, VALUE self);
+// VALUE Backend_recv(int argc, VALUE *argv, VALUE self);
+// VALUE Backend_recvmsg(int argc, VALUE *argv, VALUE self);
+// VALUE Backend_release_io(VALUE self, VALUE io);
+// VALUE Backend_recv_batch(VALUE self, VALUE io, VALUE max_msgs, VALUE max_len);
+// VALUE Backend_select(VALUE self, VALUE queues, VALUE ios, VALUE timeout);
+// VALUE Backend_send(int argc, VALUE *argv, VALUE self);
+// VALUE Backend_sendmsg(int argc, VALUE *argv, VALUE self);
+// VALUE Backend_send_batch(VALUE self, VALUE io, VALUE messages);
+// VALUE Backend_sleep(VALUE self, VALUE duration);
+// VALUE Backend_timeout(int argc, VALUE *argv, VALUE self);
+// VALUE Backend_timer_loop(VALUE self, VALUE interval);
+// VALUE Backend_wait_io(VALUE self, VALUE io, VALUE write);
+// VALUE Backend_wait_pid(VALUE self, VALUE pid);
+// VALUE Backend_write(int argc, VALUE *argv, VALUE self);
 
+typedef VALUE (* backend_now_t)(VALUE self);
 typedef VALUE (* backend_pending_count_t)(VALUE self);
-typedef VALUE (*backend_poll_t)(VALUE self, VALUE nowait, VALUE current_fiber, VALUE queue);
+typedef VALUE (*backend_poll_t)(VALUE self, VALUE nowait, VALUE current_fiber, VALUE runnable_count);
 typedef VALUE (* backend_ref_t)(VALUE self);
 typedef int (* backend_ref_count_t)(VALUE self);
 typedef void (* backend_reset_ref_count_t)(VALUE self);
@@ -27,6 +39,7 @@ typedef VALUE (* backend_wait_event_t)(VALUE self, VALUE raise_on_exception);
 typedef VALUE (* backend_wakeup_t)(VALUE self);
 
 typedef struct backend_interface {
+  backend_now_t             now;
   backend_pending_count_t   pending_count;
   backend_poll_t            poll;
   backend_ref_t             ref;
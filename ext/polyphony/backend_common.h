@@ -0,0 +1,571 @@
+#ifndef BACKEND_COMMON_H
+#define BACKEND_COMMON_H
+
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "polyphony.h"
+
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+// the following is copied verbatim from the Ruby source code (io.c)
+struct io_internal_read_struct {
+    int fd;
+    int nonblock;
+    void *buf;
+    size_t capa;
+};
+
+#define StringValue(v) rb_string_value(&(v))
+
+static inline int io_setstrbuf(VALUE *str, long len) {
+  #ifdef _WIN32
+    len = (len + 1) & ~1L;	/* round up for wide char */
+  #endif
+  if (NIL_P(*str)) {
+    *str = rb_str_new(0, len);
+    return 1;
+  }
+  else {
+    VALUE s = StringValue(*str);
+    long clen = RSTRING_LEN(s);
+    if (clen >= len) {
+      rb_str_modify(s);
+      return 0;
+    }
+    len -= clen;
+  }
+  rb_str_modify_expand(*str, len);
+  return 0;
+}
+
+// Returns the offset in the given buffer at which Backend#read stores the data
+// read: the given position, or the end of the buffer if the position is -1.
+static inline long io_read_buffer_pos(VALUE str, VALUE pos) {
+  long buffer_pos = NIL_P(pos) ? 0 : NUM2LONG(pos);
+  long str_len = NIL_P(str) ? 0 : RSTRING_LEN(StringValue(str));
+
+  if (buffer_pos == -1) return str_len;
+  if (buffer_pos < 0 || buffer_pos > str_len)
+    rb_raise(rb_eArgError, "buffer position out of range");
+  return buffer_pos;
+}
+
+#define MAX_REALLOC_GAP 4096
+static inline void io_shrink_read_string(VALUE str, long n) {
+  if (rb_str_capacity(str) - n > MAX_REALLOC_GAP) {
+    rb_str_resize(str, n);
+  }
+}
+
+static inline void io_set_read_length(VALUE str, long n, int shrinkable) {
+  if (RSTRING_LEN(str) != n) {
+    rb_str_modify(str);
+    rb_str_set_len(str, n);
+    if (shrinkable) io_shrink_read_string(str, n);
+  }
+}
+
+static inline rb_encoding* io_read_encoding(rb_io_t *fptr) {
+    if (fptr->encs.enc) {
+	return fptr->encs.enc;
+    }
+    return rb_default_external_encoding();
+}
+
+static inline VALUE io_enc_str(VALUE str, rb_io_t *fptr) {
+    OBJ_TAINT(str);
+    rb_enc_associate(str, io_read_encoding(fptr));
+    return str;
+}
+
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+
+static inline VALUE backend_snooze() {
+  Fiber_make_runnable(rb_fiber_current(), Qnil);
+  return Thread_switch_fiber(rb_thread_current());
+}
+
+// The running time of a fiber is only checked every BACKEND_BUDGET_CLOCK_OPS
+// operations, so most operations do not pay for reading the clock.
+#define BACKEND_BUDGET_OPS        64
+#define BACKEND_BUDGET_CLOCK_OPS  16
+#define BACKEND_BUDGET_USECS      1000
+
+static inline unsigned long long backend_usecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Accounts for an operation performed by the current fiber, returning true if
+// the fiber has used up its budget.
+static inline int backend_budget_spend(backend_budget_t *budget) {
+  if (++budget->ops >= BACKEND_BUDGET_OPS) return 1;
+  if (budget->ops % BACKEND_BUDGET_CLOCK_OPS) return 0;
+
+  if (!budget->start) {
+    budget->start = backend_usecs();
+    return 0;
+  }
+  return backend_usecs() - budget->start >= BACKEND_BUDGET_USECS;
+}
+
+static VALUE backend_timeout_exception_new(VALUE args) {
+  VALUE *argv = (VALUE *) args;
+  return NIL_P(argv[1]) ?
+    rb_funcall(argv[0], ID_new, 0) : rb_funcall(argv[0], ID_new, 1, argv[1]);
+}
+
+// Returns the exception to be raised in a fiber whose timeout has expired.
+// The exception class is instantiated only once the timeout expires, so that
+// timeouts that are cancelled do not pay for creating the exception (and
+// capturing its caller). Since this is called from the event loop, an error
+// raised by the exception constructor is returned instead of raised.
+static inline VALUE backend_timeout_exception(VALUE exception, VALUE value) {
+  VALUE args[2] = { exception, value };
+  int state = 0;
+  VALUE ret;
+
+  if (!RB_TYPE_P(exception, T_CLASS)) return exception;
+
+  ret = rb_protect(backend_timeout_exception_new, (VALUE) args, &state);
+  if (state) {
+    ret = rb_errinfo();
+    rb_set_errinfo(Qnil);
+  }
+  return ret;
+}
+
+// Backend#select waits on multiple queues and IOs at once. The queue part is
+// common to both backends: the current fiber is added to the waiters of each
+// queue, using a separate list node per queue.
+typedef struct backend_select {
+  VALUE queues;
+  VALUE ios;
+  fiber_node_t *nodes;
+  long queue_count;   // number of queues waited upon
+  long selected;      // index of queue a value was shifted from, or -1
+} backend_select_t;
+
+static inline void backend_select_init(backend_select_t *select, VALUE queues, VALUE ios) {
+  if (queues != Qnil) Check_Type(queues, T_ARRAY);
+  if (ios != Qnil) Check_Type(ios, T_ARRAY);
+
+  select->queues = queues == Qnil ? rb_ary_new() : queues;
+  select->ios = ios == Qnil ? rb_ary_new() : ios;
+  select->queue_count = 0;
+  select->selected = -1;
+  select->nodes = NULL;
+}
+
+// Returns a [queue, value] pair if any queue has a value, otherwise makes sure
+// the current fiber is waiting on all queues and returns nil.
+static inline VALUE backend_select_queues(backend_select_t *select) {
+  long len = RARRAY_LEN(select->queues);
+  VALUE value;
+
+  if (!select->nodes) select->nodes = ALLOC_N(fiber_node_t, len + 1);
+  for (long i = 0; i < len; i++) {
+    VALUE queue = RARRAY_AREF(select->queues, i);
+    if (Queue_select_shift(queue, &value)) {
+      select->selected = i;
+      return rb_ary_new_from_args(2, queue, value);
+    }
+    if (i == select->queue_count) {
+      fiber_node_init(&select->nodes[i], rb_fiber_current());
+      select->queue_count++;
+    }
+  }
+  for (long i = 0; i < select->queue_count; i++)
+    Queue_select_wait(RARRAY_AREF(select->queues, i), &select->nodes[i]);
+  return Qnil;
+}
+
+static inline void backend_select_done(backend_select_t *select) {
+  for (long i = 0; i < select->queue_count; i++)
+    Queue_select_done(RARRAY_AREF(select->queues, i), &select->nodes[i], i == select->selected);
+  select->queue_count = 0;
+  if (select->nodes) xfree(select->nodes);
+  select->nodes = NULL;
+}
+
+// writev is performed in batches of iovecs kept on the stack, so any number
+// of strings can be written without allocating, and without exceeding
+// IOV_MAX. The strings are given either as an array of VALUEs or as a Ruby
+// array.
+#define WRITEV_BATCH_LEN (IOV_MAX < 128 ? IOV_MAX : 128)
+
+typedef struct backend_writev {
+  VALUE ary;
+  VALUE *argv;
+  long count;
+  long next;          // index of next string to add to a batch
+  struct iovec *iov_ptr;
+  int iov_count;      // iovecs left to write in the current batch
+  struct iovec iov[WRITEV_BATCH_LEN];
+} backend_writev_t;
+
+static inline void backend_writev_init(backend_writev_t *w, VALUE ary, VALUE *argv, long count) {
+  w->ary = ary;
+  w->argv = argv;
+  w->count = count;
+  w->next = 0;
+  w->iov_ptr = w->iov;
+  w->iov_count = 0;
+}
+
+// Prepares the next batch of iovecs, returning 0 once all strings have been
+// written. Empty strings are skipped.
+static inline int backend_writev_fill(backend_writev_t *w) {
+  long count = NIL_P(w->ary) ? w->count : RARRAY_LEN(w->ary);
+
+  w->iov_ptr = w->iov;
+  w->iov_count = 0;
+  while (w->next < count && w->iov_count < WRITEV_BATCH_LEN) {
+    VALUE str = NIL_P(w->ary) ? w->argv[w->next] : RARRAY_AREF(w->ary, w->next);
+    w->next++;
+    StringValue(str);
+    if (RSTRING_LEN(str) == 0) continue;
+
+    w->iov[w->iov_count].iov_base = RSTRING_PTR(str);
+    w->iov[w->iov_count].iov_len = RSTRING_LEN(str);
+    w->iov_count++;
+  }
+  return w->iov_count > 0;
+}
+
+// Advances the current batch past the given number of bytes written.
+static inline void backend_writev_advance(backend_writev_t *w, long n) {
+  while (n > 0) {
+    if ((size_t) n < w->iov_ptr[0].iov_len) {
+      w->iov_ptr[0].iov_base = (char *) w->iov_ptr[0].iov_base + n;
+      w->iov_ptr[0].iov_len -= n;
+      n = 0;
+    }
+    else {
+      n -= w->iov_ptr[0].iov_len;
+      w->iov_ptr += 1;
+      w->iov_count -= 1;
+    }
+  }
+}
+
+// read_loop adapts the size of chunks to recent reads: the chunk size grows
+// when a read fills the buffer, and shrinks when reads are much smaller.
+#define READ_LOOP_MIN_LEN   4096
+#define READ_LOOP_INIT_LEN  8192
+#define READ_LOOP_MAX_LEN   65536
+
+static inline long read_loop_adapt_len(long len, long n) {
+  if (n == len && len < READ_LOOP_MAX_LEN) return len * 2;
+  if (n < len / 4 && len > READ_LOOP_MIN_LEN) return len / 2;
+  return len;
+}
+
+// read_loop may also split the data read into frames, which are either
+// prefixed with a fixed-size length header (length_header: 1, 2, 4 or 8,
+// endian: :big or :little) or terminated by a delimiter (delimiter: str). Data
+// is read into an internal buffer, and only complete frames are yielded,
+// without their header or delimiter. Any partial frame is kept at the start of
+// the buffer for the next read, and discarded on EOF. Data already read from
+// the IO (e.g. by a buffered reader) is given with the initial option, and
+// processed before reading, whether framed or not. Frames are limited to
+// max_frame_length bytes (READ_FRAMER_MAX_LEN by default), so a bogus length
+// header or a missing delimiter raises an IOError instead of growing the
+// buffer without bound.
+#define READ_FRAMER_MAX_LEN (1L << 24)
+
+enum read_framing {
+  READ_FRAMING_NONE,
+  READ_FRAMING_LENGTH,
+  READ_FRAMING_DELIMITER
+};
+
+typedef struct read_framer {
+  enum read_framing mode;
+  int header_len;
+  int little_endian;
+  VALUE delimiter;
+  long max_frame_len;
+  VALUE initial;
+  VALUE data;
+  VALUE buffer;
+  // length of the partial frame already searched for a delimiter
+  long scanned;
+} read_framer_t;
+
+static inline void read_framer_init(read_framer_t *framer, VALUE buffer, VALUE opts) {
+  static ID keys[5];
+  VALUE values[5] = {Qundef, Qundef, Qundef, Qundef, Qundef};
+
+  framer->mode = READ_FRAMING_NONE;
+  framer->delimiter = Qnil;
+  framer->max_frame_len = READ_FRAMER_MAX_LEN;
+  framer->initial = Qnil;
+  framer->data = Qnil;
+  framer->buffer = buffer;
+  framer->scanned = 0;
+  if (NIL_P(opts)) return;
+
+  if (!keys[0]) {
+    keys[0] = rb_intern("length_header");
+    keys[1] = rb_intern("endian");
+    keys[2] = rb_intern("delimiter");
+    keys[3] = rb_intern("max_frame_length");
+    keys[4] = rb_intern("initial");
+  }
+  rb_get_kwargs(opts, keys, 0, 5, values);
+
+  if (values[4] != Qundef && !NIL_P(values[4]))
+    framer->initial = StringValue(values[4]);
+
+  if (values[0] != Qundef && values[2] != Qundef)
+    rb_raise(rb_eArgError, "cannot specify both length_header and delimiter");
+
+  if (values[0] != Qundef) {
+    framer->mode = READ_FRAMING_LENGTH;
+    framer->header_len = NUM2INT(values[0]);
+    if (framer->header_len != 1 && framer->header_len != 2 && framer->header_len != 4 && framer->header_len != 8)
+      rb_raise(rb_eArgError, "invalid length header size (expected 1, 2, 4 or 8)");
+
+    VALUE endian = values[1] == Qundef ? Qnil : values[1];
+    if (NIL_P(endian) || endian == ID2SYM(rb_intern("big"))) framer->little_endian = 0;
+    else if (endian == ID2SYM(rb_intern("little"))) framer->little_endian = 1;
+    else rb_raise(rb_eArgError, "invalid endianness (expected :big or :little)");
+  }
+  else if (values[2] != Qundef) {
+    framer->mode = READ_FRAMING_DELIMITER;
+    framer->delimiter = StringValue(values[2]);
+    if (RSTRING_LEN(framer->delimiter) == 0) rb_raise(rb_eArgError, "delimiter must not be empty");
+  }
+  else return;
+
+  if (values[3] != Qundef) {
+    framer->max_frame_len = NUM2LONG(values[3]);
+    if (framer->max_frame_len <= 0) rb_raise(rb_eArgError, "max_frame_length must be positive");
+  }
+  framer->data = rb_str_buf_new(READ_LOOP_INIT_LEN);
+}
+
+// Returns a pointer to len bytes of free space following the buffered data.
+static inline char *read_framer_prepare(read_framer_t *framer, long len) {
+  long used = RSTRING_LEN(framer->data);
+  rb_str_modify_expand(framer->data, len);
+  return RSTRING_PTR(framer->data) + used;
+}
+
+static inline long read_framer_decode_length(read_framer_t *framer, const unsigned char *ptr) {
+  unsigned long long len = 0;
+  for (int i = 0; i < framer->header_len; i++)
+    len = (len << 8) | ptr[framer->little_endian ? framer->header_len - 1 - i : i];
+  if (len > (unsigned long long)framer->max_frame_len)
+    rb_raise(rb_eIOError, "frame length %llu exceeds maximum of %ld", len, framer->max_frame_len);
+  return (long)len;
+}
+
+static inline VALUE read_framer_frame(read_framer_t *framer, const char *ptr, long len, rb_io_t *fptr) {
+  VALUE str = framer->buffer;
+  if (NIL_P(str)) str = rb_str_new(ptr, len);
+  else {
+    rb_str_resize(str, len);
+    memcpy(RSTRING_PTR(str), ptr, len);
+  }
+  return io_enc_str(str, fptr);
+}
+
+// Adds n bytes read into the space returned by read_framer_prepare to the
+// buffered data, yielding all complete frames.
+static inline void read_framer_feed(read_framer_t *framer, long n, rb_io_t *fptr) {
+  VALUE data = framer->data;
+  long total = RSTRING_LEN(data) + n;
+  long head = 0;
+  rb_str_set_len(data, total);
+
+  while (1) {
+    const char *ptr = RSTRING_PTR(data) + head;
+    long avail = total - head;
+    long frame_len;
+    VALUE frame;
+
+    if (framer->mode == READ_FRAMING_LENGTH) {
+      if (avail < framer->header_len) break;
+      frame_len = read_framer_decode_length(framer, (const unsigned char *)ptr);
+      if (avail - framer->header_len < frame_len) break;
+
+      frame = read_framer_frame(framer, ptr + framer->header_len, frame_len, fptr);
+      head += framer->header_len + frame_len;
+    }
+    else {
+      long delimiter_len = RSTRING_LEN(framer->delimiter);
+      const char *found = memmem(
+        ptr + framer->scanned, avail - framer->scanned,
+        RSTRING_PTR(framer->delimiter), delimiter_len
+      );
+      if (!found) {
+        if (avail - delimiter_len >= framer->max_frame_len)
+          rb_raise(rb_eIOError, "frame length exceeds maximum of %ld", framer->max_frame_len);
+        // a delimiter may straddle the end of the data read so far
+        framer->scanned = avail - delimiter_len + 1;
+        if (framer->scanned < 0) framer->scanned = 0;
+        break;
+      }
+
+      frame_len = found - ptr;
+      if (frame_len > framer->max_frame_len)
+        rb_raise(rb_eIOError, "frame length %ld exceeds maximum of %ld", frame_len, framer->max_frame_len);
+      frame = read_framer_frame(framer, ptr, frame_len, fptr);
+      head += frame_len + delimiter_len;
+      framer->scanned = 0;
+    }
+    rb_yield(frame);
+  }
+
+  if (head > 0) {
+    char *ptr = RSTRING_PTR(data);
+    memmove(ptr, ptr + head, total - head);
+    rb_str_set_len(data, total - head);
+  }
+}
+
+// Processes the data given with the initial option, as if it were read from
+// the IO. In unframed mode the data is yielded as a single chunk, so this
+// should be called before the read buffer is prepared.
+static inline void read_framer_feed_initial(read_framer_t *framer, rb_io_t *fptr) {
+  VALUE initial = framer->initial;
+  if (NIL_P(initial) || RSTRING_LEN(initial) == 0) return;
+
+  if (framer->mode == READ_FRAMING_NONE) {
+    rb_yield(read_framer_frame(framer, RSTRING_PTR(initial), RSTRING_LEN(initial), fptr));
+    return;
+  }
+  rb_str_buf_append(framer->data, initial);
+  read_framer_feed(framer, 0, fptr);
+}
+
+// A zero-length read signifies EOF only for stream sockets, since datagrams
+// may be empty.
+static inline int socket_is_stream(int fd) {
+  int type;
+  socklen_t len = sizeof(type);
+  return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_STREAM;
+}
+
+extern VALUE cAddrinfo;
+
+// Returns the [data, sender_addrinfo, flags] tuple returned by recvmsg. The
+// sender address is nil if not given (e.g. for connected stream sockets).
+static inline VALUE recvmsg_result(VALUE str, struct msghdr *msg) {
+  VALUE addrinfo = Qnil;
+  if (msg->msg_namelen > 0)
+    addrinfo = rb_funcall(cAddrinfo, rb_intern("new"), 1, rb_str_new(msg->msg_name, msg->msg_namelen));
+  return rb_ary_new_from_args(3, str, addrinfo, INT2NUM(msg->msg_flags));
+}
+
+// Sets the destination address of the given msghdr, from either an Addrinfo or
+// a packed sockaddr string. Returns the sockaddr string, which should be kept
+// alive until the message is sent.
+static inline VALUE sendmsg_set_dest(struct msghdr *msg, VALUE dest) {
+  if (NIL_P(dest)) return Qnil;
+
+  if (rb_obj_is_kind_of(dest, cAddrinfo)) dest = rb_funcall(dest, rb_intern("to_sockaddr"), 0);
+  StringValue(dest);
+  msg->msg_name = RSTRING_PTR(dest);
+  msg->msg_namelen = (socklen_t) RSTRING_LEN(dest);
+  return dest;
+}
+
+#ifdef __linux__
+
+// Batched datagram I/O using recvmmsg/sendmmsg. The kernel caps the number of
+// messages per call at UIO_MAXIOV.
+#define MMSG_MAX_COUNT 1024
+
+// Sets up count message headers for receiving up to len bytes each, using a
+// single temporary buffer allocated along with the headers.
+static inline struct mmsghdr *mmsg_recv_setup(VALUE *tmp, int count, long len) {
+  struct mmsghdr *msgs;
+  struct iovec *iov;
+  char *buf;
+
+  if (count <= 0 || count > MMSG_MAX_COUNT)
+    rb_raise(rb_eArgError, "invalid message count (expected 1..%d)", MMSG_MAX_COUNT);
+  if (len <= 0) rb_raise(rb_eArgError, "invalid message length");
+
+  msgs = rb_alloc_tmp_buffer(tmp, count * (sizeof(struct mmsghdr) + sizeof(struct iovec) + len));
+  iov = (struct iovec *)(msgs + count);
+  buf = (char *)(iov + count);
+  memset(msgs, 0, count * sizeof(struct mmsghdr));
+  for (int i = 0; i < count; i++) {
+    iov[i].iov_base = buf + i * len;
+    iov[i].iov_len = len;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  return msgs;
+}
+
+// Returns an array of strings holding the count received messages
+static inline VALUE mmsg_recv_result(struct mmsghdr *msgs, int count) {
+  VALUE result = rb_ary_new_capa(count);
+  for (int i = 0; i < count; i++)
+    rb_ary_push(result, rb_str_new(msgs[i].msg_hdr.msg_iov->iov_base, msgs[i].msg_len));
+  return result;
+}
+
+// Sets up message headers for sending the given array of strings. The number
+// of messages is stored in *count.
+static inline struct mmsghdr *mmsg_send_setup(VALUE *tmp, VALUE messages, int *count) {
+  struct mmsghdr *msgs;
+  struct iovec *iov;
+
+  Check_Type(messages, T_ARRAY);
+  *count = RARRAY_LEN(messages);
+  if (*count == 0) return NULL;
+
+  msgs = rb_alloc_tmp_buffer(tmp, *count * (sizeof(struct mmsghdr) + sizeof(struct iovec)));
+  iov = (struct iovec *)(msgs + *count);
+  memset(msgs, 0, *count * sizeof(struct mmsghdr));
+  for (int i = 0; i < *count; i++) {
+    VALUE str = RARRAY_AREF(messages, i);
+    Check_Type(str, T_STRING);
+    iov[i].iov_base = RSTRING_PTR(str);
+    iov[i].iov_len = RSTRING_LEN(str);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  return msgs;
+}
+
+#endif /* __linux__ */
+
+extern ID ID_ivar_is_nonblocking;
+
+// Since we need to ensure that fd's are non-blocking before every I/O
+// operation, here we improve upon Ruby's rb_io_set_nonblock by caching the
+// "nonblock" state in an instance variable. Calling rb_ivar_get on every read
+// is still much cheaper than doing a fcntl syscall on every read! Preliminary
+// benchmarks (with a "hello world" HTTP server) show throughput is improved
+// by 10-13%.
+static inline void io_set_nonblock(rb_io_t *fptr, VALUE io) {
+  VALUE is_nonblocking = rb_ivar_get(io, ID_ivar_is_nonblocking);
+  if (is_nonblocking == Qtrue) return;
+
+  rb_ivar_set(io, ID_ivar_is_nonblocking, Qtrue);
+
+#ifdef _WIN32
+  rb_w32_set_nonblock(fptr->fd);
+#elif defined(F_GETFL)
+  int oflags = fcntl(fptr->fd, F_GETFL);
+  if ((oflags == -1) && (oflags & O_NONBLOCK)) return;
+  oflags |= O_NONBLOCK;
+  fcntl(fptr->fd, F_SETFL, oflags);
+#endif
+}
+
+#endif /* BACKEND_COMMON_H */
@@ -0,0 +1,186 @@
+#include "polyphony.h"
+#include "ruby/debug.h"
+
+// Fibers record the caller of spin, which is used for Fiber#location,
+// Fiber#caller and for sanitizing exception backtraces. Materializing a full
+// backtrace as an array of strings on each spin is expensive, so the capture
+// mode can be set using Polyphony.caller_capture=:
+//
+// - :full - the caller is captured using Kernel#caller (the default).
+// - :lazy - raw frames are recorded using rb_profile_frames, and converted to
+//   strings only when needed. Up to CALLER_MAX_FRAMES frames are recorded, and
+//   labels of block frames are those of the enclosing method. Only Ruby frames
+//   are recorded, since not all Ruby versions report C frames.
+// - :off - the caller is not recorded.
+
+#define CALLER_MAX_FRAMES 256
+
+enum caller_capture_mode {
+  CALLER_CAPTURE_FULL,
+  CALLER_CAPTURE_LAZY,
+  CALLER_CAPTURE_OFF
+};
+
+static enum caller_capture_mode caller_capture_mode = CALLER_CAPTURE_FULL;
+
+VALUE cCaller = Qnil;
+VALUE SYM_full;
+VALUE SYM_lazy;
+VALUE SYM_off;
+
+typedef struct caller {
+  int count;
+  VALUE backtrace;
+  VALUE *frames;
+  int *lines;
+} Caller_t;
+
+static void Caller_mark(void *ptr) {
+  Caller_t *caller = ptr;
+  rb_gc_mark(caller->backtrace);
+  for (int i = 0; i < caller->count; i++) rb_gc_mark(caller->frames[i]);
+}
+
+static void Caller_free(void *ptr) {
+  Caller_t *caller = ptr;
+  xfree(caller->frames);
+  xfree(caller->lines);
+  xfree(ptr);
+}
+
+static size_t Caller_size(const void *ptr) {
+  const Caller_t *caller = ptr;
+  return sizeof(Caller_t) + caller->count * (sizeof(VALUE) + sizeof(int));
+}
+
+static const rb_data_type_t Caller_type = {
+  "Caller",
+  {Caller_mark, Caller_free, Caller_size,},
+  0, 0, 0
+};
+
+#define GetCaller(obj, caller) \
+  TypedData_Get_Struct((obj), Caller_t, &Caller_type, (caller))
+
+// Records the current Ruby frames, skipping the given number of innermost
+// frames. C frames, and the line 0 frames that some Ruby versions report
+// below <main>, have no counterpart in Kernel#caller and are left out, so they
+// are neither recorded nor counted as skipped. The frames are skipped here
+// rather than by rb_profile_frames, since some Ruby versions ignore its start
+// argument.
+static VALUE caller_new(int skip) {
+  VALUE frames[CALLER_MAX_FRAMES];
+  int lines[CALLER_MAX_FRAMES];
+  int total = rb_profile_frames(0, CALLER_MAX_FRAMES, frames, lines);
+  int count = 0;
+  Caller_t *caller = ALLOC(Caller_t);
+
+  caller->count = 0;
+  caller->backtrace = Qnil;
+  caller->frames = NULL;
+  caller->lines = NULL;
+  VALUE obj = TypedData_Wrap_Struct(cCaller, &Caller_type, caller);
+
+  for (int i = 0; i < total; i++) {
+    if (lines[i] <= 0 || rb_profile_frame_path(frames[i]) == Qnil) continue;
+    if (skip > 0) {
+      skip--;
+      continue;
+    }
+    frames[count] = frames[i];
+    lines[count] = lines[i];
+    count++;
+  }
+
+  if (count > 0) {
+    caller->frames = ALLOC_N(VALUE, count);
+    caller->lines = ALLOC_N(int, count);
+    MEMCPY(caller->frames, frames, VALUE, count);
+    MEMCPY(caller->lines, lines, int, count);
+    caller->count = count;
+  }
+  return obj;
+}
+
+// Returns the recorded frames as an array of strings in the same format as
+// Kernel#caller. The array is built on first use and then cached.
+VALUE Caller_to_a(VALUE self) {
+  Caller_t *caller;
+  GetCaller(self, caller);
+
+  if (caller->backtrace != Qnil) return caller->backtrace;
+
+  VALUE backtrace = rb_ary_new_capa(caller->count);
+  for (int i = 0; i < caller->count; i++) {
+    VALUE label = rb_profile_frame_label(caller->frames[i]);
+    if (label == Qnil) label = rb_profile_frame_method_name(caller->frames[i]);
+
+    rb_ary_push(backtrace, rb_sprintf("%"PRIsVALUE":%d:in `%"PRIsVALUE"'",
+      rb_profile_frame_path(caller->frames[i]), caller->lines[i], label));
+  }
+  caller->backtrace = backtrace;
+  return backtrace;
+}
+
+VALUE Caller_aref(VALUE self, VALUE idx) {
+  return rb_ary_entry(Caller_to_a(self), NUM2LONG(idx));
+}
+
+VALUE Caller_size_m(VALUE self) {
+  return LONG2NUM(RARRAY_LEN(Caller_to_a(self)));
+}
+
+// Returns the caller of the calling method according to the current capture
+// mode, with start having the same meaning as for Kernel#caller.
+static VALUE Polyphony_capture_caller(int argc, VALUE *argv, VALUE self) {
+  VALUE start;
+  rb_scan_args(argc, argv, "01", &start);
+  int start_int = start == Qnil ? 1 : NUM2INT(start);
+
+  // For Kernel#caller one more frame is skipped for the frame of this method.
+  // The lazy caller does not count it, being a C frame.
+  switch (caller_capture_mode) {
+    case CALLER_CAPTURE_FULL:
+      return rb_funcall(rb_mKernel, ID_caller, 1, INT2NUM(start_int + 1));
+    case CALLER_CAPTURE_LAZY:
+      return caller_new(start_int);
+    default:
+      return Qnil;
+  }
+}
+
+static VALUE Polyphony_caller_capture(VALUE self) {
+  switch (caller_capture_mode) {
+    case CALLER_CAPTURE_FULL: return SYM_full;
+    case CALLER_CAPTURE_LAZY: return SYM_lazy;
+    default:                  return SYM_off;
+  }
+}
+
+static VALUE Polyphony_caller_capture_set(VALUE self, VALUE mode) {
+  if (mode == SYM_full) caller_capture_mode = CALLER_CAPTURE_FULL;
+  else if (mode == SYM_lazy) caller_capture_mode = CALLER_CAPTURE_LAZY;
+  else if (mode == SYM_off) caller_capture_mode = CALLER_CAPTURE_OFF;
+  else rb_raise(rb_eArgError, "invalid caller capture mode (expected :full, :lazy or :off)");
+  return mode;
+}
+
+void Init_Caller() {
+  cCaller = rb_define_class_under(mPolyphony, "Caller", rb_cData);
+  rb_undef_alloc_func(cCaller);
+
+  rb_define_method(cCaller, "to_a", Caller_to_a, 0);
+  rb_define_method(cCaller, "[]", Caller_aref, 1);
+  rb_define_method(cCaller, "size", Caller_size_m, 0);
+
+  rb_define_singleton_method(mPolyphony, "capture_caller", Polyphony_capture_caller, -1);
+  rb_define_singleton_method(mPolyphony, "caller_capture", Polyphony_caller_capture, 0);
+  rb_define_singleton_method(mPolyphony, "caller_capture=", Polyphony_caller_capture_set, 1);
+
+  SYM_full = ID2SYM(rb_intern("full"));
+  SYM_lazy = ID2SYM(rb_intern("lazy"));
+  SYM_off = ID2SYM(rb_intern("off"));
+  rb_global_variable(&SYM_full);
+  rb_global_variable(&SYM_lazy);
+  rb_global_variable(&SYM_off);
+}
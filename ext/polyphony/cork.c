@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "polyphony.h"
+
+// A cork coalesces writes to an IO into a single buffer (see IO#cork). The
+// buffer is written out using the backend once it reaches the cork's
+// threshold, or when explicitly flushed. Buffered data is also flushed once
+// the writing fiber reaches a switchpoint: a corked IO with buffered data is
+// added to the thread's list of corked IOs, which is flushed in
+// Thread_switch_fiber before switching fibers.
+//
+// Since fibers cannot be switched while switching fibers, the flush at a
+// switchpoint does not wait for the IO to become writable. Sockets are written
+// to using a nonblocking send. If the data cannot be written at once, or if
+// the IO is not a socket (whose fd mode the cork leaves untouched), the cork
+// is added to a list drained by the thread's cork flusher, a fiber created
+// once per thread on the first corked write, and resumed only when it has
+// corks to flush.
+
+#define CORK_DEFAULT_THRESHOLD 16384
+
+typedef struct cork {
+  VALUE io;
+  VALUE buffer;
+  // buffer written while the cork is being flushed, swapped with buffer
+  VALUE spare;
+  long threshold;
+  int is_socket;
+  // set while a fiber is writing buffered data
+  int flushing;
+  // set while in the thread's list of corked IOs
+  int pending;
+  // error encountered while flushing at a switchpoint, raised on next write
+  int error;
+} Cork_t;
+
+VALUE cCork = Qnil;
+static ID ID_errno;
+static ID ID_ivar_io;
+static ID ID_write;
+
+static void Cork_mark(void *ptr) {
+  Cork_t *cork = ptr;
+  rb_gc_mark(cork->io);
+  rb_gc_mark(cork->buffer);
+  rb_gc_mark(cork->spare);
+}
+
+static void Cork_free(void *ptr) {
+  xfree(ptr);
+}
+
+static size_t Cork_size(const void *ptr) {
+  return sizeof(Cork_t);
+}
+
+static const rb_data_type_t Cork_type = {
+  "Cork",
+  {Cork_mark, Cork_free, Cork_size,},
+  0, 0, 0
+};
+
+static VALUE Cork_allocate(VALUE klass) {
+  Cork_t *cork;
+
+  cork = ALLOC(Cork_t);
+  cork->io = Qnil;
+  cork->buffer = Qnil;
+  cork->spare = Qnil;
+  return TypedData_Wrap_Struct(klass, &Cork_type, cork);
+}
+
+#define GetCork(obj, cork) \
+  TypedData_Get_Struct((obj), Cork_t, &Cork_type, (cork))
+
+static void cork_flusher_setup(VALUE thread, thread_sched_t *sched);
+
+static VALUE Cork_initialize(int argc, VALUE *argv, VALUE self) {
+  Cork_t *cork;
+  VALUE io;
+  VALUE threshold;
+  rb_io_t *fptr;
+  struct stat st;
+  GetCork(self, cork);
+
+  rb_scan_args(argc, argv, "11", &io, &threshold);
+  cork->threshold = NIL_P(threshold) ? CORK_DEFAULT_THRESHOLD : NUM2LONG(threshold);
+  if (cork->threshold <= 0) rb_raise(rb_eArgError, "threshold must be positive");
+
+  cork->io = io;
+  cork->buffer = rb_str_buf_new(cork->threshold);
+  cork->spare = rb_str_buf_new(cork->threshold);
+  cork->flushing = 0;
+  cork->pending = 0;
+  cork->error = 0;
+
+  VALUE underlying_io = rb_ivar_get(io, ID_ivar_io);
+  if (underlying_io != Qnil) io = underlying_io;
+  GetOpenFile(rb_io_get_write_io(io), fptr);
+  cork->is_socket = fstat(fptr->fd, &st) == 0 && S_ISSOCK(st.st_mode);
+
+  return self;
+}
+
+static inline void cork_check_error(Cork_t *cork) {
+  int e = cork->error;
+  if (!e) return;
+
+  cork->error = 0;
+  rb_syserr_fail(e, strerror(e));
+}
+
+static VALUE cork_flush_body(VALUE arg) {
+  Cork_t *cork = (Cork_t *)arg;
+
+  while (RSTRING_LEN(cork->buffer) > 0) {
+    VALUE data = cork->buffer;
+    cork->buffer = cork->spare;
+    cork->spare = data;
+    rb_funcall(THREAD_BACKEND(rb_thread_current()), ID_write, 2, cork->io, data);
+    rb_str_set_len(data, 0);
+  }
+  return Qnil;
+}
+
+static VALUE cork_flush_ensure(VALUE arg) {
+  Cork_t *cork = (Cork_t *)arg;
+  cork->flushing = 0;
+  return Qnil;
+}
+
+// Writes out all buffered data, waiting for any flush already in progress.
+static void cork_flush(Cork_t *cork) {
+  while (cork->flushing) {
+    Fiber_make_runnable(rb_fiber_current(), Qnil);
+    VALUE ret = Thread_switch_fiber(rb_thread_current());
+    if (TEST_EXCEPTION(ret)) RAISE_EXCEPTION(ret);
+  }
+  cork_check_error(cork);
+  if (RSTRING_LEN(cork->buffer) == 0) return;
+
+  cork->flushing = 1;
+  rb_ensure(cork_flush_body, (VALUE)cork, cork_flush_ensure, (VALUE)cork);
+}
+
+VALUE Cork_write(int argc, VALUE *argv, VALUE self) {
+  Cork_t *cork;
+  long len = 0;
+  GetCork(self, cork);
+
+  cork_check_error(cork);
+  for (int i = 0; i < argc; i++) {
+    VALUE str = rb_obj_as_string(argv[i]);
+    rb_str_buf_append(cork->buffer, str);
+    len += RSTRING_LEN(str);
+  }
+
+  if (RSTRING_LEN(cork->buffer) >= cork->threshold)
+    cork_flush(cork);
+  else if (!cork->pending) {
+    VALUE thread = rb_thread_current();
+    thread_sched_t *sched = Thread_sched(thread);
+    if (sched->corked == Qnil) sched->corked = rb_ary_new();
+    if (sched->cork_flusher == Qnil) cork_flusher_setup(thread, sched);
+    rb_ary_push(sched->corked, self);
+    cork->pending = 1;
+  }
+
+  return LONG2NUM(len);
+}
+
+VALUE Cork_flush(VALUE self) {
+  Cork_t *cork;
+  GetCork(self, cork);
+
+  cork_flush(cork);
+  return self;
+}
+
+VALUE Cork_buffered(VALUE self) {
+  Cork_t *cork;
+  GetCork(self, cork);
+
+  return LONG2NUM(RSTRING_LEN(cork->buffer));
+}
+
+VALUE Cork_threshold(VALUE self) {
+  Cork_t *cork;
+  GetCork(self, cork);
+
+  return LONG2NUM(cork->threshold);
+}
+
+// Tries to write buffered data to a socket without blocking, returning 0 if
+// the write would block.
+static int cork_write_nowait(Cork_t *cork) {
+  rb_io_t *fptr;
+  VALUE io = cork->io;
+  VALUE underlying_io = rb_ivar_get(io, ID_ivar_io);
+  if (underlying_io != Qnil) io = underlying_io;
+  io = rb_io_get_write_io(io);
+  GetOpenFile(io, fptr);
+  if (fptr->fd < 0) return 1;
+
+  char *ptr = RSTRING_PTR(cork->buffer);
+  long left = RSTRING_LEN(cork->buffer);
+  while (left > 0) {
+    ssize_t n = send(fptr->fd, ptr, left, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      int e = errno;
+      if (e == EINTR) continue;
+      if (e == EAGAIN || e == EWOULDBLOCK) break;
+
+      cork->error = e;
+      left = 0;
+      break;
+    }
+    ptr += n;
+    left -= n;
+  }
+
+  long written = RSTRING_LEN(cork->buffer) - left;
+  if (written > 0) {
+    rb_str_modify(cork->buffer);
+    memmove(RSTRING_PTR(cork->buffer), RSTRING_PTR(cork->buffer) + written, left);
+    rb_str_set_len(cork->buffer, left);
+  }
+  return left == 0;
+}
+
+static VALUE cork_flusher_rescue(VALUE self, VALUE exception) {
+  Cork_t *cork;
+  GetCork(self, cork);
+
+  cork->error = rb_obj_is_kind_of(exception, rb_eSystemCallError) ?
+    NUM2INT(rb_funcall(exception, ID_errno, 0)) : EIO;
+  return Qnil;
+}
+
+// Flushes the corks added to the thread's list of flushes, then waits for more
+// to be added. Errors are kept until the next write or flush of the respective
+// cork, rather than raised in the flusher.
+static VALUE cork_flusher_body(RB_BLOCK_CALL_FUNC_ARGLIST(_, thread)) {
+  thread_sched_t *sched = Thread_sched(thread);
+
+  while (1) {
+    while (RARRAY_LEN(sched->cork_flushes) == 0) {
+      sched->cork_flusher_waiting = 1;
+      Thread_switch_fiber(thread);
+      sched->cork_flusher_waiting = 0;
+    }
+    VALUE self = rb_ary_shift(sched->cork_flushes);
+    rb_rescue2(Cork_flush, self, cork_flusher_rescue, self, rb_eStandardError, (VALUE)0);
+  }
+  return Qnil;
+}
+
+// Creates the given thread's cork flusher. The flusher is a plain fiber rather
+// than a child of the thread's main fiber, so it is not awaited or terminated
+// along with the main fiber's children. It is started on its first resume.
+static void cork_flusher_setup(VALUE thread, thread_sched_t *sched) {
+  sched->cork_flushes = rb_ary_new();
+  sched->cork_flusher = rb_fiber_new(cork_flusher_body, thread);
+  Fiber_set_thread(sched->cork_flusher, thread);
+  sched->cork_flusher_waiting = 1;
+}
+
+// Flushes the given thread's list of corked IOs. Called from
+// Thread_switch_fiber, so no fiber is switched or spun here.
+void Cork_flush_pending(thread_sched_t *sched) {
+  VALUE corked = sched->corked;
+
+  while (RARRAY_LEN(corked) > 0) {
+    VALUE self = rb_ary_pop(corked);
+    Cork_t *cork;
+    GetCork(self, cork);
+
+    cork->pending = 0;
+    if (cork->flushing || RSTRING_LEN(cork->buffer) == 0) continue;
+    if (cork->is_socket && cork_write_nowait(cork)) continue;
+
+    rb_ary_push(sched->cork_flushes, self);
+    if (sched->cork_flusher_waiting) {
+      sched->cork_flusher_waiting = 0;
+      Fiber_make_runnable(sched->cork_flusher, Qnil);
+    }
+  }
+}
+
+// Empties the given thread's lists of corked IOs without flushing them, and
+// drops its cork flusher (used after forking).
+void Cork_clear_pending(thread_sched_t *sched) {
+  if (sched->corked != Qnil) {
+    while (RARRAY_LEN(sched->corked) > 0) {
+      Cork_t *cork;
+      GetCork(rb_ary_pop(sched->corked), cork);
+      cork->pending = 0;
+    }
+  }
+  sched->cork_flushes = Qnil;
+  sched->cork_flusher = Qnil;
+  sched->cork_flusher_waiting = 0;
+}
+
+void Init_Cork() {
+  cCork = rb_define_class_under(mPolyphony, "Cork", rb_cData);
+  rb_define_alloc_func(cCork, Cork_allocate);
+
+  rb_define_method(cCork, "initialize", Cork_initialize, -1);
+  rb_define_method(cCork, "write", Cork_write, -1);
+  rb_define_method(cCork, "flush", Cork_flush, 0);
+  rb_define_method(cCork, "buffered", Cork_buffered, 0);
+  rb_define_method(cCork, "threshold", Cork_threshold, 0);
+
+  ID_errno = rb_intern("errno");
+  ID_ivar_io = rb_intern("@io");
+  ID_write = rb_intern("write");
+}
@@ -1,15 +1,35 @@
 #include "polyphony.h"
 #include "ring_buffer.h"
 
+// An event may be awaited by any number of fibers, kept in an intrusive list.
+// By default, a signal wakes up the first waiting fiber and is otherwise lost.
+// Events may also be created with a reset mode, in which case a signal that
+// does not wake up any fiber is kept:
+//
+// - :auto - the next call to #await consumes the signal.
+// - :manual - the event stays signalled, waking up all current and future
+//   waiters, until it is reset.
+enum event_mode {
+  EVENT_MODE_NONE,
+  EVENT_MODE_AUTO,
+  EVENT_MODE_MANUAL
+};
+
 typedef struct event {
-  VALUE waiting_fiber;
+  fiber_list_t waiters;
+  enum event_mode mode;
+  int signalled;
+  VALUE value;
 } Event_t;
 
 VALUE cEvent = Qnil;
+VALUE SYM_auto;
+VALUE SYM_manual;
 
 static void Event_mark(void *ptr) {
   Event_t *event = ptr;
-  rb_gc_mark(event->waiting_fiber);
+  fiber_list_mark(&event->waiters);
+  rb_gc_mark(event->value);
 }
 
 static void Event_free(void *ptr) {
@@ -36,38 +56,100 @@ static VALUE Event_allocate(VALUE klass) {
 #define GetEvent(obj, event) \
   TypedData_Get_Struct((obj), Event_t, &Event_type, (event))
 
-static VALUE Event_initialize(VALUE self) {
+static VALUE Event_initialize(int argc, VALUE *argv, VALUE self) {
   Event_t *event;
+  VALUE mode;
   GetEvent(self, event);
 
-  event->waiting_fiber = Qnil;
+  rb_scan_args(argc, argv, "01", &mode);
+  if (mode == Qnil) event->mode = EVENT_MODE_NONE;
+  else if (mode == SYM_auto) event->mode = EVENT_MODE_AUTO;
+  else if (mode == SYM_manual) event->mode = EVENT_MODE_MANUAL;
+  else rb_raise(rb_eArgError, "invalid event mode (expected :auto or :manual)");
+
+  fiber_list_init(&event->waiters);
+  event->signalled = 0;
+  event->value = Qnil;
 
   return self;
 }
 
+static inline void event_wake_all(Event_t *event, VALUE value) {
+  while (event->waiters.count > 0)
+    Fiber_make_runnable(fiber_list_shift(&event->waiters), value);
+}
+
 VALUE Event_signal(int argc, VALUE *argv, VALUE self) {
   VALUE value = argc > 0 ? argv[0] : Qnil;
   Event_t *event;
   GetEvent(self, event);
 
-  if (event->waiting_fiber != Qnil) {
-    Fiber_make_runnable(event->waiting_fiber, value);
-    event->waiting_fiber = Qnil;
+  event->value = value;
+  if (event->mode == EVENT_MODE_MANUAL) {
+    event->signalled = 1;
+    event_wake_all(event, value);
   }
+  else if (event->waiters.count > 0)
+    Fiber_make_runnable(fiber_list_shift(&event->waiters), value);
+  else if (event->mode == EVENT_MODE_AUTO)
+    event->signalled = 1;
+  return self;
+}
+
+// Wakes up all waiting fibers in a single pass.
+VALUE Event_broadcast(int argc, VALUE *argv, VALUE self) {
+  VALUE value = argc > 0 ? argv[0] : Qnil;
+  Event_t *event;
+  GetEvent(self, event);
+
+  event->value = value;
+  if (event->mode == EVENT_MODE_MANUAL ||
+      (event->mode == EVENT_MODE_AUTO && event->waiters.count == 0))
+    event->signalled = 1;
+  event_wake_all(event, value);
+  return self;
+}
+
+VALUE Event_reset(VALUE self) {
+  Event_t *event;
+  GetEvent(self, event);
+
+  event->signalled = 0;
+  event->value = Qnil;
   return self;
 }
 
+VALUE Event_signalled_p(VALUE self) {
+  Event_t *event;
+  GetEvent(self, event);
+
+  return event->signalled ? Qtrue : Qfalse;
+}
+
 VALUE Event_await(VALUE self) {
   Event_t *event;
   GetEvent(self, event);
 
-  if (event->waiting_fiber != Qnil)
-    rb_raise(rb_eRuntimeError, "Event is already awaited by another fiber");
+  if (event->signalled) {
+    VALUE value = event->value;
+    if (event->mode == EVENT_MODE_AUTO) {
+      event->signalled = 0;
+      event->value = Qnil;
+    }
+    return value;
+  }
 
-  VALUE backend = rb_ivar_get(rb_thread_current(), ID_ivar_backend);
-  event->waiting_fiber = rb_fiber_current();
+  VALUE backend = THREAD_BACKEND(rb_thread_current());
+  fiber_sched_t *sched = Fiber_sched(rb_fiber_current());
+  fiber_list_push(&event->waiters, &sched->wait_node);
   VALUE switchpoint_result = __BACKEND__.wait_event(backend, Qnil);
-  event->waiting_fiber = Qnil;
+  if (sched->wait_node.list) fiber_list_delete(&event->waiters, &sched->wait_node);
+  else if (event->mode == EVENT_MODE_AUTO && TEST_EXCEPTION(switchpoint_result)) {
+    // the fiber was signalled but is resumed with an exception, so the signal
+    // is passed on
+    VALUE args[1] = { event->value };
+    Event_signal(1, args, self);
+  }
 
   TEST_RESUME_EXCEPTION(switchpoint_result);
   RB_GC_GUARD(backend);
@@ -76,11 +158,27 @@ VALUE Event_await(VALUE self) {
   return switchpoint_result;
 }
 
+VALUE Event_waiting_count(VALUE self) {
+  Event_t *event;
+  GetEvent(self, event);
+
+  return LONG2NUM(event->waiters.count);
+}
+
 void Init_Event() {
   cEvent = rb_define_class_under(mPolyphony, "Event", rb_cData);
   rb_define_alloc_func(cEvent, Event_allocate);
 
-  rb_define_method(cEvent, "initialize", Event_initialize, 0);
+  rb_define_method(cEvent, "initialize", Event_initialize, -1);
   rb_define_method(cEvent, "await", Event_await, 0);
   rb_define_method(cEvent, "signal", Event_signal, -1);
+  rb_define_method(cEvent, "broadcast", Event_broadcast, -1);
+  rb_define_method(cEvent, "reset", Event_reset, 0);
+  rb_define_method(cEvent, "signalled?", Event_signalled_p, 0);
+  rb_define_method(cEvent, "waiting_count", Event_waiting_count, 0);
+
+  SYM_auto = ID2SYM(rb_intern("auto"));
+  SYM_manual = ID2SYM(rb_intern("manual"));
+  rb_global_variable(&SYM_auto);
+  rb_global_variable(&SYM_manual);
 }
@@ -5,6 +5,24 @@ require "rubygems"
 require "mkmf"
 
 have_header("unistd.h")
+have_func("rb_fiber_transfer", "ruby.h")
+
+# The backend is selected at build time, e.g.:
+#
+#   POLYPHONY_BACKEND=io_uring gem install polyphony
+#   rake compile -- --with-backend=io_uring
+backend = with_config("backend", ENV["POLYPHONY_BACKEND"] || "libev")
+case backend
+when "io_uring"
+  unless RUBY_PLATFORM =~ /linux/ && have_header("linux/io_uring.h")
+    abort "The io_uring backend requires Linux 5.6 or newer"
+  end
+  $defs << "-DPOLYPHONY_BACKEND_IO_URING"
+when "libev"
+  $defs << "-DPOLYPHONY_BACKEND_LIBEV"
+else
+  abort "Unknown backend #{backend.inspect} (expected libev or io_uring)"
+end
 
 $defs << "-DEV_USE_LINUXAIO"     if have_header("linux/aio_abi.h")
 $defs << "-DEV_USE_SELECT"       if have_header("sys/select.h")
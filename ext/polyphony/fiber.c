@@ -19,9 +19,49 @@ VALUE SYM_fiber_schedule;
 VALUE SYM_fiber_switchpoint;
 VALUE SYM_fiber_terminate;
 
+static void FiberSched_mark(void *ptr) {
+  fiber_sched_t *sched = ptr;
+  rb_gc_mark(sched->thread);
+  rb_gc_mark(sched->runnable_value);
+}
+
+static const rb_data_type_t FiberSched_type = {
+  "FiberSched",
+  {FiberSched_mark, RUBY_TYPED_DEFAULT_FREE, 0,},
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+// Returns the scheduling state for the given fiber, creating it if needed
+fiber_sched_t *Fiber_sched(VALUE fiber) {
+  VALUE obj = rb_ivar_get(fiber, ID_sched);
+  fiber_sched_t *sched;
+
+  if (obj != Qnil) return RTYPEDDATA_DATA(obj);
+
+  obj = TypedData_Make_Struct(0, fiber_sched_t, &FiberSched_type, sched);
+  sched->thread = Qnil;
+  sched->thread_sched = NULL;
+  sched->runnable_value = Qnil;
+  fiber_node_init(&sched->run_node, fiber);
+  fiber_node_init(&sched->wait_node, fiber);
+  rb_ivar_set(fiber, ID_sched, obj);
+  return sched;
+}
+
+static VALUE Fiber_thread(VALUE self) {
+  return Fiber_sched(self)->thread;
+}
+
+VALUE Fiber_set_thread(VALUE self, VALUE thread) {
+  fiber_sched_t *sched = Fiber_sched(self);
+  sched->thread = thread;
+  sched->thread_sched = NIL_P(thread) ? NULL : Thread_sched(thread);
+  return thread;
+}
+
 static VALUE Fiber_safe_transfer(int argc, VALUE *argv, VALUE self) {
   VALUE arg = (argc == 0) ? Qnil : argv[0];
-  VALUE ret = rb_funcall(self, ID_transfer, 1, arg);
+  VALUE ret = FIBER_TRANSFER(self, arg);
 
   TEST_RESUME_EXCEPTION(ret);
   RB_GC_GUARD(ret);
@@ -49,15 +89,15 @@ static VALUE Fiber_state(VALUE self) {
   if (!rb_fiber_alive_p(self) || (rb_ivar_get(self, ID_ivar_running) == Qfalse))
     return SYM_dead;
   if (rb_fiber_current() == self) return SYM_running;
-  if (rb_ivar_get(self, ID_runnable) != Qnil) return SYM_runnable;
+  if (FIBER_SCHED_RUNNABLE(Fiber_sched(self))) return SYM_runnable;
 
   return SYM_waiting;
 }
 
 void Fiber_make_runnable(VALUE fiber, VALUE value) {
-  VALUE thread = rb_ivar_get(fiber, ID_ivar_thread);
-  if (thread != Qnil) {
-    Thread_schedule_fiber(thread, fiber, value);
+  fiber_sched_t *sched = Fiber_sched(fiber);
+  if (sched->thread != Qnil) {
+    Thread_schedule_fiber_sched(sched, fiber, value);
   }
   else {
     rb_warn("No thread set for fiber (fiber, value, caller):");
@@ -120,6 +160,8 @@ void Init_Fiber() {
   rb_define_method(cFiber, "safe_transfer", Fiber_safe_transfer, -1);
   rb_define_method(cFiber, "schedule", Fiber_schedule, -1);
   rb_define_method(cFiber, "state", Fiber_state, 0);
+  rb_define_method(cFiber, "thread", Fiber_thread, 0);
+  rb_define_method(cFiber, "thread=", Fiber_set_thread, 1);
   rb_define_method(cFiber, "auto_watcher", Fiber_auto_watcher, 0);
 
   rb_define_method(cFiber, "await", Fiber_await, 0);
@@ -0,0 +1,95 @@
+#ifndef FIBER_LIST_H
+#define FIBER_LIST_H
+
+#include "ruby.h"
+
+// An intrusive doubly linked list of fibers, used for run queues and for
+// fibers waiting on a queue. List nodes are embedded in the fibers' scheduling
+// state, so that insertion at either end, removal and membership checks are
+// all O(1). A fiber can be in at most one list per node. Lists mark the fibers
+// they contain, which keeps the nodes alive while they are in a list.
+
+struct fiber_list;
+
+typedef struct fiber_node {
+  struct fiber_node *prev;
+  struct fiber_node *next;
+  struct fiber_list *list;
+  VALUE fiber;
+} fiber_node_t;
+
+typedef struct fiber_list {
+  fiber_node_t *head;
+  fiber_node_t *tail;
+  long count;
+} fiber_list_t;
+
+static inline void fiber_node_init(fiber_node_t *node, VALUE fiber) {
+  node->prev = node->next = NULL;
+  node->list = NULL;
+  node->fiber = fiber;
+}
+
+static inline void fiber_list_init(fiber_list_t *list) {
+  list->head = list->tail = NULL;
+  list->count = 0;
+}
+
+static inline int fiber_list_includes(fiber_list_t *list, fiber_node_t *node) {
+  return node->list == list;
+}
+
+static inline void fiber_list_push(fiber_list_t *list, fiber_node_t *node) {
+  node->list = list;
+  node->next = NULL;
+  node->prev = list->tail;
+  if (list->tail) list->tail->next = node;
+  else list->head = node;
+  list->tail = node;
+  list->count++;
+}
+
+static inline void fiber_list_unshift(fiber_list_t *list, fiber_node_t *node) {
+  node->list = list;
+  node->prev = NULL;
+  node->next = list->head;
+  if (list->head) list->head->prev = node;
+  else list->tail = node;
+  list->head = node;
+  list->count++;
+}
+
+// Removes the given node from the list. Does nothing if the node is not in the
+// list.
+static inline void fiber_list_delete(fiber_list_t *list, fiber_node_t *node) {
+  if (node->list != list) return;
+
+  if (node->prev) node->prev->next = node->next;
+  else list->head = node->next;
+  if (node->next) node->next->prev = node->prev;
+  else list->tail = node->prev;
+  node->prev = node->next = NULL;
+  node->list = NULL;
+  list->count--;
+}
+
+// Removes the first node from the list, returning its fiber, or nil if the
+// list is empty.
+static inline VALUE fiber_list_shift(fiber_list_t *list) {
+  fiber_node_t *node = list->head;
+  if (!node) return Qnil;
+
+  fiber_list_delete(list, node);
+  return node->fiber;
+}
+
+static inline void fiber_list_clear(fiber_list_t *list) {
+  while (list->head) fiber_list_delete(list, list->head);
+}
+
+static inline void fiber_list_mark(fiber_list_t *list) {
+  for (fiber_node_t *node = list->head; node; node = node->next)
+    rb_gc_mark(node->fiber);
+}
+
+#endif /* FIBER_LIST_H */
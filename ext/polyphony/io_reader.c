@@ -0,0 +1,256 @@
+#include "polyphony.h"
+#include "ruby/encoding.h"
+
+// An IO reader implements buffered reads of lines, characters and bytes on
+// top of the backend's read method, and is attached lazily to each IO read
+// using IO#gets, IO#getc etc. Buffered data is kept in a single string, with
+// unread data between a head offset and the end of the string, so consuming a
+// line only advances the head offset. Data is always read directly into the
+// tail of the buffer, after any unread data has been moved to its start.
+
+#define IO_READER_CHUNK_LEN 8192
+#define IO_READER_MAX_IDLE_CAPA (1 << 16)
+
+typedef struct io_reader {
+  VALUE io;
+  VALUE buffer;
+  long head;
+} IOReader_t;
+
+VALUE cIOReader = Qnil;
+static ID ID_read;
+
+static void IOReader_mark(void *ptr) {
+  IOReader_t *reader = ptr;
+  rb_gc_mark(reader->io);
+  rb_gc_mark(reader->buffer);
+}
+
+static void IOReader_free(void *ptr) {
+  xfree(ptr);
+}
+
+static size_t IOReader_size(const void *ptr) {
+  return sizeof(IOReader_t);
+}
+
+static const rb_data_type_t IOReader_type = {
+  "IOReader",
+  {IOReader_mark, IOReader_free, IOReader_size,},
+  0, 0, 0
+};
+
+static VALUE IOReader_allocate(VALUE klass) {
+  IOReader_t *reader;
+
+  reader = ALLOC(IOReader_t);
+  reader->io = Qnil;
+  reader->buffer = Qnil;
+  reader->head = 0;
+  return TypedData_Wrap_Struct(klass, &IOReader_type, reader);
+}
+
+#define GetIOReader(obj, reader) \
+  TypedData_Get_Struct((obj), IOReader_t, &IOReader_type, (reader))
+
+static VALUE IOReader_initialize(VALUE self, VALUE io) {
+  IOReader_t *reader;
+  GetIOReader(self, reader);
+
+  reader->io = io;
+  reader->buffer = rb_str_buf_new(IO_READER_CHUNK_LEN);
+  reader->head = 0;
+
+  return self;
+}
+
+#define READER_AVAIL(reader) (RSTRING_LEN((reader)->buffer) - (reader)->head)
+#define READER_PTR(reader) (RSTRING_PTR((reader)->buffer) + (reader)->head)
+
+// Reads more data into the buffer, returning 0 on EOF. Pointers into the
+// buffer are invalidated, since the buffer may be moved or reallocated.
+static int io_reader_fill(IOReader_t *reader) {
+  VALUE backend = THREAD_BACKEND(rb_thread_current());
+  VALUE buffer = reader->buffer;
+  long avail = READER_AVAIL(reader);
+
+  rb_str_modify(buffer);
+  if (avail == 0) {
+    // The length is reset before reading, so nothing stale is left in the
+    // buffer if the read is interrupted
+    if (rb_str_capacity(buffer) > IO_READER_MAX_IDLE_CAPA)
+      rb_str_resize(buffer, 0);
+    else
+      rb_str_set_len(buffer, 0);
+    reader->head = 0;
+  }
+  else if (reader->head > 0) {
+    char *ptr = RSTRING_PTR(buffer);
+    memmove(ptr, ptr + reader->head, avail);
+    rb_str_set_len(buffer, avail);
+    reader->head = 0;
+  }
+
+  VALUE result = rb_funcall(backend, ID_read, 5, reader->io, buffer, INT2NUM(IO_READER_CHUNK_LEN), Qfalse, INT2NUM(-1));
+  return result != Qnil;
+}
+
+// Skips newlines at the head of the buffer, reading more data as needed.
+// Returns 0 on EOF.
+static int io_reader_skip_newlines(IOReader_t *reader) {
+  while (1) {
+    while (READER_AVAIL(reader) > 0 && READER_PTR(reader)[0] == '\n') reader->head++;
+    if (READER_AVAIL(reader) > 0) return 1;
+    if (!io_reader_fill(reader)) return 0;
+  }
+}
+
+// Removes len bytes from the head of the buffer, returning them as a new
+// string without the last drop_len bytes.
+static inline VALUE io_reader_take(IOReader_t *reader, long len, long drop_len) {
+  VALUE str = rb_str_new(READER_PTR(reader), len - drop_len);
+  rb_enc_copy(str, reader->buffer);
+  reader->head += len;
+  return str;
+}
+
+static inline long io_reader_find(const char *ptr, long len, const char *sep, long sep_len) {
+  const char *start = ptr;
+  const char *end = ptr + len - sep_len + 1;
+
+  while (ptr < end) {
+    ptr = memchr(ptr, sep[0], end - ptr);
+    if (!ptr) return -1;
+    if (sep_len == 1 || !memcmp(ptr + 1, sep + 1, sep_len - 1)) return ptr - start;
+    ptr++;
+  }
+  return -1;
+}
+
+static VALUE io_reader_read_all(IOReader_t *reader, long limit) {
+  while (limit < 0 || READER_AVAIL(reader) < limit)
+    if (!io_reader_fill(reader)) break;
+
+  long avail = READER_AVAIL(reader);
+  if (avail == 0) return Qnil;
+  return io_reader_take(reader, (limit >= 0 && limit < avail) ? limit : avail, 0);
+}
+
+// Reads a line terminated by the given separator, with the same arguments as
+// IO#gets. An empty separator (paragraph mode) is treated as "\n\n", with
+// newlines preceding the paragraph and any additional buffered newlines
+// following it skipped.
+VALUE IOReader_gets(VALUE self, VALUE sep, VALUE limit, VALUE chomp) {
+  IOReader_t *reader;
+  GetIOReader(self, reader);
+
+  long limit_len = NIL_P(limit) ? -1 : NUM2LONG(limit);
+  if (limit_len == 0) return rb_enc_str_new(0, 0, rb_enc_get(reader->buffer));
+  if (NIL_P(sep)) return io_reader_read_all(reader, limit_len);
+
+  StringValue(sep);
+  int paragraph = RSTRING_LEN(sep) == 0;
+  if (paragraph) {
+    if (!io_reader_skip_newlines(reader)) return Qnil;
+    sep = rb_str_new_literal("\n\n");
+  }
+  const char *sep_ptr = RSTRING_PTR(sep);
+  long sep_len = RSTRING_LEN(sep);
+  long scanned = 0;
+
+  while (1) {
+    long avail = READER_AVAIL(reader);
+    long search_len = (limit_len >= 0 && limit_len < avail) ? limit_len : avail;
+
+    long idx = io_reader_find(READER_PTR(reader) + scanned, search_len - scanned, sep_ptr, sep_len);
+    if (idx >= 0) {
+      long len = scanned + idx + sep_len;
+      long drop_len = 0;
+      if (RTEST(chomp)) {
+        drop_len = sep_len;
+        if (sep_len == 1 && sep_ptr[0] == '\n' && len > 1 && READER_PTR(reader)[len - 2] == '\r')
+          drop_len++;
+      }
+      VALUE line = io_reader_take(reader, len, drop_len);
+      if (paragraph)
+        while (READER_AVAIL(reader) > 0 && READER_PTR(reader)[0] == '\n') reader->head++;
+      RB_GC_GUARD(sep);
+      return line;
+    }
+
+    if (limit_len >= 0 && avail >= limit_len) return io_reader_take(reader, limit_len, 0);
+    // a separator may straddle the end of the data buffered so far
+    scanned = avail - sep_len + 1;
+    if (scanned < 0) scanned = 0;
+
+    if (!io_reader_fill(reader))
+      return avail ? io_reader_take(reader, avail, 0) : Qnil;
+  }
+}
+
+// Reads a single character according to the IO's read encoding.
+VALUE IOReader_getc(VALUE self) {
+  IOReader_t *reader;
+  GetIOReader(self, reader);
+
+  while (1) {
+    long avail = READER_AVAIL(reader);
+    if (avail > 0) {
+      char *ptr = READER_PTR(reader);
+      int n = rb_enc_precise_mbclen(ptr, ptr + avail, rb_enc_get(reader->buffer));
+      if (MBCLEN_CHARFOUND_P(n)) return io_reader_take(reader, MBCLEN_CHARFOUND_LEN(n), 0);
+      if (!MBCLEN_NEEDMORE_P(n)) return io_reader_take(reader, 1, 0);
+    }
+
+    if (!io_reader_fill(reader))
+      return avail ? io_reader_take(reader, 1, 0) : Qnil;
+  }
+}
+
+VALUE IOReader_getbyte(VALUE self) {
+  IOReader_t *reader;
+  GetIOReader(self, reader);
+
+  if (READER_AVAIL(reader) == 0 && !io_reader_fill(reader)) return Qnil;
+
+  unsigned char byte = READER_PTR(reader)[0];
+  reader->head++;
+  return INT2FIX(byte);
+}
+
+// Removes and returns up to max bytes of buffered data (all buffered data if
+// max is nil), or nil if no data is buffered. Used for reads that bypass the
+// reader, such as IO#read and IO#readpartial.
+VALUE IOReader_consume(int argc, VALUE *argv, VALUE self) {
+  IOReader_t *reader;
+  VALUE max;
+  GetIOReader(self, reader);
+
+  rb_scan_args(argc, argv, "01", &max);
+  long avail = READER_AVAIL(reader);
+  if (avail == 0) return Qnil;
+
+  long len = NIL_P(max) ? avail : NUM2LONG(max);
+  return io_reader_take(reader, len < avail ? len : avail, 0);
+}
+
+VALUE IOReader_buffered(VALUE self) {
+  IOReader_t *reader;
+  GetIOReader(self, reader);
+
+  return LONG2NUM(READER_AVAIL(reader));
+}
+
+void Init_IOReader() {
+  cIOReader = rb_define_class_under(mPolyphony, "IOReader", rb_cData);
+  rb_define_alloc_func(cIOReader, IOReader_allocate);
+
+  rb_define_method(cIOReader, "initialize", IOReader_initialize, 1);
+  rb_define_method(cIOReader, "gets", IOReader_gets, 3);
+  rb_define_method(cIOReader, "getc", IOReader_getc, 0);
+  rb_define_method(cIOReader, "getbyte", IOReader_getbyte, 0);
+  rb_define_method(cIOReader, "consume", IOReader_consume, -1);
+  rb_define_method(cIOReader, "buffered", IOReader_buffered, 0);
+
+  ID_read = rb_intern("read");
+}
@@ -0,0 +1,1789 @@
+#ifdef POLYPHONY_BACKEND_IO_URING
+
+#define _GNU_SOURCE 1 // for pipe2
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "backend_common.h"
+#include "uring.h"
+#include "ruby/thread.h"
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+VALUE cTCPSocket;
+VALUE cAddrinfo;
+
+// Number of SQ entries. SQEs are prepared by fibers and submitted in batches,
+// so this bounds the number of operations submitted in a single syscall, not
+// the number of operations in flight.
+#define IO_URING_RING_SIZE 256
+
+// user_data values that do not point to an op context
+#define USER_DATA_IGNORE  0
+#define USER_DATA_WAKEUP  1
+
+enum op_type {
+  OP_READ,
+  OP_WRITE,
+  OP_WRITEV,
+  OP_ACCEPT,
+  OP_CONNECT,
+  OP_RECVMSG,
+  OP_SENDMSG,
+  OP_POLL,
+  OP_TIMEOUT,
+  OP_DEADLINE,
+  OP_SPLICE
+};
+
+// An op context tracks a single submitted operation. Contexts are kept in a
+// per-backend store and reused, since a context must stay valid until its
+// completion is reaped, even if the waiting fiber has been interrupted.
+typedef struct op_context {
+  struct op_context *prev;
+  struct op_context *next;
+  enum op_type type;
+  VALUE fiber;
+  int result;
+  int completed;
+  struct __kernel_timespec ts;
+  // for OP_DEADLINE, the exception (or exception class and value) to be
+  // raised in the fiber on expiry
+  VALUE exception;
+  VALUE value;
+} op_context_t;
+
+typedef struct op_context_store {
+  op_context_t *available;
+  op_context_t *taken;
+} op_context_store_t;
+
+static op_context_t *context_store_acquire(op_context_store_t *store, enum op_type type) {
+  op_context_t *ctx = store->available;
+
+  if (ctx) store->available = ctx->next;
+  else {
+    ctx = malloc(sizeof(op_context_t));
+    if (!ctx) rb_memerror();
+  }
+
+  ctx->type = type;
+  ctx->fiber = rb_fiber_current();
+  ctx->result = 0;
+  ctx->completed = 0;
+  ctx->exception = ctx->value = Qnil;
+
+  ctx->prev = NULL;
+  ctx->next = store->taken;
+  if (store->taken) store->taken->prev = ctx;
+  store->taken = ctx;
+  return ctx;
+}
+
+static void context_store_release(op_context_store_t *store, op_context_t *ctx) {
+  if (ctx->next) ctx->next->prev = ctx->prev;
+  if (ctx->prev) ctx->prev->next = ctx->next;
+  else store->taken = ctx->next;
+
+  ctx->fiber = Qnil;
+  ctx->exception = ctx->value = Qnil;
+  ctx->next = store->available;
+  store->available = ctx;
+}
+
+static void context_store_mark(op_context_store_t *store) {
+  for (op_context_t *ctx = store->taken; ctx; ctx = ctx->next) {
+    rb_gc_mark(ctx->fiber);
+    rb_gc_mark(ctx->exception);
+    rb_gc_mark(ctx->value);
+  }
+}
+
+static void context_store_free_list(op_context_t *ctx) {
+  while (ctx) {
+    op_context_t *next = ctx->next;
+    free(ctx);
+    ctx = next;
+  }
+}
+
+// Marks all taken contexts as cancelled, for operations whose completions will
+// never arrive. The contexts are released by their fibers as usual.
+static void context_store_orphan(op_context_store_t *store) {
+  for (op_context_t *ctx = store->taken; ctx; ctx = ctx->next) {
+    ctx->result = -ECANCELED;
+    ctx->completed = 1;
+  }
+}
+
+static void context_store_free(op_context_store_t *store) {
+  context_store_free_list(store->available);
+  context_store_free_list(store->taken);
+  store->available = store->taken = NULL;
+}
+
+typedef struct IOUringBackend_t {
+  uring_t ring;
+  op_context_store_t store;
+  int ref_count;
+  int run_no_wait_count;
+  unsigned int pending_sqes;
+  int currently_polling;
+  int event_fd;
+  int event_fd_armed;
+  double now;
+} IOUringBackend_t;
+
+static void IOUringBackend_mark(void *ptr) {
+  IOUringBackend_t *backend = ptr;
+  context_store_mark(&backend->store);
+}
+
+static void io_uring_backend_close(IOUringBackend_t *backend) {
+  uring_exit(&backend->ring);
+  if (backend->event_fd >= 0) {
+    close(backend->event_fd);
+    backend->event_fd = -1;
+  }
+}
+
+static void IOUringBackend_free(void *ptr) {
+  IOUringBackend_t *backend = ptr;
+  io_uring_backend_close(backend);
+  context_store_free(&backend->store);
+  xfree(ptr);
+}
+
+static size_t IOUringBackend_size(const void *ptr) {
+  return sizeof(IOUringBackend_t);
+}
+
+static const rb_data_type_t IOUringBackend_type = {
+    "IOUring",
+    {IOUringBackend_mark, IOUringBackend_free, IOUringBackend_size,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE IOUringBackend_allocate(VALUE klass) {
+  IOUringBackend_t *backend = ALLOC(IOUringBackend_t);
+
+  backend->ring.ring_fd = -1;
+  backend->event_fd = -1;
+  backend->store.available = backend->store.taken = NULL;
+  return TypedData_Wrap_Struct(klass, &IOUringBackend_type, backend);
+}
+
+#define GetIOUringBackend(obj, backend) \
+  TypedData_Get_Struct((obj), IOUringBackend_t, &IOUringBackend_type, (backend))
+
+// The loop time is read from the monotonic clock and cached the same way as
+// libev's loop time, and is updated on each poll.
+static inline void io_uring_backend_update_now(IOUringBackend_t *backend) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  backend->now = ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void io_uring_backend_setup(IOUringBackend_t *backend) {
+  int ret = uring_init(&backend->ring, IO_URING_RING_SIZE);
+  if (ret < 0) rb_syserr_fail(-ret, "io_uring_setup");
+
+  backend->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (backend->event_fd < 0) {
+    int e = errno;
+    uring_exit(&backend->ring);
+    rb_syserr_fail(e, strerror(e));
+  }
+
+  backend->pending_sqes = 0;
+  backend->currently_polling = 0;
+  backend->event_fd_armed = 0;
+  io_uring_backend_update_now(backend);
+}
+
+static VALUE IOUringBackend_initialize(VALUE self) {
+  IOUringBackend_t *backend;
+  GetIOUringBackend(self, backend);
+
+  io_uring_backend_setup(backend);
+  backend->ref_count = 0;
+  backend->run_no_wait_count = 0;
+
+  return Qnil;
+}
+
+VALUE IOUringBackend_finalize(VALUE self) {
+  IOUringBackend_t *backend;
+  GetIOUringBackend(self, backend);
+
+  io_uring_backend_close(backend);
+  return self;
+}
+
+VALUE IOUringBackend_post_fork(VALUE self) {
+  IOUringBackend_t *backend;
+  GetIOUringBackend(self, backend);
+
+  // The ring and the eventfd are shared with the parent process, so we replace
+  // them with fresh ones. Any operations still tracked in the store belong to
+  // fibers of the parent process, and their completions will never arrive.
+  // Their contexts are kept in the store, since those fibers may still release
+  // them (e.g. in ensure blocks), and are freed along with the backend.
+  io_uring_backend_close(backend);
+  context_store_orphan(&backend->store);
+  io_uring_backend_setup(backend);
+
+  return self;
+}
+
+VALUE IOUringBackend_ref(VALUE self) {
+  IOUringBackend_t *backend;
+  GetIOUringBackend(self, backend);
+
+  backend->ref_count++;
+  return self;
+}
+
+VALUE IOUringBackend_unref(VALUE self) {
+  IOUringBackend_t *backend;
+  GetIOUringBackend(self, backend);
+
+  backend->ref_count--;
+  return self;
+}
+
+int IOUringBackend_ref_count(VALUE self) {
+  IOUringBackend_t *backend;
+  GetIOUringBackend(self, backend);
+
+  return backend->ref_count;
+}
+
+void IOUringBackend_reset_ref_count(VALUE self) {
+  IOUringBackend_t *backend;
+  GetIOUringBackend(self, backend);
+
+  backend->ref_count = 0;
+}
+
+VALUE IOUringBackend_now(VALUE self) {
+  IOUringBackend_t *backend;
+  GetIOUringBackend(self, backend);
+  return DBL2NUM(backend->now);
+}
+
+VALUE IOUringBackend_pending_count(VALUE self) {
+  IOUringBackend_t *backend;
+  GetIOUringBackend(self, backend);
+
+  return INT2NUM(uring_cq_ready(&backend->ring));
+}
+
+// Submits all prepared SQEs without waiting for completions
+static void io_uring_backend_submit(IOUringBackend_t *backend) {
+  unsigned to_submit;
+  int ret;
+
+  if (backend->ring.ring_fd < 0) return;
+
+  to_submit = uring_flush_sq(&backend->ring);
+  ret = uring_enter(&backend->ring, to_submit, 0, 0);
+
+  backend->pending_sqes = (ret >= 0) ? to_submit - ret : to_submit;
+}
+
+static struct io_uring_sqe *io_uring_backend_get_sqe(IOUringBackend_t *backend) {
+  struct io_uring_sqe *sqe;
+
+  if (backend->ring.ring_fd < 0) rb_raise(rb_eIOError, "Backend is finalized");
+
+  sqe = uring_get_sqe(&backend->ring);
+  if (sqe) return sqe;
+
+  // the submission queue is full, so we submit right away to make room
+  io_uring_backend_submit(backend);
+  sqe = uring_get_sqe(&backend->ring);
+  if (!sqe) rb_raise(rb_eRuntimeError, "io_uring submission queue overflow");
+  return sqe;
+}
+
+static inline void io_uring_backend_defer_submit(IOUringBackend_t *backend) {
+  backend->pending_sqes++;
+}
+
+static void io_uring_backend_arm_wakeup(IOUringBackend_t *backend) {
+  struct io_uring_sqe *sqe = io_uring_backend_get_sqe(backend);
+
+  uring_prep_rw(IORING_OP_POLL_ADD, sqe, backend->event_fd, NULL, 0, 0);
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = USER_DATA_WAKEUP;
+  io_uring_backend_defer_submit(backend);
+  backend->event_fd_armed = 1;
+}
+
+static void io_uring_backend_handle_wakeup(IOUringBackend_t *backend) {
+  uint64_t value;
+  // drain the eventfd, the poll will be rearmed before the next blocking wait
+  if (read(backend->event_fd, &value, sizeof(value)) < 0) {}
+  backend->event_fd_armed = 0;
+}
+
+// A deadline op is not awaited by its fiber. On expiry, the exception is
+// scheduled on the fiber. If the deadline has been cancelled, there's no fiber
+// and the op context is released here.
+static void io_uring_backend_handle_deadline(IOUringBackend_t *backend, op_context_t *ctx) {
+  if (ctx->fiber == Qnil) {
+    context_store_release(&backend->store, ctx);
+    return;
+  }
+  if (ctx->result == -ETIME)
+    Fiber_make_runnable(ctx->fiber, backend_timeout_exception(ctx->exception, ctx->value));
+}
+
+// Reaps all available completions in a single pass, scheduling the fibers
+// waiting on the corresponding operations.
+static void io_uring_backend_handle_completions(IOUringBackend_t *backend) {
+  struct uring_cq *cq = &backend->ring.cq;
+  unsigned head, tail, mask;
+
+  if (backend->ring.ring_fd < 0) return;
+
+  head = *cq->khead;
+  tail = uring_load_acquire(cq->ktail);
+  mask = *cq->kring_mask;
+
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &cq->cqes[head & mask];
+    __u64 user_data = cqe->user_data;
+    int result = cqe->res;
+    head++;
+
+    if (user_data == USER_DATA_IGNORE) continue;
+    if (user_data == USER_DATA_WAKEUP) {
+      io_uring_backend_handle_wakeup(backend);
+      continue;
+    }
+
+    op_context_t *ctx = (op_context_t *) user_data;
+    ctx->result = result;
+    ctx->completed = 1;
+    if (ctx->type == OP_DEADLINE)
+      io_uring_backend_handle_deadline(backend, ctx);
+    else if (ctx->fiber != Qnil)
+      Fiber_make_runnable(ctx->fiber, Qnil);
+  }
+  uring_store_release(cq->khead, head);
+}
+
+struct io_uring_poll_args {
+  uring_t *ring;
+  unsigned to_submit;
+  int result;
+};
+
+void *io_uring_backend_poll_without_gvl(void *ptr) {
+  struct io_uring_poll_args *args = ptr;
+  args->result = uring_enter(args->ring, args->to_submit, 1, IORING_ENTER_GETEVENTS);
+  return NULL;
+}
+
+// Submits all prepared SQEs and waits for at least one completion, with the
+// GVL released.
+static void io_uring_backend_submit_and_wait(IOUringBackend_t *backend) {
+  struct io_uring_poll_args args;
+
+  args.ring = &backend->ring;
+  args.to_submit = uring_flush_sq(&backend->ring);
+  args.result = -EINTR;
+
+  backend->currently_polling = 1;
+  rb_thread_call_without_gvl(io_uring_backend_poll_without_gvl, (void *)&args, RUBY_UBF_IO, 0);
+  backend->currently_polling = 0;
+
+  backend->pending_sqes = (args.result >= 0) ? args.to_submit - args.result : args.to_submit;
+  if (args.result < 0 && args.result != -EINTR && args.result != -EAGAIN && args.result != -EBUSY)
+    rb_syserr_fail(-args.result, "io_uring_enter");
+}
+
+VALUE IOUringBackend_poll(VALUE self, VALUE nowait, VALUE current_fiber, VALUE runnable_count) {
+  int is_nowait = nowait == Qtrue;
+  IOUringBackend_t *backend;
+  GetIOUringBackend(self, backend);
+
+  if (backend->ring.ring_fd < 0) return self;
+
+  if (is_nowait) {
+    backend->run_no_wait_count++;
+    // Prepared SQEs are submitted once all currently runnable fibers have had
+    // a chance to run (and to prepare their own SQEs), so a single submission
+    // covers a whole pass over the run queue.
+    if (backend->run_no_wait_count < NUM2LONG(runnable_count)) return self;
+    if (backend->pending_sqes == 0 && backend->run_no_wait_count < 10) return self;
+  }
+
+  backend->run_no_wait_count = 0;
+
+  COND_TRACE(2, SYM_fiber_ev_loop_enter, current_fiber);
+  if (is_nowait) {
+    if (backend->pending_sqes > 0) io_uring_backend_submit(backend);
+  }
+  else {
+    if (!backend->event_fd_armed) io_uring_backend_arm_wakeup(backend);
+    io_uring_backend_submit_and_wait(backend);
+  }
+  io_uring_backend_update_now(backend);
+  io_uring_backend_handle_completions(backend);
+  COND_TRACE(2, SYM_fiber_ev_loop_leave, current_fiber);
+
+  return self;
+}
+
+VALUE IOUringBackend_wakeup(VALUE self) {
+  IOUringBackend_t *backend;
+  GetIOUringBackend(self, backend);
+
+  if (backend->currently_polling) {
+    // Writing to the eventfd completes the armed poll operation, which causes
+    // io_uring_enter to return. This is both thread-safe and signal-safe.
+    uint64_t value = 1;
+    if (write(backend->event_fd, &value, sizeof(value)) < 0) {}
+    return Qtrue;
+  }
+
+  return Qnil;
+}
+
+static inline VALUE io_uring_backend_await(IOUringBackend_t *backend) {
+  VALUE ret;
+  backend->ref_count++;
+  ret = Thread_switch_fiber(rb_thread_current());
+  backend->ref_count--;
+  RB_GC_GUARD(ret);
+  return ret;
+}
+
+static op_context_t *io_uring_backend_prep(
+  IOUringBackend_t *backend, enum op_type type, int opcode, int fd,
+  const void *addr, unsigned len, __u64 offset, struct io_uring_sqe **sqe_ptr
+) {
+  // the sqe is taken first, since getting it may raise
+  struct io_uring_sqe *sqe = io_uring_backend_get_sqe(backend);
+  op_context_t *ctx = context_store_acquire(&backend->store, type);
+
+  uring_prep_rw(opcode, sqe, fd, addr, len, offset);
+  sqe->user_data = (__u64) ctx;
+  if (sqe_ptr) *sqe_ptr = sqe;
+  return ctx;
+}
+
+// Cancels the given operation and waits for it to complete. The cancellation
+// is submitted right away and in most cases completes synchronously, so the
+// fiber does not need to switch while waiting for the cancelled operation. The
+// first exception the fiber is resumed with is kept in *switchpoint_result.
+static void io_uring_backend_cancel(
+  IOUringBackend_t *backend, op_context_t *ctx, VALUE *switchpoint_result
+) {
+  struct io_uring_sqe *sqe;
+  int opcode = (ctx->type == OP_TIMEOUT) ? IORING_OP_TIMEOUT_REMOVE : IORING_OP_ASYNC_CANCEL;
+
+  // closing the ring cancels all pending operations
+  if (backend->ring.ring_fd < 0) {
+    ctx->result = -ECANCELED;
+    ctx->completed = 1;
+    return;
+  }
+
+  sqe = io_uring_backend_get_sqe(backend);
+  uring_prep_rw(opcode, sqe, -1, (void *) ctx, 0, 0);
+  sqe->user_data = USER_DATA_IGNORE;
+
+  // the fiber is running, so it should not be scheduled by the completion
+  ctx->fiber = Qnil;
+  io_uring_backend_defer_submit(backend);
+  io_uring_backend_submit(backend);
+  io_uring_backend_handle_completions(backend);
+  ctx->fiber = rb_fiber_current();
+
+  while (!ctx->completed) {
+    VALUE ret = io_uring_backend_await(backend);
+    if (TEST_EXCEPTION(ret) && !TEST_EXCEPTION(*switchpoint_result))
+      *switchpoint_result = ret;
+  }
+}
+
+// Submits the operation (deferred until the next poll) and waits for its
+// completion. If the fiber is resumed with an exception before the operation
+// has completed (or with any value, if resume_cancels is set), the operation
+// is cancelled. Since the kernel may still be accessing the buffers referenced
+// by the operation, we always wait for it to complete before returning. The
+// operation's result is stored in *result, and the context is released.
+static VALUE io_uring_backend_await_op(
+  IOUringBackend_t *backend, op_context_t *ctx, int resume_cancels, int *result
+) {
+  VALUE switchpoint_result = Qnil;
+
+  io_uring_backend_defer_submit(backend);
+  while (1) {
+    switchpoint_result = io_uring_backend_await(backend);
+    if (ctx->completed) break;
+
+    if (resume_cancels || TEST_EXCEPTION(switchpoint_result)) {
+      io_uring_backend_cancel(backend, ctx, &switchpoint_result);
+      break;
+    }
+  }
+
+  if (result) *result = ctx->result;
+  context_store_release(&backend->store, ctx);
+  RB_GC_GUARD(switchpoint_result);
+  return switchpoint_result;
+}
+
+// Waits for the given fd to become readable or writable. fds are used in
+// whatever mode they are in, since the mode is shared by all processes holding
+// the fd. This is used as a fallback for fds in non-blocking mode, for which
+// the kernel returns EAGAIN instead of waiting for readiness.
+static VALUE io_uring_backend_wait_fd(IOUringBackend_t *backend, int fd, int write) {
+  struct io_uring_sqe *sqe;
+  op_context_t *ctx = io_uring_backend_prep(
+    backend, OP_POLL, IORING_OP_POLL_ADD, fd, NULL, 0, 0, &sqe
+  );
+  sqe->poll32_events = write ? POLLOUT : POLLIN;
+
+  return io_uring_backend_await_op(backend, ctx, 1, NULL);
+}
+
+VALUE IOUringBackend_read(int argc, VALUE *argv, VALUE self) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE io, str, length, to_eof, pos;
+  rb_scan_args(argc, argv, "41", &io, &str, &length, &to_eof, &pos);
+  long dynamic_len = length == Qnil;
+  long len = dynamic_len ? 4096 : NUM2INT(length);
+  long buffer_pos = io_read_buffer_pos(str, pos);
+  int shrinkable = io_setstrbuf(&str, buffer_pos + len);
+  char *buf = RSTRING_PTR(str) + buffer_pos;
+  long total = 0;
+  VALUE switchpoint_result = Qnil;
+  int read_to_eof = RTEST(to_eof);
+  VALUE underlying_io = rb_iv_get(io, "@io");
+
+  GetIOUringBackend(self, backend);
+  if (underlying_io != Qnil) io = underlying_io;
+  GetOpenFile(io, fptr);
+  rb_io_check_byte_readable(fptr);
+
+  OBJ_TAINT(str);
+
+  // Apparently after reopening a closed file, the file position is not reset,
+  // which causes the read to fail. Fortunately we can use fptr->rbuf.len to
+  // find out if that's the case.
+  // See: https://github.com/digital-fabric/polyphony/issues/30
+  if (fptr->rbuf.len > 0) {
+    lseek(fptr->fd, -fptr->rbuf.len, SEEK_CUR);
+    fptr->rbuf.len = 0;
+  }
+
+  while (1) {
+    int result;
+    op_context_t *ctx = io_uring_backend_prep(
+      backend, OP_READ, IORING_OP_READ, fptr->fd, buf, len - total, -1, NULL
+    );
+    switchpoint_result = io_uring_backend_await_op(backend, ctx, 0, &result);
+
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+
+    if (result < 0) {
+      if (result != -EAGAIN) rb_syserr_fail(-result, strerror(-result));
+
+      switchpoint_result = io_uring_backend_wait_fd(backend, fptr->fd, 0);
+      if (TEST_EXCEPTION(switchpoint_result)) goto error;
+    }
+    else {
+      if (result == 0) break; // EOF
+      total = total + result;
+      if (!read_to_eof) break;
+
+      if (total == len) {
+        if (!dynamic_len) break;
+
+        rb_str_resize(str, buffer_pos + total);
+        rb_str_modify_expand(str, len);
+        buf = RSTRING_PTR(str) + buffer_pos + total;
+        shrinkable = 0;
+        len += len;
+      }
+      else buf += result;
+    }
+  }
+
+  io_set_read_length(str, buffer_pos + total, shrinkable);
+  io_enc_str(str, fptr);
+
+  if (total == 0) return Qnil;
+
+  RB_GC_GUARD(str);
+  RB_GC_GUARD(switchpoint_result);
+
+  return str;
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// See LibevBackend_read_loop
+VALUE IOUringBackend_read_loop(int argc, VALUE *argv, VALUE self) {
+
+  #define PREPARE_STR() { \
+    str = buffer; \
+    shrinkable = io_setstrbuf(&str, len) && (buffer == Qnil); \
+    buf = RSTRING_PTR(str); \
+    total = 0; \
+    OBJ_TAINT(str); \
+  }
+
+  #define YIELD_STR() { \
+    io_set_read_length(str, total, shrinkable); \
+    io_enc_str(str, fptr); \
+    rb_yield(str); \
+    PREPARE_STR(); \
+  }
+
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE io;
+  VALUE buffer;
+  VALUE str = Qnil;
+  long total;
+  long len = READ_LOOP_INIT_LEN;
+  int shrinkable = 0;
+  char *buf = NULL;
+  VALUE switchpoint_result = Qnil;
+  VALUE underlying_io;
+  VALUE opts;
+  read_framer_t framer;
+
+  rb_scan_args(argc, argv, "11:", &io, &buffer, &opts);
+  underlying_io = rb_iv_get(io, "@io");
+  read_framer_init(&framer, buffer, opts);
+
+  GetIOUringBackend(self, backend);
+  if (underlying_io != Qnil) io = underlying_io;
+  GetOpenFile(io, fptr);
+  rb_io_check_byte_readable(fptr);
+
+  // Apparently after reopening a closed file, the file position is not reset,
+  // which causes the read to fail. Fortunately we can use fptr->rbuf.len to
+  // find out if that's the case.
+  // See: https://github.com/digital-fabric/polyphony/issues/30
+  if (fptr->rbuf.len > 0) {
+    lseek(fptr->fd, -fptr->rbuf.len, SEEK_CUR);
+    fptr->rbuf.len = 0;
+  }
+
+  read_framer_feed_initial(&framer, fptr);
+  if (framer.mode == READ_FRAMING_NONE) PREPARE_STR();
+
+  while (1) {
+    int result;
+    if (framer.mode != READ_FRAMING_NONE) buf = read_framer_prepare(&framer, len);
+    op_context_t *ctx = io_uring_backend_prep(
+      backend, OP_READ, IORING_OP_READ, fptr->fd, buf, len, -1, NULL
+    );
+    switchpoint_result = io_uring_backend_await_op(backend, ctx, 0, &result);
+
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+
+    if (result < 0) {
+      if (result != -EAGAIN) rb_syserr_fail(-result, strerror(-result));
+
+      switchpoint_result = io_uring_backend_wait_fd(backend, fptr->fd, 0);
+      if (TEST_EXCEPTION(switchpoint_result)) goto error;
+    }
+    else {
+      if (result == 0) break; // EOF
+      long n = result;
+      len = read_loop_adapt_len(len, result);
+      if (framer.mode != READ_FRAMING_NONE) {
+        read_framer_feed(&framer, n, fptr);
+        continue;
+      }
+      total = n;
+      YIELD_STR();
+    }
+  }
+
+  RB_GC_GUARD(str);
+  RB_GC_GUARD(framer.data);
+  RB_GC_GUARD(framer.delimiter);
+  RB_GC_GUARD(framer.initial);
+  RB_GC_GUARD(switchpoint_result);
+
+  return io;
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+VALUE IOUringBackend_write(VALUE self, VALUE io, VALUE str) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE switchpoint_result = Qnil;
+  VALUE underlying_io;
+  char *buf = StringValuePtr(str);
+  long len = RSTRING_LEN(str);
+  long left = len;
+
+  underlying_io = rb_iv_get(io, "@io");
+  if (underlying_io != Qnil) io = underlying_io;
+  GetIOUringBackend(self, backend);
+  io = rb_io_get_write_io(io);
+  GetOpenFile(io, fptr);
+
+  while (left > 0) {
+    int result;
+    op_context_t *ctx = io_uring_backend_prep(
+      backend, OP_WRITE, IORING_OP_WRITE, fptr->fd, buf, left, -1, NULL
+    );
+    switchpoint_result = io_uring_backend_await_op(backend, ctx, 0, &result);
+
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+
+    if (result < 0) {
+      if (result != -EAGAIN) rb_syserr_fail(-result, strerror(-result));
+
+      switchpoint_result = io_uring_backend_wait_fd(backend, fptr->fd, 1);
+      if (TEST_EXCEPTION(switchpoint_result)) goto error;
+    }
+    else {
+      buf += result;
+      left -= result;
+    }
+  }
+
+  RB_GC_GUARD(str);
+  RB_GC_GUARD(switchpoint_result);
+
+  return INT2NUM(len);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// See LibevBackend_writev
+VALUE IOUringBackend_writev(VALUE self, VALUE io, VALUE ary, int argc, VALUE *argv) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE switchpoint_result = Qnil;
+  VALUE underlying_io;
+  long total_written = 0;
+  backend_writev_t w;
+
+  underlying_io = rb_iv_get(io, "@io");
+  if (underlying_io != Qnil) io = underlying_io;
+  GetIOUringBackend(self, backend);
+  io = rb_io_get_write_io(io);
+  GetOpenFile(io, fptr);
+
+  backend_writev_init(&w, ary, argv, argc);
+  while (backend_writev_fill(&w)) {
+    while (w.iov_count > 0) {
+      int result;
+      op_context_t *ctx = io_uring_backend_prep(
+        backend, OP_WRITEV, IORING_OP_WRITEV, fptr->fd, w.iov_ptr, w.iov_count, -1, NULL
+      );
+      switchpoint_result = io_uring_backend_await_op(backend, ctx, 0, &result);
+
+      if (TEST_EXCEPTION(switchpoint_result)) goto error;
+
+      if (result < 0) {
+        if (result != -EAGAIN) rb_syserr_fail(-result, strerror(-result));
+
+        switchpoint_result = io_uring_backend_wait_fd(backend, fptr->fd, 1);
+        if (TEST_EXCEPTION(switchpoint_result)) goto error;
+      }
+      else {
+        total_written += result;
+        backend_writev_advance(&w, result);
+      }
+    }
+  }
+
+  RB_GC_GUARD(ary);
+  RB_GC_GUARD(switchpoint_result);
+
+  return INT2NUM(total_written);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// See LibevBackend_write_m
+VALUE IOUringBackend_write_m(int argc, VALUE *argv, VALUE self) {
+  if (argc < 2)
+    rb_raise(rb_eArgError, "wrong number of arguments (given %d, expected 2+)", argc);
+
+  if (argc == 2)
+    return RB_TYPE_P(argv[1], T_ARRAY) ?
+      IOUringBackend_writev(self, argv[0], argv[1], 0, NULL) :
+      IOUringBackend_write(self, argv[0], argv[1]);
+  return IOUringBackend_writev(self, argv[0], Qnil, argc - 1, argv + 1);
+}
+
+///////////////////////////////////////////////////////////////////////////
+
+static VALUE io_uring_backend_make_socket(int fd) {
+  VALUE socket;
+  rb_io_t *fp;
+
+  socket = rb_obj_alloc(cTCPSocket);
+  MakeOpenFile(socket, fp);
+  rb_update_max_fd(fd);
+  fp->fd = fd;
+  fp->mode = FMODE_READWRITE | FMODE_DUPLEX;
+  rb_io_ascii8bit_binmode(socket);
+  rb_io_synchronized(fp);
+
+  // if (rsock_do_not_reverse_lookup) {
+  //   fp->mode |= FMODE_NOREVLOOKUP;
+  // }
+  return socket;
+}
+
+// Accepts a single connection, returning the accepted fd
+static int io_uring_backend_accept_fd(IOUringBackend_t *backend, int server_fd, VALUE *switchpoint_result) {
+  struct sockaddr addr;
+  socklen_t len = (socklen_t)sizeof addr;
+  struct io_uring_sqe *sqe;
+  int result;
+
+  while (1) {
+    op_context_t *ctx = io_uring_backend_prep(
+      backend, OP_ACCEPT, IORING_OP_ACCEPT, server_fd, &addr, 0, 0, &sqe
+    );
+    sqe->addr2 = (__u64) &len;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    *switchpoint_result = io_uring_backend_await_op(backend, ctx, 0, &result);
+
+    if (TEST_EXCEPTION(*switchpoint_result)) {
+      if (result >= 0) close(result); // close fd since we're raising an exception
+      return -1;
+    }
+
+    if (result >= 0) return result;
+    if (result != -EAGAIN) rb_syserr_fail(-result, strerror(-result));
+
+    *switchpoint_result = io_uring_backend_wait_fd(backend, server_fd, 0);
+    if (TEST_EXCEPTION(*switchpoint_result)) return -1;
+  }
+}
+
+VALUE IOUringBackend_accept(VALUE self, VALUE sock) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  int fd;
+  VALUE switchpoint_result = Qnil;
+  VALUE underlying_sock = rb_iv_get(sock, "@io");
+  if (underlying_sock != Qnil) sock = underlying_sock;
+
+  GetIOUringBackend(self, backend);
+  GetOpenFile(sock, fptr);
+
+  fd = io_uring_backend_accept_fd(backend, fptr->fd, &switchpoint_result);
+  if (fd < 0) goto error;
+
+  RB_GC_GUARD(switchpoint_result);
+  return io_uring_backend_make_socket(fd);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// See LibevBackend_accept_loop. The batch size is accepted for compatibility
+// only: each accept op is a switchpoint of its own, and completes without
+// waiting while connections are pending.
+VALUE IOUringBackend_accept_loop(int argc, VALUE *argv, VALUE self) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE sock;
+  VALUE batch;
+  int fd;
+  VALUE switchpoint_result = Qnil;
+  VALUE socket = Qnil;
+
+  rb_scan_args(argc, argv, "11", &sock, &batch);
+  VALUE underlying_sock = rb_iv_get(sock, "@io");
+  if (underlying_sock != Qnil) sock = underlying_sock;
+
+  GetIOUringBackend(self, backend);
+  GetOpenFile(sock, fptr);
+
+  while (1) {
+    fd = io_uring_backend_accept_fd(backend, fptr->fd, &switchpoint_result);
+    if (fd < 0) goto error;
+
+    socket = io_uring_backend_make_socket(fd);
+    rb_yield(socket);
+    socket = Qnil;
+  }
+
+  RB_GC_GUARD(socket);
+  RB_GC_GUARD(switchpoint_result);
+  return Qnil;
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+VALUE IOUringBackend_connect(VALUE self, VALUE sock, VALUE host, VALUE port) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  struct sockaddr_in addr;
+  char *host_buf = StringValueCStr(host);
+  VALUE switchpoint_result = Qnil;
+  int result;
+  VALUE underlying_sock = rb_iv_get(sock, "@io");
+  if (underlying_sock != Qnil) sock = underlying_sock;
+
+  GetIOUringBackend(self, backend);
+  GetOpenFile(sock, fptr);
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(host_buf);
+  addr.sin_port = htons(NUM2INT(port));
+
+  op_context_t *ctx = io_uring_backend_prep(
+    backend, OP_CONNECT, IORING_OP_CONNECT, fptr->fd, &addr, 0, sizeof(addr), NULL
+  );
+  switchpoint_result = io_uring_backend_await_op(backend, ctx, 0, &result);
+
+  if (TEST_EXCEPTION(switchpoint_result)) goto error;
+
+  if (result == -EINPROGRESS || result == -EALREADY) {
+    // non-blocking socket, wait for the connection to be established
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+
+    switchpoint_result = io_uring_backend_wait_fd(backend, fptr->fd, 1);
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+
+    if (getsockopt(fptr->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) err = errno;
+    if (err) rb_syserr_fail(err, strerror(err));
+  }
+  else if (result < 0) rb_syserr_fail(-result, strerror(-result));
+
+  RB_GC_GUARD(switchpoint_result);
+  return sock;
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// Receives or sends a message using the given msghdr (opcode is either
+// IORING_OP_RECVMSG or IORING_OP_SENDMSG). Sends are repeated until the whole
+// message is sent. If MSG_DONTWAIT is given, the operation is not retried, and
+// IO::EAGAINWaitReadable (or IO::EAGAINWaitWritable) is raised if it would
+// block. Returns the number of bytes transferred, or -1 if the fiber was
+// resumed with an exception (stored in *switchpoint_result).
+static ssize_t io_uring_backend_msg_op(
+  IOUringBackend_t *backend, int opcode, int fd, struct msghdr *msg, int flags,
+  VALUE *switchpoint_result
+) {
+  int write = opcode == IORING_OP_SENDMSG;
+  size_t left = msg->msg_iov[0].iov_len;
+  ssize_t total = 0;
+
+  while (1) {
+    struct io_uring_sqe *sqe;
+    int result;
+    op_context_t *ctx = io_uring_backend_prep(
+      backend, write ? OP_SENDMSG : OP_RECVMSG, opcode, fd, msg, 1, 0, &sqe
+    );
+    sqe->msg_flags = flags;
+    *switchpoint_result = io_uring_backend_await_op(backend, ctx, 0, &result);
+    if (TEST_EXCEPTION(*switchpoint_result)) return -1;
+
+    if (result < 0) {
+      if (result != -EAGAIN) rb_syserr_fail(-result, strerror(-result));
+      if (flags & MSG_DONTWAIT)
+        rb_readwrite_syserr_fail(
+          write ? RB_IO_WAIT_WRITABLE : RB_IO_WAIT_READABLE, -result,
+          write ? "sendmsg(2) would block" : "recvmsg(2) would block"
+        );
+
+      *switchpoint_result = io_uring_backend_wait_fd(backend, fd, write);
+      if (TEST_EXCEPTION(*switchpoint_result)) return -1;
+      continue;
+    }
+
+    total += result;
+    if (!write) break;
+
+    left -= result;
+    if (left == 0 || (flags & MSG_DONTWAIT)) break;
+
+    msg->msg_iov[0].iov_base = (char *) msg->msg_iov[0].iov_base + result;
+    msg->msg_iov[0].iov_len = left;
+  }
+
+  return total;
+}
+
+static VALUE io_uring_backend_get_socket(VALUE sock, rb_io_t **fptr) {
+  VALUE underlying_sock = rb_iv_get(sock, "@io");
+  if (underlying_sock != Qnil) sock = underlying_sock;
+  GetOpenFile(sock, *fptr);
+  return sock;
+}
+
+// See LibevBackend_recv
+VALUE IOUringBackend_recv(int argc, VALUE *argv, VALUE self) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE io, maxlen, flags, str;
+  VALUE switchpoint_result = Qnil;
+  struct msghdr msg;
+  struct iovec iov;
+  int shrinkable;
+  long len;
+  ssize_t n;
+
+  rb_scan_args(argc, argv, "22", &io, &maxlen, &flags, &str);
+  len = NUM2LONG(maxlen);
+  shrinkable = io_setstrbuf(&str, len);
+  OBJ_TAINT(str);
+
+  GetIOUringBackend(self, backend);
+  io = io_uring_backend_get_socket(io, &fptr);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = RSTRING_PTR(str);
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  n = io_uring_backend_msg_op(
+    backend, IORING_OP_RECVMSG, fptr->fd, &msg, NIL_P(flags) ? 0 : NUM2INT(flags),
+    &switchpoint_result
+  );
+  if (n < 0) goto error;
+
+  io_set_read_length(str, n, shrinkable);
+  io_enc_str(str, fptr);
+  if (n == 0 && len > 0 && socket_is_stream(fptr->fd)) return Qnil;
+
+  RB_GC_GUARD(str);
+  RB_GC_GUARD(switchpoint_result);
+  return str;
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// See LibevBackend_recvmsg
+VALUE IOUringBackend_recvmsg(int argc, VALUE *argv, VALUE self) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE io, maxlen, flags, str = Qnil;
+  VALUE switchpoint_result = Qnil;
+  struct sockaddr_storage addr;
+  struct msghdr msg;
+  struct iovec iov;
+  int shrinkable;
+  long len;
+  ssize_t n;
+
+  rb_scan_args(argc, argv, "21", &io, &maxlen, &flags);
+  len = NUM2LONG(maxlen);
+  shrinkable = io_setstrbuf(&str, len);
+  OBJ_TAINT(str);
+
+  GetIOUringBackend(self, backend);
+  io = io_uring_backend_get_socket(io, &fptr);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = RSTRING_PTR(str);
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_name = &addr;
+  msg.msg_namelen = sizeof(addr);
+
+  n = io_uring_backend_msg_op(
+    backend, IORING_OP_RECVMSG, fptr->fd, &msg, NIL_P(flags) ? 0 : NUM2INT(flags),
+    &switchpoint_result
+  );
+  if (n < 0) goto error;
+
+  io_set_read_length(str, n, shrinkable);
+  io_enc_str(str, fptr);
+  if (n == 0 && len > 0 && socket_is_stream(fptr->fd)) return Qnil;
+
+  RB_GC_GUARD(str);
+  RB_GC_GUARD(switchpoint_result);
+  return recvmsg_result(str, &msg);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// See LibevBackend_send
+VALUE IOUringBackend_send(int argc, VALUE *argv, VALUE self) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE io, str, flags;
+  VALUE switchpoint_result = Qnil;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t n;
+
+  rb_scan_args(argc, argv, "21", &io, &str, &flags);
+  StringValue(str);
+
+  GetIOUringBackend(self, backend);
+  io = io_uring_backend_get_socket(io, &fptr);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = RSTRING_PTR(str);
+  iov.iov_len = RSTRING_LEN(str);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  n = io_uring_backend_msg_op(
+    backend, IORING_OP_SENDMSG, fptr->fd, &msg, NIL_P(flags) ? 0 : NUM2INT(flags),
+    &switchpoint_result
+  );
+  if (n < 0) goto error;
+
+  RB_GC_GUARD(str);
+  RB_GC_GUARD(switchpoint_result);
+  return LONG2NUM(n);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// See LibevBackend_sendmsg
+VALUE IOUringBackend_sendmsg(int argc, VALUE *argv, VALUE self) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE io, str, flags, dest;
+  VALUE switchpoint_result = Qnil;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t n;
+
+  rb_scan_args(argc, argv, "22", &io, &str, &flags, &dest);
+  StringValue(str);
+
+  GetIOUringBackend(self, backend);
+  io = io_uring_backend_get_socket(io, &fptr);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = RSTRING_PTR(str);
+  iov.iov_len = RSTRING_LEN(str);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  dest = sendmsg_set_dest(&msg, dest);
+
+  n = io_uring_backend_msg_op(
+    backend, IORING_OP_SENDMSG, fptr->fd, &msg, NIL_P(flags) ? 0 : NUM2INT(flags),
+    &switchpoint_result
+  );
+  if (n < 0) goto error;
+
+  RB_GC_GUARD(str);
+  RB_GC_GUARD(dest);
+  RB_GC_GUARD(switchpoint_result);
+  return LONG2NUM(n);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+static VALUE io_uring_backend_get_src_io(VALUE io, rb_io_t **fptr) {
+  VALUE underlying_io = rb_iv_get(io, "@io");
+  if (underlying_io != Qnil) io = underlying_io;
+  GetOpenFile(io, *fptr);
+  return io;
+}
+
+static VALUE io_uring_backend_get_dest_io(VALUE io, rb_io_t **fptr) {
+  VALUE underlying_io = rb_iv_get(io, "@io");
+  if (underlying_io != Qnil) io = underlying_io;
+  io = rb_io_get_write_io(io);
+  GetOpenFile(io, *fptr);
+  return io;
+}
+
+// Performs a single splice or tee operation, returning its result (the number
+// of bytes moved, or a negative errno value).
+static int io_uring_backend_splice_op(
+  IOUringBackend_t *backend, int opcode, int src_fd, __u64 src_off, int dest_fd,
+  unsigned len, VALUE *switchpoint_result
+) {
+  struct io_uring_sqe *sqe = io_uring_backend_get_sqe(backend);
+  op_context_t *ctx = context_store_acquire(&backend->store, OP_SPLICE);
+  int result;
+
+  // tee does not take offsets, splice requires -1 for pipes and for using the
+  // current file position
+  if (opcode == IORING_OP_TEE)
+    uring_prep_splice(opcode, sqe, src_fd, 0, dest_fd, 0, len);
+  else
+    uring_prep_splice(opcode, sqe, src_fd, src_off, dest_fd, (__u64) -1, len);
+  sqe->user_data = (__u64) ctx;
+  *switchpoint_result = io_uring_backend_await_op(backend, ctx, 0, &result);
+  return result;
+}
+
+// Moves up to maxlen bytes from src to dest using splice or tee. One of the
+// fds (both for tee) must be a pipe.
+static VALUE io_uring_backend_splice(VALUE self, VALUE src, VALUE dest, VALUE maxlen, int opcode) {
+  IOUringBackend_t *backend;
+  rb_io_t *src_fptr;
+  rb_io_t *dest_fptr;
+  VALUE switchpoint_result = Qnil;
+  int wait_for_dest = 0;
+  int result;
+
+  GetIOUringBackend(self, backend);
+  src = io_uring_backend_get_src_io(src, &src_fptr);
+  dest = io_uring_backend_get_dest_io(dest, &dest_fptr);
+
+  while (1) {
+    result = io_uring_backend_splice_op(
+      backend, opcode, src_fptr->fd, (__u64) -1, dest_fptr->fd, NUM2UINT(maxlen),
+      &switchpoint_result
+    );
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+    if (result >= 0) break;
+    if (result != -EAGAIN) rb_syserr_fail(-result, strerror(-result));
+
+    // EAGAIN does not tell which of the two fds is not ready, so the two are
+    // waited upon alternately
+    switchpoint_result = wait_for_dest ?
+      io_uring_backend_wait_fd(backend, dest_fptr->fd, 1) :
+      io_uring_backend_wait_fd(backend, src_fptr->fd, 0);
+    wait_for_dest = !wait_for_dest;
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+  }
+
+  RB_GC_GUARD(switchpoint_result);
+  return INT2NUM(result);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+VALUE IOUringBackend_splice(VALUE self, VALUE src, VALUE dest, VALUE maxlen) {
+  return io_uring_backend_splice(self, src, dest, maxlen, IORING_OP_SPLICE);
+}
+
+VALUE IOUringBackend_tee(VALUE self, VALUE src, VALUE dest, VALUE maxlen) {
+  return io_uring_backend_splice(self, src, dest, maxlen, IORING_OP_TEE);
+}
+
+VALUE IOUringBackend_splice_to_eof(VALUE self, VALUE src, VALUE dest, VALUE chunksize) {
+  long total = 0;
+
+  while (1) {
+    int len = NUM2INT(io_uring_backend_splice(self, src, dest, chunksize, IORING_OP_SPLICE));
+    if (len == 0) break;
+    total += len;
+  }
+
+  return LONG2NUM(total);
+}
+
+// the default pipe capacity
+#define SENDFILE_MAX_CHUNK (1 << 16)
+
+// Sends count bytes (or everything up to EOF if count is nil) from the file src
+// to dest, starting from the given offset (or from the current file position
+// if offset is nil). Returns the number of bytes sent. io_uring has no sendfile
+// operation, so the data is spliced through an intermediary pipe, which is
+// how sendfile(2) works internally.
+VALUE IOUringBackend_sendfile(VALUE self, VALUE src, VALUE dest, VALUE offset, VALUE count) {
+  IOUringBackend_t *backend;
+  rb_io_t *src_fptr;
+  rb_io_t *dest_fptr;
+  VALUE switchpoint_result = Qnil;
+  __s64 off = NIL_P(offset) ? -1 : NUM2OFFT(offset);
+  long left = NIL_P(count) ? -1 : NUM2LONG(count);
+  long total = 0;
+  int pipefd[2];
+  int err = 0;
+
+  GetIOUringBackend(self, backend);
+  src = io_uring_backend_get_src_io(src, &src_fptr);
+  rb_io_check_byte_readable(src_fptr);
+  dest = io_uring_backend_get_dest_io(dest, &dest_fptr);
+
+  // See comment in IOUringBackend_read
+  if (src_fptr->rbuf.len > 0) {
+    lseek(src_fptr->fd, -src_fptr->rbuf.len, SEEK_CUR);
+    src_fptr->rbuf.len = 0;
+  }
+
+  if (pipe2(pipefd, O_CLOEXEC) < 0) rb_syserr_fail(errno, strerror(errno));
+
+  while (left != 0) {
+    unsigned chunk = (left < 0 || left > SENDFILE_MAX_CHUNK) ? SENDFILE_MAX_CHUNK : left;
+    int n = io_uring_backend_splice_op(
+      backend, IORING_OP_SPLICE, src_fptr->fd, (__u64) off, pipefd[1], chunk,
+      &switchpoint_result
+    );
+    if (TEST_EXCEPTION(switchpoint_result)) goto done;
+    if (n < 0) { err = -n; goto done; }
+    if (n == 0) break; // EOF
+
+    if (off >= 0) off += n;
+    total += n;
+    if (left > 0) left -= n;
+
+    while (n > 0) {
+      int written = io_uring_backend_splice_op(
+        backend, IORING_OP_SPLICE, pipefd[0], (__u64) -1, dest_fptr->fd, n,
+        &switchpoint_result
+      );
+      if (TEST_EXCEPTION(switchpoint_result)) goto done;
+      if (written == -EAGAIN) {
+        switchpoint_result = io_uring_backend_wait_fd(backend, dest_fptr->fd, 1);
+        if (TEST_EXCEPTION(switchpoint_result)) goto done;
+        continue;
+      }
+      if (written < 0) { err = -written; goto done; }
+      n -= written;
+    }
+  }
+
+done:
+  close(pipefd[0]);
+  close(pipefd[1]);
+  if (TEST_EXCEPTION(switchpoint_result)) return RAISE_EXCEPTION(switchpoint_result);
+  if (err) rb_syserr_fail(err, strerror(err));
+
+  RB_GC_GUARD(switchpoint_result);
+  return LONG2NUM(total);
+}
+
+// io_uring has no batched message operations, so recvmmsg/sendmmsg are called
+// directly in non-blocking mode, and the socket is polled for readiness if
+// they would block.
+VALUE IOUringBackend_recv_batch(VALUE self, VALUE io, VALUE max_msgs, VALUE max_len) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE switchpoint_result = Qnil;
+  VALUE tmp = 0;
+  struct mmsghdr *msgs;
+  int count = NUM2INT(max_msgs);
+  int n;
+
+  GetIOUringBackend(self, backend);
+  io = io_uring_backend_get_socket(io, &fptr);
+  msgs = mmsg_recv_setup(&tmp, count, NUM2LONG(max_len));
+
+  while (1) {
+    n = recvmmsg(fptr->fd, msgs, count, MSG_DONTWAIT, NULL);
+    if (n >= 0) break;
+
+    int e = errno;
+    if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
+
+    switchpoint_result = io_uring_backend_wait_fd(backend, fptr->fd, 0);
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+  }
+
+  VALUE result = mmsg_recv_result(msgs, n);
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(switchpoint_result);
+  return result;
+error:
+  ALLOCV_END(tmp);
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// See IOUringBackend_recv_batch
+VALUE IOUringBackend_send_batch(VALUE self, VALUE io, VALUE messages) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE switchpoint_result = Qnil;
+  VALUE tmp = 0;
+  struct mmsghdr *msgs;
+  int count;
+  int sent = 0;
+
+  GetIOUringBackend(self, backend);
+  io = io_uring_backend_get_socket(io, &fptr);
+  msgs = mmsg_send_setup(&tmp, messages, &count);
+
+  while (sent < count) {
+    int n = sendmmsg(fptr->fd, msgs + sent, count - sent, MSG_DONTWAIT);
+    if (n >= 0) {
+      sent += n;
+      continue;
+    }
+
+    int e = errno;
+    if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
+
+    switchpoint_result = io_uring_backend_wait_fd(backend, fptr->fd, 1);
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+  }
+
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(messages);
+  RB_GC_GUARD(switchpoint_result);
+  return INT2NUM(sent);
+error:
+  ALLOCV_END(tmp);
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+VALUE IOUringBackend_wait_io(VALUE self, VALUE io, VALUE write) {
+  IOUringBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE switchpoint_result;
+  VALUE underlying_io = rb_iv_get(io, "@io");
+  if (underlying_io != Qnil) io = underlying_io;
+  GetIOUringBackend(self, backend);
+  GetOpenFile(io, fptr);
+
+  switchpoint_result = io_uring_backend_wait_fd(backend, fptr->fd, RTEST(write));
+
+  TEST_RESUME_EXCEPTION(switchpoint_result);
+  RB_GC_GUARD(switchpoint_result);
+  return switchpoint_result;
+}
+
+// Each wait is a separate poll operation, so there are no watchers to release
+// (see LibevBackend_release_io).
+VALUE IOUringBackend_release_io(VALUE self, VALUE io) {
+  return self;
+}
+
+VALUE IOUringBackend_sleep(VALUE self, VALUE duration) {
+  IOUringBackend_t *backend;
+  VALUE switchpoint_result = Qnil;
+  double secs = NUM2DBL(duration);
+  op_context_t *ctx;
+
+  GetIOUringBackend(self, backend);
+  if (secs < 0) secs = 0;
+
+  // the timespec is kept in the op context, since it needs to remain valid
+  // until the operation is submitted
+  struct io_uring_sqe *sqe = io_uring_backend_get_sqe(backend);
+  ctx = context_store_acquire(&backend->store, OP_TIMEOUT);
+  ctx->ts.tv_sec = (long long) secs;
+  ctx->ts.tv_nsec = (long long) ((secs - ctx->ts.tv_sec) * 1e9);
+  uring_prep_rw(IORING_OP_TIMEOUT, sqe, -1, &ctx->ts, 1, 0);
+  sqe->user_data = (__u64) ctx;
+
+  switchpoint_result = io_uring_backend_await_op(backend, ctx, 1, NULL);
+
+  TEST_RESUME_EXCEPTION(switchpoint_result);
+  RB_GC_GUARD(switchpoint_result);
+  return switchpoint_result;
+}
+
+// See LibevBackend_timer_loop. Each tick is an absolute IORING_OP_TIMEOUT on
+// the monotonic clock, one interval after the previous tick, so that the loop
+// does not drift. The cached loop time is used, so no clock is read per tick.
+VALUE IOUringBackend_timer_loop(VALUE self, VALUE interval) {
+  IOUringBackend_t *backend;
+  VALUE switchpoint_result = Qnil;
+  double secs = NUM2DBL(interval);
+  double next;
+  op_context_t *ctx;
+  struct io_uring_sqe *sqe;
+
+  if (secs <= 0) rb_raise(rb_eArgError, "interval must be positive");
+  rb_need_block();
+  GetIOUringBackend(self, backend);
+
+  next = backend->now + secs;
+  while (1) {
+    sqe = io_uring_backend_get_sqe(backend);
+    ctx = context_store_acquire(&backend->store, OP_TIMEOUT);
+    ctx->ts.tv_sec = (long long) next;
+    ctx->ts.tv_nsec = (long long) ((next - ctx->ts.tv_sec) * 1e9);
+    uring_prep_rw(IORING_OP_TIMEOUT, sqe, -1, &ctx->ts, 1, 0);
+    sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    sqe->user_data = (__u64) ctx;
+
+    switchpoint_result = io_uring_backend_await_op(backend, ctx, 1, NULL);
+    TEST_RESUME_EXCEPTION(switchpoint_result);
+
+    // the fiber might have been resumed before the tick
+    if (backend->now < next) continue;
+
+    rb_yield(Qnil);
+    // as with a repeating ev_timer, missed ticks are coalesced into a single
+    // tick, which is run right away
+    next += secs;
+    if (next < backend->now) next = backend->now;
+  }
+
+  RB_GC_GUARD(switchpoint_result);
+  return Qnil;
+}
+
+struct io_uring_timeout_args {
+  IOUringBackend_t *backend;
+  op_context_t *ctx;
+};
+
+static VALUE io_uring_backend_timeout_ensure(VALUE arg) {
+  struct io_uring_timeout_args *args = (struct io_uring_timeout_args *) arg;
+  IOUringBackend_t *backend = args->backend;
+  op_context_t *ctx = args->ctx;
+  struct io_uring_sqe *sqe;
+
+  if (ctx->completed || backend->ring.ring_fd < 0) {
+    context_store_release(&backend->store, ctx);
+    return Qnil;
+  }
+
+  // The context is released once the removal completes, see
+  // io_uring_backend_handle_deadline
+  ctx->fiber = Qnil;
+  sqe = io_uring_backend_get_sqe(backend);
+  uring_prep_rw(IORING_OP_TIMEOUT_REMOVE, sqe, -1, (void *) ctx, 0, 0);
+  sqe->user_data = USER_DATA_IGNORE;
+  io_uring_backend_defer_submit(backend);
+  return Qnil;
+}
+
+// See LibevBackend_timeout. The timeout is a detached IORING_OP_TIMEOUT
+// operation, which is removed once the block completes.
+VALUE IOUringBackend_timeout(int argc, VALUE *argv, VALUE self) {
+  IOUringBackend_t *backend;
+  struct io_uring_timeout_args args;
+  VALUE duration, exception, value;
+  double secs;
+  op_context_t *ctx;
+  struct io_uring_sqe *sqe;
+
+  rb_scan_args(argc, argv, "21", &duration, &exception, &value);
+  rb_need_block();
+  GetIOUringBackend(self, backend);
+  secs = NUM2DBL(duration);
+  if (secs < 0) secs = 0;
+
+  sqe = io_uring_backend_get_sqe(backend);
+  ctx = context_store_acquire(&backend->store, OP_DEADLINE);
+  ctx->exception = exception;
+  ctx->value = value;
+  ctx->ts.tv_sec = (long long) secs;
+  ctx->ts.tv_nsec = (long long) ((secs - ctx->ts.tv_sec) * 1e9);
+  uring_prep_rw(IORING_OP_TIMEOUT, sqe, -1, &ctx->ts, 1, 0);
+  sqe->user_data = (__u64) ctx;
+  io_uring_backend_defer_submit(backend);
+
+  args.backend = backend;
+  args.ctx = ctx;
+  return rb_ensure(rb_yield, Qnil, io_uring_backend_timeout_ensure, (VALUE) &args);
+}
+
+struct io_uring_select {
+  backend_select_t select;
+  IOUringBackend_t *backend;
+  op_context_t **polls;
+  long io_count;
+  op_context_t *timer;
+  double timeout;
+  VALUE switchpoint_result;
+};
+
+static VALUE io_uring_select_body(VALUE arg) {
+  struct io_uring_select *s = (struct io_uring_select *)arg;
+  struct io_uring_sqe *sqe;
+  VALUE result;
+
+  s->polls = ALLOC_N(op_context_t *, RARRAY_LEN(s->select.ios) + 1);
+  for (long i = 0; i < RARRAY_LEN(s->select.ios); i++) {
+    VALUE io = RARRAY_AREF(s->select.ios, i);
+    VALUE underlying_io = rb_iv_get(io, "@io");
+    rb_io_t *fptr;
+    if (underlying_io != Qnil) io = underlying_io;
+    GetOpenFile(io, fptr);
+
+    s->polls[i] = io_uring_backend_prep(
+      s->backend, OP_POLL, IORING_OP_POLL_ADD, fptr->fd, NULL, 0, 0, &sqe
+    );
+    sqe->poll32_events = POLLIN;
+    io_uring_backend_defer_submit(s->backend);
+    s->io_count++;
+  }
+
+  if (s->timeout >= 0) {
+    sqe = io_uring_backend_get_sqe(s->backend);
+    s->timer = context_store_acquire(&s->backend->store, OP_TIMEOUT);
+    s->timer->ts.tv_sec = (long long) s->timeout;
+    s->timer->ts.tv_nsec = (long long) ((s->timeout - s->timer->ts.tv_sec) * 1e9);
+    uring_prep_rw(IORING_OP_TIMEOUT, sqe, -1, &s->timer->ts, 1, 0);
+    sqe->user_data = (__u64) s->timer;
+    io_uring_backend_defer_submit(s->backend);
+  }
+
+  while (1) {
+    result = backend_select_queues(&s->select);
+    if (result != Qnil) return result;
+
+    for (long i = 0; i < s->io_count; i++)
+      if (s->polls[i]->completed)
+        return rb_ary_new_from_args(2, RARRAY_AREF(s->select.ios, i), Qnil);
+
+    if (s->timer && s->timer->completed) return Qnil;
+
+    VALUE switchpoint_result = io_uring_backend_await(s->backend);
+    TEST_RESUME_EXCEPTION(switchpoint_result);
+    RB_GC_GUARD(switchpoint_result);
+  }
+}
+
+static void io_uring_select_release(struct io_uring_select *s, op_context_t *ctx) {
+  if (!ctx->completed) io_uring_backend_cancel(s->backend, ctx, &s->switchpoint_result);
+  context_store_release(&s->backend->store, ctx);
+}
+
+static VALUE io_uring_select_ensure(VALUE arg) {
+  struct io_uring_select *s = (struct io_uring_select *)arg;
+
+  // the kernel may still reference the timer's timespec, so all pending ops
+  // are cancelled and waited upon before returning
+  for (long i = 0; i < s->io_count; i++) io_uring_select_release(s, s->polls[i]);
+  if (s->timer) io_uring_select_release(s, s->timer);
+  if (s->polls) xfree(s->polls);
+  backend_select_done(&s->select);
+  return Qnil;
+}
+
+// See LibevBackend_select.
+VALUE IOUringBackend_select(VALUE self, VALUE queues, VALUE ios, VALUE timeout) {
+  struct io_uring_select s;
+  VALUE result;
+
+  GetIOUringBackend(self, s.backend);
+  s.timeout = -1;
+  if (timeout != Qnil) {
+    s.timeout = NUM2DBL(timeout);
+    if (s.timeout < 0) s.timeout = 0;
+  }
+  backend_select_init(&s.select, queues, ios);
+  s.polls = NULL;
+  s.io_count = 0;
+  s.timer = NULL;
+  s.switchpoint_result = Qnil;
+
+  result = rb_ensure(io_uring_select_body, (VALUE) &s, io_uring_select_ensure, (VALUE) &s);
+  TEST_RESUME_EXCEPTION(s.switchpoint_result);
+  RB_GC_GUARD(s.switchpoint_result);
+  return result;
+}
+
+VALUE IOUringBackend_waitpid(VALUE self, VALUE pid) {
+  IOUringBackend_t *backend;
+  VALUE switchpoint_result = Qnil;
+  int pid_int = NUM2INT(pid);
+  int status = 0;
+  int pid_fd;
+  GetIOUringBackend(self, backend);
+
+  // A pidfd becomes readable once the child process has terminated
+  pid_fd = (int) syscall(__NR_pidfd_open, pid_int, 0);
+  if (pid_fd < 0) {
+    int e = errno;
+    rb_syserr_fail(e, strerror(e));
+  }
+
+  switchpoint_result = io_uring_backend_wait_fd(backend, pid_fd, 0);
+  close(pid_fd);
+  TEST_RESUME_EXCEPTION(switchpoint_result);
+
+  pid_int = waitpid(pid_int, &status, WNOHANG);
+  if (pid_int < 0) {
+    int e = errno;
+    rb_syserr_fail(e, strerror(e));
+  }
+
+  RB_GC_GUARD(switchpoint_result);
+  return rb_ary_new_from_args(2, INT2NUM(pid_int), INT2NUM(WEXITSTATUS(status)));
+}
+
+VALUE IOUringBackend_wait_event(VALUE self, VALUE raise) {
+  IOUringBackend_t *backend;
+  VALUE switchpoint_result = Qnil;
+  GetIOUringBackend(self, backend);
+
+  // No operation is needed here, since an armed wakeup poll is always part of
+  // a blocking wait, and the raised ref count prevents the loop from exiting.
+  switchpoint_result = io_uring_backend_await(backend);
+
+  if (RTEST(raise)) TEST_RESUME_EXCEPTION(switchpoint_result);
+  RB_GC_GUARD(switchpoint_result);
+  return switchpoint_result;
+}
+
+void Init_IOUringBackend() {
+  rb_require("socket");
+  cTCPSocket = rb_const_get(rb_cObject, rb_intern("TCPSocket"));
+  cAddrinfo = rb_const_get(rb_cObject, rb_intern("Addrinfo"));
+
+  VALUE cBackend = rb_define_class_under(mPolyphony, "Backend", rb_cData);
+  rb_define_alloc_func(cBackend, IOUringBackend_allocate);
+  rb_define_const(cBackend, "KIND", ID2SYM(rb_intern("io_uring")));
+
+  rb_define_method(cBackend, "initialize", IOUringBackend_initialize, 0);
+  rb_define_method(cBackend, "finalize", IOUringBackend_finalize, 0);
+  rb_define_method(cBackend, "post_fork", IOUringBackend_post_fork, 0);
+  rb_define_method(cBackend, "pending_count", IOUringBackend_pending_count, 0);
+
+  rb_define_method(cBackend, "ref", IOUringBackend_ref, 0);
+  rb_define_method(cBackend, "unref", IOUringBackend_unref, 0);
+
+  rb_define_method(cBackend, "poll", IOUringBackend_poll, 3);
+  rb_define_method(cBackend, "break", IOUringBackend_wakeup, 0);
+
+  rb_define_method(cBackend, "read", IOUringBackend_read, -1);
+  rb_define_method(cBackend, "read_loop", IOUringBackend_read_loop, -1);
+  rb_define_method(cBackend, "write", IOUringBackend_write_m, -1);
+  rb_define_method(cBackend, "accept", IOUringBackend_accept, 1);
+  rb_define_method(cBackend, "accept_loop", IOUringBackend_accept_loop, -1);
+  rb_define_method(cBackend, "connect", IOUringBackend_connect, 3);
+  rb_define_method(cBackend, "wait_io", IOUringBackend_wait_io, 2);
+  rb_define_method(cBackend, "release_io", IOUringBackend_release_io, 1);
+  rb_define_method(cBackend, "recv", IOUringBackend_recv, -1);
+  rb_define_method(cBackend, "recvmsg", IOUringBackend_recvmsg, -1);
+  rb_define_method(cBackend, "send", IOUringBackend_send, -1);
+  rb_define_method(cBackend, "sendmsg", IOUringBackend_sendmsg, -1);
+  rb_define_method(cBackend, "splice", IOUringBackend_splice, 3);
+  rb_define_method(cBackend, "splice_to_eof", IOUringBackend_splice_to_eof, 3);
+  rb_define_method(cBackend, "tee", IOUringBackend_tee, 3);
+  rb_define_method(cBackend, "sendfile", IOUringBackend_sendfile, 4);
+  rb_define_method(cBackend, "recv_batch", IOUringBackend_recv_batch, 3);
+  rb_define_method(cBackend, "send_batch", IOUringBackend_send_batch, 2);
+  rb_define_method(cBackend, "sleep", IOUringBackend_sleep, 1);
+  rb_define_method(cBackend, "timeout", IOUringBackend_timeout, -1);
+  rb_define_method(cBackend, "select", IOUringBackend_select, 3);
+  rb_define_method(cBackend, "timer_loop", IOUringBackend_timer_loop, 1);
+  rb_define_method(cBackend, "now", IOUringBackend_now, 0);
+  rb_define_method(cBackend, "waitpid", IOUringBackend_waitpid, 1);
+  rb_define_method(cBackend, "wait_event", IOUringBackend_wait_event, 1);
+
+
+  __BACKEND__.now             = IOUringBackend_now;
+  __BACKEND__.pending_count   = IOUringBackend_pending_count;
+  __BACKEND__.poll            = IOUringBackend_poll;
+  __BACKEND__.ref             = IOUringBackend_ref;
+  __BACKEND__.ref_count       = IOUringBackend_ref_count;
+  __BACKEND__.reset_ref_count = IOUringBackend_reset_ref_count;
+  __BACKEND__.unref           = IOUringBackend_unref;
+  __BACKEND__.wait_event      = IOUringBackend_wait_event;
+  __BACKEND__.wakeup          = IOUringBackend_wakeup;
+}
+
+#endif /* POLYPHONY_BACKEND_IO_URING */
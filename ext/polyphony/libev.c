@@ -1,2 +1,6 @@
 #include "libev.h"
 #include "../libev/ev.c"
+
+ev_tstamp ev_mn_now(struct ev_loop *loop) {
+  return loop->mn_now;
+}
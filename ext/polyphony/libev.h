@@ -6,4 +6,7 @@
 #define EV_USE_REALTIME 0
 #endif
 
-#include "../libev/ev.h"
\ No newline at end of file
+#include "../libev/ev.h"
+// Returns the loop's monotonic time, cached once per loop iteration. This is
+// the time base used for relative timers (ev_timer).
+ev_tstamp ev_mn_now(struct ev_loop *loop);
@@ -1,3 +1,10 @@
+#ifdef POLYPHONY_BACKEND_LIBEV
+
+#ifdef __linux__
+#define _GNU_SOURCE 1 // for splice and tee
+#include <sys/sendfile.h>
+#endif
+
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
@@ -6,10 +13,47 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#include "polyphony.h"
+#include "backend_common.h"
 #include "../libev/ev.h"
 
 VALUE cTCPSocket;
+VALUE cAddrinfo;
+
+struct libev_io {
+  struct ev_io io;
+  VALUE fiber;
+  int fired;
+};
+
+// Each fd waited upon gets a pair of long-lived watchers, one for reading and
+// one for writing. A watcher is started on the first wait and stays active
+// between waits, so a fiber repeatedly waiting on the same fd (e.g. a
+// keep-alive connection) causes a single epoll_ctl call instead of one per
+// wait, as happens when a watcher is set up anew for each wait. A watcher that
+// fires while no fiber waits on it is stopped, so the loop does not keep
+// waking up for an fd that's ready but not being read. The watchers are also
+// stopped when the IO is closed (see Backend#release_io), so no change to a
+// closed fd is ever passed to epoll_ctl.
+//
+// The token identifies the IO object the watchers were set up for (it's also
+// stored in the IO's @__watcher_token ivar), so that if the fd is closed
+// without being released (e.g. by the GC) and its number reused by another IO,
+// the watchers are reset and the new fd is registered anew.
+typedef struct libev_fd_watchers {
+  struct libev_io read;
+  struct libev_io write;
+  long token;
+} libev_fd_watchers_t;
+
+// Watchers for a loop, indexed by fd. Since all main thread backends share the
+// default loop, they also share its table, so an fd never has active watchers
+// left behind by another backend.
+typedef struct libev_fd_table {
+  libev_fd_watchers_t **entries;
+  int size;
+} libev_fd_table_t;
+
+static libev_fd_table_t libev_default_loop_fd_table = {NULL, 0};
 
 typedef struct LibevBackend_t {
   struct ev_loop *ev_loop;
@@ -17,21 +61,64 @@ typedef struct LibevBackend_t {
   int running;
   int ref_count;
   int run_no_wait_count;
+  // points to own_fd_table, or to the default loop's table
+  libev_fd_table_t *fd_table;
+  libev_fd_table_t own_fd_table;
+  // generation of the default loop the backend was set up on, see post_fork
+  unsigned int default_loop_generation;
+  // scheduling state of the thread the backend was created on, whose budget is
+  // spent by I/O operations that complete without waiting
+  VALUE thread;
+  thread_sched_t *sched;
 } LibevBackend_t;
 
+// Incremented whenever the default loop is destroyed after forking, since
+// main thread backends set up before the fork cannot stop their watchers on
+// the new default loop.
+static unsigned int libev_default_loop_generation = 0;
+
+static void LibevBackend_mark(void *ptr) {
+  LibevBackend_t *backend = ptr;
+  rb_gc_mark(backend->thread);
+  if (!backend->fd_table) return;
+
+  for (int i = 0; i < backend->fd_table->size; i++) {
+    libev_fd_watchers_t *entry = backend->fd_table->entries[i];
+    if (!entry) continue;
+    rb_gc_mark(entry->read.fiber);
+    rb_gc_mark(entry->write.fiber);
+  }
+}
+
 static size_t LibevBackend_size(const void *ptr) {
-  return sizeof(LibevBackend_t);
+  const LibevBackend_t *backend = ptr;
+  return sizeof(LibevBackend_t) +
+    backend->own_fd_table.size * sizeof(libev_fd_watchers_t *);
+}
+
+static void libev_backend_close(LibevBackend_t *backend);
+
+static void LibevBackend_free(void *ptr) {
+  LibevBackend_t *backend = ptr;
+  libev_backend_close(backend);
+  xfree(ptr);
 }
 
 static const rb_data_type_t LibevBackend_type = {
     "Libev",
-    {0, 0, LibevBackend_size,},
+    {LibevBackend_mark, LibevBackend_free, LibevBackend_size,},
     0, 0, RUBY_TYPED_FREE_IMMEDIATELY
 };
 
 static VALUE LibevBackend_allocate(VALUE klass) {
   LibevBackend_t *backend = ALLOC(LibevBackend_t);
 
+  backend->ev_loop = NULL;
+  backend->fd_table = NULL;
+  backend->own_fd_table.entries = NULL;
+  backend->own_fd_table.size = 0;
+  backend->thread = Qnil;
+  backend->sched = NULL;
   return TypedData_Wrap_Struct(klass, &LibevBackend_type, backend);
 }
 
@@ -58,18 +145,55 @@ static VALUE LibevBackend_initialize(VALUE self) {
   backend->running = 0;
   backend->ref_count = 0;
   backend->run_no_wait_count = 0;
+  backend->fd_table = is_main_thread ?
+    &libev_default_loop_fd_table : &backend->own_fd_table;
+  backend->default_loop_generation = libev_default_loop_generation;
+  backend->thread = thread;
+  backend->sched = Thread_sched(thread);
 
   return Qnil;
 }
 
+// Frees the given fd watchers table. Called only when the loop the watchers
+// were started on is destroyed, so the watchers are not stopped.
+static void libev_fd_table_free(libev_fd_table_t *table) {
+  for (int i = 0; i < table->size; i++) free(table->entries[i]);
+  free(table->entries);
+  table->entries = NULL;
+  table->size = 0;
+}
+
+// Stops the backend's break_async watcher and destroys its loop, unless it's
+// the default loop, whose fd watchers are shared with other main thread
+// backends. Called on finalize, or when a backend is garbage collected without
+// being finalized.
+static void libev_backend_close(LibevBackend_t *backend) {
+  if (!backend->ev_loop) return;
+
+  if (ev_is_default_loop(backend->ev_loop) &&
+      backend->default_loop_generation != libev_default_loop_generation) {
+    // the loop the watchers were started on has been destroyed
+    backend->ev_loop = NULL;
+    return;
+  }
+
+  // the break_async watcher was unref'd on start, so the loop must be ref'd
+  // before stopping it, otherwise the loop's active watcher count is thrown off
+  ev_ref(backend->ev_loop);
+  ev_async_stop(backend->ev_loop, &backend->break_async);
+
+  if (!ev_is_default_loop(backend->ev_loop)) {
+    libev_fd_table_free(&backend->own_fd_table);
+    ev_loop_destroy(backend->ev_loop);
+  }
+  backend->ev_loop = NULL;
+}
+
 VALUE LibevBackend_finalize(VALUE self) {
   LibevBackend_t *backend;
   GetLibevBackend(self, backend);
 
-   ev_async_stop(backend->ev_loop, &backend->break_async);
-
-  if (!ev_is_default_loop(backend->ev_loop)) ev_loop_destroy(backend->ev_loop);
-
+  libev_backend_close(backend);
   return self;
 }
 
@@ -82,8 +206,15 @@ VALUE LibevBackend_post_fork(VALUE self) {
   // default one, as post_fork is called only from the main thread of the forked
   // process. That way we don't need to call ev_loop_fork, since the loop is
   // always a fresh one.
+  libev_fd_table_free(backend->fd_table);
   ev_loop_destroy(backend->ev_loop);
   backend->ev_loop = EV_DEFAULT;
+  backend->fd_table = &libev_default_loop_fd_table;
+  backend->default_loop_generation = ++libev_default_loop_generation;
+
+  ev_async_init(&backend->break_async, break_async_callback);
+  ev_async_start(backend->ev_loop, &backend->break_async);
+  ev_unref(backend->ev_loop); // don't count the break_async watcher
 
   return self;
 }
@@ -118,6 +249,13 @@ void LibevBackend_reset_ref_count(VALUE self) {
   backend->ref_count = 0;
 }
 
+// Returns the event loop time, in seconds on the monotonic clock
+VALUE LibevBackend_now(VALUE self) {
+  LibevBackend_t *backend;
+  GetLibevBackend(self, backend);
+  return DBL2NUM(ev_mn_now(backend->ev_loop));
+}
+
 VALUE LibevBackend_pending_count(VALUE self) {
   int count;
   LibevBackend_t *backend;
@@ -126,22 +264,25 @@ VALUE LibevBackend_pending_count(VALUE self) {
   return INT2NUM(count);
 }
 
-VALUE LibevBackend_poll(VALUE self, VALUE nowait, VALUE current_fiber, VALUE queue) {
+VALUE LibevBackend_poll(VALUE self, VALUE nowait, VALUE current_fiber, VALUE runnable_count) {
   int is_nowait = nowait == Qtrue;
   LibevBackend_t *backend;
   GetLibevBackend(self, backend);
 
   if (is_nowait) {
-    long runnable_count = Queue_len(queue);
     backend->run_no_wait_count++;
-    if (backend->run_no_wait_count < runnable_count || backend->run_no_wait_count < 10)
+    if (backend->run_no_wait_count < NUM2LONG(runnable_count) || backend->run_no_wait_count < 10)
       return self;
   }
 
   backend->run_no_wait_count = 0;
 
   COND_TRACE(2, SYM_fiber_ev_loop_enter, current_fiber);
-  backend->running = 1;
+  // The GVL is released while ev_run blocks (see the patched ev_run in
+  // libev/ev.c), so other threads may call LibevBackend_wakeup concurrently.
+  // The running flag itself is only accessed while holding the GVL. A
+  // non-blocking run returns immediately and does not need to be woken up.
+  backend->running = !is_nowait;
   ev_run(backend->ev_loop, is_nowait ? EVRUN_NOWAIT : EVRUN_ONCE);
   backend->running = 0;
   COND_TRACE(2, SYM_fiber_ev_loop_leave, current_fiber);
@@ -166,91 +307,111 @@ VALUE LibevBackend_wakeup(VALUE self) {
   return Qnil;
 }
 
-#include "polyphony.h"
-#include "../libev/ev.h"
-
-//////////////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////////////
-// the following is copied verbatim from the Ruby source code (io.c)
-struct io_internal_read_struct {
-    int fd;
-    int nonblock;
-    void *buf;
-    size_t capa;
-};
-
-#define StringValue(v) rb_string_value(&(v))
+void LibevBackend_io_callback(EV_P_ ev_io *w, int revents)
+{
+  struct libev_io *watcher = (struct libev_io *)w;
 
-int io_setstrbuf(VALUE *str, long len) {
-  #ifdef _WIN32
-    len = (len + 1) & ~1L;	/* round up for wide char */
-  #endif
-  if (NIL_P(*str)) {
-    *str = rb_str_new(0, len);
-    return 1;
-  }
-  else {
-    VALUE s = StringValue(*str);
-    long clen = RSTRING_LEN(s);
-    if (clen >= len) {
-      rb_str_modify(s);
-      return 0;
-    }
-    len -= clen;
+  // an fd watcher left active between waits (see libev_fd_watchers_t)
+  if (watcher->fiber == Qnil) {
+    ev_io_stop(EV_A_ w);
+    return;
   }
-  rb_str_modify_expand(*str, len);
-  return 0;
+  if (watcher->fired) return;
+
+  watcher->fired = 1;
+  Fiber_make_runnable(watcher->fiber, Qnil);
 }
 
-#define MAX_REALLOC_GAP 4096
-static void io_shrink_read_string(VALUE str, long n) {
-  if (rb_str_capacity(str) - n > MAX_REALLOC_GAP) {
-    rb_str_resize(str, n);
-  }
+static inline VALUE libev_await(LibevBackend_t *backend) {
+  VALUE ret;
+  backend->ref_count++;
+  ret = Thread_switch_fiber(rb_thread_current());
+  backend->ref_count--;
+  RB_GC_GUARD(ret);
+  return ret;
 }
 
-void io_set_read_length(VALUE str, long n, int shrinkable) {
-  if (RSTRING_LEN(str) != n) {
-    rb_str_modify(str);
-    rb_str_set_len(str, n);
-    if (shrinkable) io_shrink_read_string(str, n);
-  }
+// Yields to other fibers after processing pending events, so fibers waiting on
+// I/O are not starved.
+static VALUE libev_snooze(LibevBackend_t *backend) {
+  backend->run_no_wait_count = 0;
+  ev_run(backend->ev_loop, EVRUN_NOWAIT);
+  return backend_snooze();
 }
 
-static rb_encoding* io_read_encoding(rb_io_t *fptr) {
-    if (fptr->encs.enc) {
-	return fptr->encs.enc;
-    }
-    return rb_default_external_encoding();
+// Called after an I/O operation completed without waiting. Once the current
+// fiber has used up its budget, pending events are processed so fibers waiting
+// on I/O are not starved, and the fiber yields if any other fiber is runnable.
+VALUE libev_snooze_if_over_budget(LibevBackend_t *backend) {
+  thread_sched_t *sched = backend->sched;
+  if (!backend_budget_spend(&sched->budget)) return Qnil;
+
+  backend->run_no_wait_count = 0;
+  ev_run(backend->ev_loop, EVRUN_NOWAIT);
+  if (sched->run_queue.count == 0 && !__atomic_load_n(&sched->inbox, __ATOMIC_RELAXED)) {
+    backend_budget_reset(&sched->budget);
+    return Qnil;
+  }
+  return backend_snooze();
 }
 
-VALUE io_enc_str(VALUE str, rb_io_t *fptr) {
-    OBJ_TAINT(str);
-    rb_enc_associate(str, io_read_encoding(fptr));
-    return str;
+ID ID_ivar_is_nonblocking;
+ID ID_ivar_watcher_token;
+static long libev_watcher_token = 0;
+
+static libev_fd_watchers_t *libev_fd_watchers_new(int fd) {
+  libev_fd_watchers_t *entry = malloc(sizeof(libev_fd_watchers_t));
+  if (!entry) rb_raise(rb_eNoMemError, "Failed to allocate fd watchers");
+
+  ev_io_init(&entry->read.io, LibevBackend_io_callback, fd, EV_READ);
+  ev_io_init(&entry->write.io, LibevBackend_io_callback, fd, EV_WRITE);
+  entry->read.fiber = entry->write.fiber = Qnil;
+  entry->read.fired = entry->write.fired = 0;
+  return entry;
 }
 
-//////////////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////////////
+// Returns the persistent watchers for the given IO, or NULL if they are in use
+// by another IO object sharing the same fd.
+static libev_fd_watchers_t *libev_fd_watchers_get(LibevBackend_t *backend, VALUE io, int fd) {
+  libev_fd_table_t *table = backend->fd_table;
+  libev_fd_watchers_t *entry;
+  VALUE token;
+
+  if (fd >= table->size) {
+    int new_size = table->size ? table->size : 64;
+    while (new_size <= fd) new_size *= 2;
+    libev_fd_watchers_t **entries = realloc(
+      table->entries, new_size * sizeof(libev_fd_watchers_t *)
+    );
+    if (!entries) rb_raise(rb_eNoMemError, "Failed to allocate fd watchers");
+    memset(
+      entries + table->size, 0,
+      (new_size - table->size) * sizeof(libev_fd_watchers_t *)
+    );
+    table->entries = entries;
+    table->size = new_size;
+  }
 
-struct libev_io {
-  struct ev_io io;
-  VALUE fiber;
-};
+  entry = table->entries[fd];
+  token = rb_ivar_get(io, ID_ivar_watcher_token);
+  if (entry && FIXNUM_P(token) && FIX2LONG(token) == entry->token) return entry;
 
-void LibevBackend_io_callback(EV_P_ ev_io *w, int revents)
-{
-  struct libev_io *watcher = (struct libev_io *)w;
-  Fiber_make_runnable(watcher->fiber, Qnil);
-}
+  if (!entry)
+    entry = table->entries[fd] = libev_fd_watchers_new(fd);
+  else {
+    if (entry->read.fiber != Qnil || entry->write.fiber != Qnil) return NULL;
+
+    // Setting the fd anew makes libev reregister it with the kernel, which is
+    // needed in case the previous fd with this number has been closed.
+    ev_io_stop(backend->ev_loop, &entry->read.io);
+    ev_io_stop(backend->ev_loop, &entry->write.io);
+    ev_io_set(&entry->read.io, fd, EV_READ);
+    ev_io_set(&entry->write.io, fd, EV_WRITE);
+  }
 
-inline VALUE libev_await(LibevBackend_t *backend) {
-  VALUE ret;
-  backend->ref_count++;
-  ret = Thread_switch_fiber(rb_thread_current());
-  backend->ref_count--;
-  RB_GC_GUARD(ret);
-  return ret;
+  entry->token = ++libev_watcher_token;
+  rb_ivar_set(io, ID_ivar_watcher_token, LONG2FIX(entry->token));
+  return entry;
 }
 
 VALUE libev_wait_fd_with_watcher(LibevBackend_t *backend, int fd, struct libev_io *watcher, int events) {
@@ -258,6 +419,7 @@ VALUE libev_wait_fd_with_watcher(LibevBackend_t *backend, int fd, struct libev_i
 
   if (watcher->fiber == Qnil) {
     watcher->fiber = rb_fiber_current();
+    watcher->fired = 0;
     ev_io_init(&watcher->io, LibevBackend_io_callback, fd, events);
   }
   ev_io_start(backend->ev_loop, &watcher->io);
@@ -269,55 +431,66 @@ VALUE libev_wait_fd_with_watcher(LibevBackend_t *backend, int fd, struct libev_i
   return switchpoint_result;
 }
 
-VALUE libev_wait_fd(LibevBackend_t *backend, int fd, int events, int raise_exception) {
-  struct libev_io watcher;
+// Waits for the given IO to become readable or writable, using its persistent
+// watcher. Falls back to a temporary watcher if the persistent one is already
+// used by another fiber.
+VALUE libev_wait_io(LibevBackend_t *backend, VALUE io, int fd, int events) {
+  libev_fd_watchers_t *entry = libev_fd_watchers_get(backend, io, fd);
+  struct libev_io *watcher = NULL;
   VALUE switchpoint_result = Qnil;
-  watcher.fiber = Qnil;
 
-  switchpoint_result = libev_wait_fd_with_watcher(backend, fd, &watcher, events);
+  if (entry) watcher = (events & EV_READ) ? &entry->read : &entry->write;
+  if (!watcher || watcher->fiber != Qnil) {
+    struct libev_io tmp_watcher;
+    tmp_watcher.fiber = Qnil;
+    return libev_wait_fd_with_watcher(backend, fd, &tmp_watcher, events);
+  }
+
+  watcher->fiber = rb_fiber_current();
+  watcher->fired = 0;
+  if (!ev_is_active(&watcher->io)) ev_io_start(backend->ev_loop, &watcher->io);
+
+  switchpoint_result = libev_await(backend);
 
-  if (raise_exception) TEST_RESUME_EXCEPTION(switchpoint_result);
+  watcher->fiber = Qnil;
   RB_GC_GUARD(switchpoint_result);
   return switchpoint_result;
 }
 
-VALUE libev_snooze() {
-  Fiber_make_runnable(rb_fiber_current(), Qnil);
-  return Thread_switch_fiber(rb_thread_current());
-}
+// Stops the persistent watchers for the given IO's fd. Called by IO#close
+// before the fd is closed, since libev would otherwise apply a later change to
+// the fd's watchers by calling epoll_ctl on the closed fd.
+VALUE LibevBackend_release_io(VALUE self, VALUE io) {
+  LibevBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE underlying_io = rb_iv_get(io, "@io");
+  GetLibevBackend(self, backend);
+  if (underlying_io != Qnil) io = underlying_io;
+  GetOpenFile(io, fptr);
 
-ID ID_ivar_is_nonblocking;
+  if (!backend->ev_loop || fptr->fd >= backend->fd_table->size) return self;
 
-// Since we need to ensure that fd's are non-blocking before every I/O
-// operation, here we improve upon Ruby's rb_io_set_nonblock by caching the
-// "nonblock" state in an instance variable. Calling rb_ivar_get on every read
-// is still much cheaper than doing a fcntl syscall on every read! Preliminary
-// benchmarks (with a "hello world" HTTP server) show throughput is improved
-// by 10-13%.
-inline void io_set_nonblock(rb_io_t *fptr, VALUE io) {
-  VALUE is_nonblocking = rb_ivar_get(io, ID_ivar_is_nonblocking);
-  if (is_nonblocking == Qtrue) return;
-
-  rb_ivar_set(io, ID_ivar_is_nonblocking, Qtrue);
-
-#ifdef _WIN32
-  rb_w32_set_nonblock(fptr->fd);
-#elif defined(F_GETFL)
-  int oflags = fcntl(fptr->fd, F_GETFL);
-  if ((oflags == -1) && (oflags & O_NONBLOCK)) return;
-  oflags |= O_NONBLOCK;
-  fcntl(fptr->fd, F_SETFL, oflags);
-#endif
+  libev_fd_watchers_t *entry = backend->fd_table->entries[fptr->fd];
+  if (entry) {
+    ev_io_stop(backend->ev_loop, &entry->read.io);
+    ev_io_stop(backend->ev_loop, &entry->write.io);
+  }
+  return self;
 }
 
-VALUE LibevBackend_read(VALUE self, VALUE io, VALUE str, VALUE length, VALUE to_eof) {
+// Reads from the given IO into the given buffer (or a new string if nil). If a
+// buffer position is given, the data read is stored at that offset, or
+// appended to the buffer if the position is -1.
+VALUE LibevBackend_read(int argc, VALUE *argv, VALUE self) {
   LibevBackend_t *backend;
-  struct libev_io watcher;
   rb_io_t *fptr;
+  VALUE io, str, length, to_eof, pos;
+  rb_scan_args(argc, argv, "41", &io, &str, &length, &to_eof, &pos);
   long dynamic_len = length == Qnil;
   long len = dynamic_len ? 4096 : NUM2INT(length);
-  int shrinkable = io_setstrbuf(&str, len);
-  char *buf = RSTRING_PTR(str);
+  long buffer_pos = io_read_buffer_pos(str, pos);
+  int shrinkable = io_setstrbuf(&str, buffer_pos + len);
+  char *buf = RSTRING_PTR(str) + buffer_pos;
   long total = 0;
   VALUE switchpoint_result = Qnil;
   int read_to_eof = RTEST(to_eof);
@@ -328,7 +501,6 @@ VALUE LibevBackend_read(VALUE self, VALUE io, VALUE str, VALUE length, VALUE to_
   GetOpenFile(io, fptr);
   rb_io_check_byte_readable(fptr);
   io_set_nonblock(fptr, io);
-  watcher.fiber = Qnil;
 
   OBJ_TAINT(str);
 
@@ -347,12 +519,12 @@ VALUE LibevBackend_read(VALUE self, VALUE io, VALUE str, VALUE length, VALUE to_
       int e = errno;
       if (e != EWOULDBLOCK && e != EAGAIN) rb_syserr_fail(e, strerror(e));
 
-      switchpoint_result = libev_wait_fd_with_watcher(backend, fptr->fd, &watcher, EV_READ);
+      switchpoint_result = libev_wait_io(backend, io, fptr->fd, EV_READ);
 
       if (TEST_EXCEPTION(switchpoint_result)) goto error;
     }
     else {
-      switchpoint_result = libev_snooze();
+      switchpoint_result = libev_snooze_if_over_budget(backend);
 
       if (TEST_EXCEPTION(switchpoint_result)) goto error;
 
@@ -363,9 +535,9 @@ VALUE LibevBackend_read(VALUE self, VALUE io, VALUE str, VALUE length, VALUE to_
       if (total == len) {
         if (!dynamic_len) break;
 
-        rb_str_resize(str, total);
+        rb_str_resize(str, buffer_pos + total);
         rb_str_modify_expand(str, len);
-        buf = RSTRING_PTR(str) + total;
+        buf = RSTRING_PTR(str) + buffer_pos + total;
         shrinkable = 0;
         len += len;
       }
@@ -373,12 +545,11 @@ VALUE LibevBackend_read(VALUE self, VALUE io, VALUE str, VALUE length, VALUE to_
     }
   }
 
-  io_set_read_length(str, total, shrinkable);
+  io_set_read_length(str, buffer_pos + total, shrinkable);
   io_enc_str(str, fptr);
 
   if (total == 0) return Qnil;
 
-  RB_GC_GUARD(watcher.fiber);
   RB_GC_GUARD(switchpoint_result);
 
   return str;
@@ -386,11 +557,16 @@ error:
   return RAISE_EXCEPTION(switchpoint_result);
 }
 
-VALUE LibevBackend_read_loop(VALUE self, VALUE io) {
+// Reads from the given IO until EOF, yielding each chunk read. If a buffer is
+// given, it is reused for all chunks (the yielded string is then overwritten on
+// the next read, so it should not be kept by the caller). Otherwise a new
+// string is allocated for each chunk. Chunks may also be split into frames
+// using the length_header or delimiter options (see read_framer_t).
+VALUE LibevBackend_read_loop(int argc, VALUE *argv, VALUE self) {
 
   #define PREPARE_STR() { \
-    str = Qnil; \
-    shrinkable = io_setstrbuf(&str, len); \
+    str = buffer; \
+    shrinkable = io_setstrbuf(&str, len) && (buffer == Qnil); \
     buf = RSTRING_PTR(str); \
     total = 0; \
     OBJ_TAINT(str); \
@@ -404,24 +580,28 @@ VALUE LibevBackend_read_loop(VALUE self, VALUE io) {
   }
 
   LibevBackend_t *backend;
-  struct libev_io watcher;
   rb_io_t *fptr;
-  VALUE str;
+  VALUE io;
+  VALUE buffer;
+  VALUE str = Qnil;
   long total;
-  long len = 8192;
-  int shrinkable;
-  char *buf;
+  long len = READ_LOOP_INIT_LEN;
+  int shrinkable = 0;
+  char *buf = NULL;
   VALUE switchpoint_result = Qnil;
-  VALUE underlying_io = rb_iv_get(io, "@io");
+  VALUE underlying_io;
+  VALUE opts;
+  read_framer_t framer;
 
-  PREPARE_STR();
+  rb_scan_args(argc, argv, "11:", &io, &buffer, &opts);
+  underlying_io = rb_iv_get(io, "@io");
+  read_framer_init(&framer, buffer, opts);
 
   GetLibevBackend(self, backend);
   if (underlying_io != Qnil) io = underlying_io;
   GetOpenFile(io, fptr);
   rb_io_check_byte_readable(fptr);
   io_set_nonblock(fptr, io);
-  watcher.fiber = Qnil;
 
   // Apparently after reopening a closed file, the file position is not reset,
   // which causes the read to fail. Fortunately we can use fptr->rbuf.len to
@@ -432,28 +612,39 @@ VALUE LibevBackend_read_loop(VALUE self, VALUE io) {
     fptr->rbuf.len = 0;
   }
 
+  read_framer_feed_initial(&framer, fptr);
+  if (framer.mode == READ_FRAMING_NONE) PREPARE_STR();
+
   while (1) {
+    if (framer.mode != READ_FRAMING_NONE) buf = read_framer_prepare(&framer, len);
     ssize_t n = read(fptr->fd, buf, len);
     if (n < 0) {
       int e = errno;
       if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
 
-      switchpoint_result = libev_wait_fd_with_watcher(backend, fptr->fd, &watcher, EV_READ);
+      switchpoint_result = libev_wait_io(backend, io, fptr->fd, EV_READ);
       if (TEST_EXCEPTION(switchpoint_result)) goto error;
     }
     else {
-      switchpoint_result = libev_snooze();
+      switchpoint_result = libev_snooze_if_over_budget(backend);
 
       if (TEST_EXCEPTION(switchpoint_result)) goto error;
 
       if (n == 0) break; // EOF
+      len = read_loop_adapt_len(len, n);
+      if (framer.mode != READ_FRAMING_NONE) {
+        read_framer_feed(&framer, n, fptr);
+        continue;
+      }
       total = n;
       YIELD_STR();
     }
   }
 
   RB_GC_GUARD(str);
-  RB_GC_GUARD(watcher.fiber);
+  RB_GC_GUARD(framer.data);
+  RB_GC_GUARD(framer.delimiter);
+  RB_GC_GUARD(framer.initial);
   RB_GC_GUARD(switchpoint_result);
 
   return io;
@@ -463,20 +654,20 @@ error:
 
 VALUE LibevBackend_write(VALUE self, VALUE io, VALUE str) {
   LibevBackend_t *backend;
-  struct libev_io watcher;
   rb_io_t *fptr;
   VALUE switchpoint_result = Qnil;
   VALUE underlying_io;
   char *buf = StringValuePtr(str);
   long len = RSTRING_LEN(str);
   long left = len;
+  int waited = 0;
 
   underlying_io = rb_iv_get(io, "@io");
   if (underlying_io != Qnil) io = underlying_io;
   GetLibevBackend(self, backend);
   io = rb_io_get_write_io(io);
   GetOpenFile(io, fptr);
-  watcher.fiber = Qnil;
+  io_set_nonblock(fptr, io);
 
   while (left > 0) {
     ssize_t n = write(fptr->fd, buf, left);
@@ -484,7 +675,8 @@ VALUE LibevBackend_write(VALUE self, VALUE io, VALUE str) {
       int e = errno;
       if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
 
-      switchpoint_result = libev_wait_fd_with_watcher(backend, fptr->fd, &watcher, EV_WRITE);
+      switchpoint_result = libev_wait_io(backend, io, fptr->fd, EV_WRITE);
+      waited = 1;
 
       if (TEST_EXCEPTION(switchpoint_result)) goto error;
     }
@@ -494,13 +686,12 @@ VALUE LibevBackend_write(VALUE self, VALUE io, VALUE str) {
     }
   }
 
-  if (watcher.fiber == Qnil) {
-    switchpoint_result = libev_snooze();
+  if (!waited) {
+    switchpoint_result = libev_snooze_if_over_budget(backend);
 
     if (TEST_EXCEPTION(switchpoint_result)) goto error;
   }
 
-  RB_GC_GUARD(watcher.fiber);
   RB_GC_GUARD(switchpoint_result);
 
   return INT2NUM(len);
@@ -508,97 +699,110 @@ error:
   return RAISE_EXCEPTION(switchpoint_result);
 }
 
-VALUE LibevBackend_writev(VALUE self, VALUE io, int argc, VALUE *argv) {
+// Writes the given strings (or the strings in the given array) using writev.
+VALUE LibevBackend_writev(VALUE self, VALUE io, VALUE ary, int argc, VALUE *argv) {
   LibevBackend_t *backend;
-  struct libev_io watcher;
   rb_io_t *fptr;
   VALUE switchpoint_result = Qnil;
   VALUE underlying_io;
-  long total_length = 0;
   long total_written = 0;
-  struct iovec *iov = 0;
-  struct iovec *iov_ptr = 0;
-  int iov_count = argc;
+  backend_writev_t w;
+  int waited = 0;
 
   underlying_io = rb_iv_get(io, "@io");
   if (underlying_io != Qnil) io = underlying_io;
   GetLibevBackend(self, backend);
   io = rb_io_get_write_io(io);
   GetOpenFile(io, fptr);
-  watcher.fiber = Qnil;
-
-  iov = malloc(iov_count * sizeof(struct iovec));
-  for (int i = 0; i < argc; i++) {
-    VALUE str = argv[i];
-    iov[i].iov_base = StringValuePtr(str);
-    iov[i].iov_len = RSTRING_LEN(str);
-    total_length += iov[i].iov_len;
-  }
-  iov_ptr = iov;
+  io_set_nonblock(fptr, io);
 
-  while (1) {
-    ssize_t n = writev(fptr->fd, iov_ptr, iov_count);
-    if (n < 0) {
-      int e = errno;
-      if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
+  backend_writev_init(&w, ary, argv, argc);
+  while (backend_writev_fill(&w)) {
+    while (w.iov_count > 0) {
+      ssize_t n = writev(fptr->fd, w.iov_ptr, w.iov_count);
+      if (n < 0) {
+        int e = errno;
+        if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
 
-      switchpoint_result = libev_wait_fd_with_watcher(backend, fptr->fd, &watcher, EV_WRITE);
+        switchpoint_result = libev_wait_io(backend, io, fptr->fd, EV_WRITE);
+        waited = 1;
 
-      if (TEST_EXCEPTION(switchpoint_result)) goto error;
-    }
-    else {
-      total_written += n;
-      if (total_written == total_length) break;
-
-      while (n > 0) {
-        if ((size_t) n < iov_ptr[0].iov_len) {
-          iov_ptr[0].iov_base = (char *) iov_ptr[0].iov_base + n;
-          iov_ptr[0].iov_len -= n;
-          n = 0;
-        }
-        else {
-          n -= iov_ptr[0].iov_len;
-          iov_ptr += 1;
-          iov_count -= 1;
-        }
+        if (TEST_EXCEPTION(switchpoint_result)) goto error;
+      }
+      else {
+        total_written += n;
+        backend_writev_advance(&w, n);
       }
     }
   }
-  if (watcher.fiber == Qnil) {
-    switchpoint_result = libev_snooze();
+  if (!waited) {
+    switchpoint_result = libev_snooze_if_over_budget(backend);
 
     if (TEST_EXCEPTION(switchpoint_result)) goto error;
   }
 
-  RB_GC_GUARD(watcher.fiber);
+  RB_GC_GUARD(ary);
   RB_GC_GUARD(switchpoint_result);
 
-  free(iov);
   return INT2NUM(total_written);
 error:
-  free(iov);
   return RAISE_EXCEPTION(switchpoint_result);
 }
 
+// Backend#write accepts either one or more strings, or an array of strings.
 VALUE LibevBackend_write_m(int argc, VALUE *argv, VALUE self) {
   if (argc < 2)
-    // TODO: raise ArgumentError
-    rb_raise(rb_eRuntimeError, "(wrong number of arguments (expected 2 or more))");
+    rb_raise(rb_eArgError, "wrong number of arguments (given %d, expected 2+)", argc);
 
-  return (argc == 2) ?
-    LibevBackend_write(self, argv[0], argv[1]) :
-    LibevBackend_writev(self, argv[0], argc - 1, argv + 1);
+  if (argc == 2)
+    return RB_TYPE_P(argv[1], T_ARRAY) ?
+      LibevBackend_writev(self, argv[0], argv[1], 0, NULL) :
+      LibevBackend_write(self, argv[0], argv[1]);
+  return LibevBackend_writev(self, argv[0], Qnil, argc - 1, argv + 1);
 }
 
 ///////////////////////////////////////////////////////////////////////////
 
+// Accepts a pending connection, returning the accepted fd in non-blocking
+// mode, or -1 if none is pending. Where available, accept4 is used to set the
+// fd's flags without additional syscalls.
+static inline int libev_accept_fd(int server_fd) {
+#ifdef SOCK_NONBLOCK
+  return accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  int fd = accept(server_fd, NULL, NULL);
+  if (fd >= 0) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    rb_fd_fix_cloexec(fd);
+  }
+  return fd;
+#endif
+}
+
+static VALUE libev_make_socket(int fd) {
+  VALUE socket;
+  rb_io_t *fp;
+
+  socket = rb_obj_alloc(cTCPSocket);
+  MakeOpenFile(socket, fp);
+  rb_update_max_fd(fd);
+  fp->fd = fd;
+  fp->mode = FMODE_READWRITE | FMODE_DUPLEX;
+  rb_io_ascii8bit_binmode(socket);
+  // the accepted fd is already in non-blocking mode
+  rb_ivar_set(socket, ID_ivar_is_nonblocking, Qtrue);
+  rb_io_synchronized(fp);
+
+  // if (rsock_do_not_reverse_lookup) {
+  //   fp->mode |= FMODE_NOREVLOOKUP;
+  // }
+  return socket;
+}
+
 VALUE LibevBackend_accept(VALUE self, VALUE sock) {
   LibevBackend_t *backend;
-  struct libev_io watcher;
   rb_io_t *fptr;
   int fd;
-  struct sockaddr addr;
-  socklen_t len = (socklen_t)sizeof addr;
   VALUE switchpoint_result = Qnil;
   VALUE underlying_sock = rb_iv_get(sock, "@io");
   if (underlying_sock != Qnil) sock = underlying_sock;
@@ -606,40 +810,25 @@ VALUE LibevBackend_accept(VALUE self, VALUE sock) {
   GetLibevBackend(self, backend);
   GetOpenFile(sock, fptr);
   io_set_nonblock(fptr, sock);
-  watcher.fiber = Qnil;
   while (1) {
-    fd = accept(fptr->fd, &addr, &len);
+    fd = libev_accept_fd(fptr->fd);
     if (fd < 0) {
       int e = errno;
       if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
 
-      switchpoint_result = libev_wait_fd_with_watcher(backend, fptr->fd, &watcher, EV_READ);
+      switchpoint_result = libev_wait_io(backend, sock, fptr->fd, EV_READ);
 
       if (TEST_EXCEPTION(switchpoint_result)) goto error;
     }
     else {
-      VALUE socket;
-      rb_io_t *fp;
-      switchpoint_result = libev_snooze();
+      switchpoint_result = libev_snooze_if_over_budget(backend);
 
       if (TEST_EXCEPTION(switchpoint_result)) {
         close(fd); // close fd since we're raising an exception
         goto error;
       }
 
-      socket = rb_obj_alloc(cTCPSocket);
-      MakeOpenFile(socket, fp);
-      rb_update_max_fd(fd);
-      fp->fd = fd;
-      fp->mode = FMODE_READWRITE | FMODE_DUPLEX;
-      rb_io_ascii8bit_binmode(socket);
-      io_set_nonblock(fp, socket);
-      rb_io_synchronized(fp);
-
-      // if (rsock_do_not_reverse_lookup) {
-	    //   fp->mode |= FMODE_NOREVLOOKUP;
-      // }
-      return socket;
+      return libev_make_socket(fd);
     }
   }
   RB_GC_GUARD(switchpoint_result);
@@ -648,58 +837,59 @@ error:
   return RAISE_EXCEPTION(switchpoint_result);
 }
 
-VALUE LibevBackend_accept_loop(VALUE self, VALUE sock) {
+#define ACCEPT_LOOP_DEFAULT_BATCH 64
+
+// Accepts connections in a loop, yielding each accepted socket. Once the
+// server socket is readable, all pending connections are accepted, up to the
+// given batch size, before yielding to other fibers.
+VALUE LibevBackend_accept_loop(int argc, VALUE *argv, VALUE self) {
   LibevBackend_t *backend;
-  struct libev_io watcher;
   rb_io_t *fptr;
+  VALUE sock;
+  VALUE batch;
   int fd;
-  struct sockaddr addr;
-  socklen_t len = (socklen_t)sizeof addr;
+  long batch_len;
+  long accepted = 0;
   VALUE switchpoint_result = Qnil;
   VALUE socket = Qnil;
+
+  rb_scan_args(argc, argv, "11", &sock, &batch);
+  batch_len = NIL_P(batch) ? ACCEPT_LOOP_DEFAULT_BATCH : NUM2LONG(batch);
+  if (batch_len <= 0) rb_raise(rb_eArgError, "batch size must be positive");
+
   VALUE underlying_sock = rb_iv_get(sock, "@io");
   if (underlying_sock != Qnil) sock = underlying_sock;
 
   GetLibevBackend(self, backend);
   GetOpenFile(sock, fptr);
   io_set_nonblock(fptr, sock);
-  watcher.fiber = Qnil;
 
   while (1) {
-    fd = accept(fptr->fd, &addr, &len);
+    fd = libev_accept_fd(fptr->fd);
     if (fd < 0) {
       int e = errno;
       if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
 
-      switchpoint_result = libev_wait_fd_with_watcher(backend, fptr->fd, &watcher, EV_READ);
+      accepted = 0;
+      switchpoint_result = libev_wait_io(backend, sock, fptr->fd, EV_READ);
 
       if (TEST_EXCEPTION(switchpoint_result)) goto error;
     }
     else {
-      rb_io_t *fp;
-      switchpoint_result = libev_snooze();
-
-      if (TEST_EXCEPTION(switchpoint_result)) {
-        close(fd); // close fd since we're raising an exception
-        goto error;
-      }
-
-      socket = rb_obj_alloc(cTCPSocket);
-      MakeOpenFile(socket, fp);
-      rb_update_max_fd(fd);
-      fp->fd = fd;
-      fp->mode = FMODE_READWRITE | FMODE_DUPLEX;
-      rb_io_ascii8bit_binmode(socket);
-      io_set_nonblock(fp, socket);
-      rb_io_synchronized(fp);
-
+      socket = libev_make_socket(fd);
       rb_yield(socket);
       socket = Qnil;
+
+      if (++accepted == batch_len) {
+        accepted = 0;
+        switchpoint_result = libev_snooze(backend);
+
+        if (TEST_EXCEPTION(switchpoint_result)) goto error;
+      }
     }
   }
 
   RB_GC_GUARD(socket);
-  RB_GC_GUARD(watcher.fiber);
   RB_GC_GUARD(switchpoint_result);
   return Qnil;
 error:
@@ -708,7 +898,6 @@ error:
 
 VALUE LibevBackend_connect(VALUE self, VALUE sock, VALUE host, VALUE port) {
   LibevBackend_t *backend;
-  struct libev_io watcher;
   rb_io_t *fptr;
   struct sockaddr_in addr;
   char *host_buf = StringValueCStr(host);
@@ -719,7 +908,6 @@ VALUE LibevBackend_connect(VALUE self, VALUE sock, VALUE host, VALUE port) {
   GetLibevBackend(self, backend);
   GetOpenFile(sock, fptr);
   io_set_nonblock(fptr, sock);
-  watcher.fiber = Qnil;
 
   addr.sin_family = AF_INET;
   addr.sin_addr.s_addr = inet_addr(host_buf);
@@ -730,12 +918,12 @@ VALUE LibevBackend_connect(VALUE self, VALUE sock, VALUE host, VALUE port) {
     int e = errno;
     if (e != EINPROGRESS) rb_syserr_fail(e, strerror(e));
 
-    switchpoint_result = libev_wait_fd_with_watcher(backend, fptr->fd, &watcher, EV_WRITE);
+    switchpoint_result = libev_wait_io(backend, sock, fptr->fd, EV_WRITE);
 
     if (TEST_EXCEPTION(switchpoint_result)) goto error;
   }
   else {
-    switchpoint_result = libev_snooze();
+    switchpoint_result = libev_snooze_if_over_budget(backend);
 
     if (TEST_EXCEPTION(switchpoint_result)) goto error;
   }
@@ -745,16 +933,480 @@ error:
   return RAISE_EXCEPTION(switchpoint_result);
 }
 
+// Receives a message into the given msghdr, waiting for the socket to become
+// readable. If MSG_DONTWAIT is given, raises IO::EAGAINWaitReadable instead of
+// waiting. Returns the number of bytes received, or -1 if the fiber was
+// resumed with an exception (stored in *switchpoint_result).
+static ssize_t libev_recvmsg(
+  LibevBackend_t *backend, VALUE io, int fd, struct msghdr *msg, int flags,
+  VALUE *switchpoint_result
+) {
+  while (1) {
+    ssize_t n = recvmsg(fd, msg, flags);
+    if (n < 0) {
+      int e = errno;
+      if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
+      if (flags & MSG_DONTWAIT)
+        rb_readwrite_syserr_fail(RB_IO_WAIT_READABLE, e, "recvmsg(2) would block");
+
+      *switchpoint_result = libev_wait_io(backend, io, fd, EV_READ);
+      if (TEST_EXCEPTION(*switchpoint_result)) return -1;
+    }
+    else {
+      *switchpoint_result = libev_snooze_if_over_budget(backend);
+      return TEST_EXCEPTION(*switchpoint_result) ? -1 : n;
+    }
+  }
+}
+
+// Sends the message in the given msghdr, waiting for the socket to become
+// writable until the whole message is sent. If MSG_DONTWAIT is given, a single
+// attempt is made, and IO::EAGAINWaitWritable is raised if nothing could be
+// sent. Returns the number of bytes sent, or -1 if the fiber was resumed with
+// an exception (stored in *switchpoint_result).
+static ssize_t libev_sendmsg(
+  LibevBackend_t *backend, VALUE io, int fd, struct msghdr *msg, int flags,
+  VALUE *switchpoint_result
+) {
+  char *buf = msg->msg_iov[0].iov_base;
+  size_t left = msg->msg_iov[0].iov_len;
+  ssize_t total = 0;
+  int waited = 0;
+
+  while (1) {
+    ssize_t n = sendmsg(fd, msg, flags);
+    if (n < 0) {
+      int e = errno;
+      if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
+      if (flags & MSG_DONTWAIT)
+        rb_readwrite_syserr_fail(RB_IO_WAIT_WRITABLE, e, "sendmsg(2) would block");
+
+      *switchpoint_result = libev_wait_io(backend, io, fd, EV_WRITE);
+      waited = 1;
+      if (TEST_EXCEPTION(*switchpoint_result)) return -1;
+      continue;
+    }
+
+    total += n;
+    left -= n;
+    if (left == 0 || (flags & MSG_DONTWAIT)) break;
+
+    buf += n;
+    msg->msg_iov[0].iov_base = buf;
+    msg->msg_iov[0].iov_len = left;
+  }
+
+  if (!waited) {
+    *switchpoint_result = libev_snooze_if_over_budget(backend);
+    if (TEST_EXCEPTION(*switchpoint_result)) return -1;
+  }
+  return total;
+}
+
+static VALUE libev_get_socket(VALUE sock, rb_io_t **fptr) {
+  VALUE underlying_sock = rb_iv_get(sock, "@io");
+  if (underlying_sock != Qnil) sock = underlying_sock;
+  GetOpenFile(sock, *fptr);
+  io_set_nonblock(*fptr, sock);
+  return sock;
+}
+
+// Receives up to maxlen bytes from the given socket, with the given flags
+// (e.g. MSG_PEEK). If a buffer is given, the data is read into it. Returns nil
+// on EOF.
+VALUE LibevBackend_recv(int argc, VALUE *argv, VALUE self) {
+  LibevBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE io, maxlen, flags, str;
+  VALUE switchpoint_result = Qnil;
+  struct msghdr msg;
+  struct iovec iov;
+  int shrinkable;
+  long len;
+  ssize_t n;
+
+  rb_scan_args(argc, argv, "22", &io, &maxlen, &flags, &str);
+  len = NUM2LONG(maxlen);
+  shrinkable = io_setstrbuf(&str, len);
+  OBJ_TAINT(str);
+
+  GetLibevBackend(self, backend);
+  io = libev_get_socket(io, &fptr);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = RSTRING_PTR(str);
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  n = libev_recvmsg(backend, io, fptr->fd, &msg, NIL_P(flags) ? 0 : NUM2INT(flags), &switchpoint_result);
+  if (n < 0) goto error;
+
+  io_set_read_length(str, n, shrinkable);
+  io_enc_str(str, fptr);
+  if (n == 0 && len > 0 && socket_is_stream(fptr->fd)) return Qnil;
+
+  RB_GC_GUARD(switchpoint_result);
+  return str;
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// Receives up to maxlen bytes from the given socket, returning the data along
+// with the sender address and the received message flags. Returns nil on EOF.
+VALUE LibevBackend_recvmsg(int argc, VALUE *argv, VALUE self) {
+  LibevBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE io, maxlen, flags, str = Qnil;
+  VALUE switchpoint_result = Qnil;
+  struct sockaddr_storage addr;
+  struct msghdr msg;
+  struct iovec iov;
+  int shrinkable;
+  long len;
+  ssize_t n;
+
+  rb_scan_args(argc, argv, "21", &io, &maxlen, &flags);
+  len = NUM2LONG(maxlen);
+  shrinkable = io_setstrbuf(&str, len);
+  OBJ_TAINT(str);
+
+  GetLibevBackend(self, backend);
+  io = libev_get_socket(io, &fptr);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = RSTRING_PTR(str);
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_name = &addr;
+  msg.msg_namelen = sizeof(addr);
+
+  n = libev_recvmsg(backend, io, fptr->fd, &msg, NIL_P(flags) ? 0 : NUM2INT(flags), &switchpoint_result);
+  if (n < 0) goto error;
+
+  io_set_read_length(str, n, shrinkable);
+  io_enc_str(str, fptr);
+  if (n == 0 && len > 0 && socket_is_stream(fptr->fd)) return Qnil;
+
+  RB_GC_GUARD(switchpoint_result);
+  return recvmsg_result(str, &msg);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// Sends the given string on the given socket, with the given flags (e.g.
+// MSG_MORE). Returns the number of bytes sent.
+VALUE LibevBackend_send(int argc, VALUE *argv, VALUE self) {
+  LibevBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE io, str, flags;
+  VALUE switchpoint_result = Qnil;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t n;
+
+  rb_scan_args(argc, argv, "21", &io, &str, &flags);
+  StringValue(str);
+
+  GetLibevBackend(self, backend);
+  io = libev_get_socket(io, &fptr);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = RSTRING_PTR(str);
+  iov.iov_len = RSTRING_LEN(str);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  n = libev_sendmsg(backend, io, fptr->fd, &msg, NIL_P(flags) ? 0 : NUM2INT(flags), &switchpoint_result);
+  if (n < 0) goto error;
+
+  RB_GC_GUARD(str);
+  RB_GC_GUARD(switchpoint_result);
+  return LONG2NUM(n);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// Sends the given string on the given socket, optionally to the given
+// destination address (an Addrinfo or a packed sockaddr string). Returns the
+// number of bytes sent.
+VALUE LibevBackend_sendmsg(int argc, VALUE *argv, VALUE self) {
+  LibevBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE io, str, flags, dest;
+  VALUE switchpoint_result = Qnil;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t n;
+
+  rb_scan_args(argc, argv, "22", &io, &str, &flags, &dest);
+  StringValue(str);
+
+  GetLibevBackend(self, backend);
+  io = libev_get_socket(io, &fptr);
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = RSTRING_PTR(str);
+  iov.iov_len = RSTRING_LEN(str);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  dest = sendmsg_set_dest(&msg, dest);
+
+  n = libev_sendmsg(backend, io, fptr->fd, &msg, NIL_P(flags) ? 0 : NUM2INT(flags), &switchpoint_result);
+  if (n < 0) goto error;
+
+  RB_GC_GUARD(str);
+  RB_GC_GUARD(dest);
+  RB_GC_GUARD(switchpoint_result);
+  return LONG2NUM(n);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+#ifdef __linux__
+
+#define SENDFILE_MAX_CHUNK (1 << 20)
+
+// Waits for src to become readable or dest to become writable. Since EAGAIN
+// does not tell which of the two fds is not ready, the two are waited upon
+// alternately.
+static VALUE libev_wait_src_or_dest(
+  LibevBackend_t *backend, VALUE src, int src_fd, VALUE dest, int dest_fd,
+  int *wait_for_dest
+) {
+  VALUE switchpoint_result = *wait_for_dest ?
+    libev_wait_io(backend, dest, dest_fd, EV_WRITE) :
+    libev_wait_io(backend, src, src_fd, EV_READ);
+  *wait_for_dest = !*wait_for_dest;
+  return switchpoint_result;
+}
+
+static VALUE libev_get_src_io(VALUE io, rb_io_t **fptr) {
+  VALUE underlying_io = rb_iv_get(io, "@io");
+  if (underlying_io != Qnil) io = underlying_io;
+  GetOpenFile(io, *fptr);
+  io_set_nonblock(*fptr, io);
+  return io;
+}
+
+static VALUE libev_get_dest_io(VALUE io, rb_io_t **fptr) {
+  VALUE underlying_io = rb_iv_get(io, "@io");
+  if (underlying_io != Qnil) io = underlying_io;
+  io = rb_io_get_write_io(io);
+  GetOpenFile(io, *fptr);
+  io_set_nonblock(*fptr, io);
+  return io;
+}
+
+// Moves up to maxlen bytes from src to dest using splice(2) or tee(2). One of
+// the fds (both for tee) must be a pipe.
+static VALUE libev_splice(VALUE self, VALUE src, VALUE dest, VALUE maxlen, int tee_only) {
+  LibevBackend_t *backend;
+  rb_io_t *src_fptr;
+  rb_io_t *dest_fptr;
+  VALUE switchpoint_result = Qnil;
+  int wait_for_dest = 0;
+  ssize_t len;
+
+  GetLibevBackend(self, backend);
+  src = libev_get_src_io(src, &src_fptr);
+  dest = libev_get_dest_io(dest, &dest_fptr);
+
+  while (1) {
+    len = tee_only ?
+      tee(src_fptr->fd, dest_fptr->fd, NUM2LONG(maxlen), SPLICE_F_NONBLOCK) :
+      splice(src_fptr->fd, 0, dest_fptr->fd, 0, NUM2LONG(maxlen), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (len >= 0) break;
+
+    int e = errno;
+    if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
+
+    switchpoint_result = libev_wait_src_or_dest(
+      backend, src, src_fptr->fd, dest, dest_fptr->fd, &wait_for_dest
+    );
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+  }
+
+  switchpoint_result = libev_snooze_if_over_budget(backend);
+  if (TEST_EXCEPTION(switchpoint_result)) goto error;
+
+  RB_GC_GUARD(switchpoint_result);
+  return LONG2NUM(len);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+VALUE LibevBackend_splice(VALUE self, VALUE src, VALUE dest, VALUE maxlen) {
+  return libev_splice(self, src, dest, maxlen, 0);
+}
+
+VALUE LibevBackend_tee(VALUE self, VALUE src, VALUE dest, VALUE maxlen) {
+  return libev_splice(self, src, dest, maxlen, 1);
+}
+
+VALUE LibevBackend_splice_to_eof(VALUE self, VALUE src, VALUE dest, VALUE chunksize) {
+  long total = 0;
+
+  while (1) {
+    long len = NUM2LONG(libev_splice(self, src, dest, chunksize, 0));
+    if (len == 0) break;
+    total += len;
+  }
+
+  return LONG2NUM(total);
+}
+
+// Sends count bytes (or everything up to EOF if count is nil) from the file src
+// to dest, starting from the given offset (or from the current file position
+// if offset is nil). Returns the number of bytes sent.
+VALUE LibevBackend_sendfile(VALUE self, VALUE src, VALUE dest, VALUE offset, VALUE count) {
+  LibevBackend_t *backend;
+  rb_io_t *src_fptr;
+  rb_io_t *dest_fptr;
+  VALUE switchpoint_result = Qnil;
+  off_t off = NIL_P(offset) ? 0 : NUM2OFFT(offset);
+  off_t *off_ptr = NIL_P(offset) ? NULL : &off;
+  long left = NIL_P(count) ? -1 : NUM2LONG(count);
+  long total = 0;
+
+  GetLibevBackend(self, backend);
+  GetOpenFile(src, src_fptr);
+  rb_io_check_byte_readable(src_fptr);
+  dest = libev_get_dest_io(dest, &dest_fptr);
+
+  // See comment in LibevBackend_read
+  if (src_fptr->rbuf.len > 0) {
+    lseek(src_fptr->fd, -src_fptr->rbuf.len, SEEK_CUR);
+    src_fptr->rbuf.len = 0;
+  }
+
+  while (left != 0) {
+    size_t chunk = (left < 0 || left > SENDFILE_MAX_CHUNK) ? SENDFILE_MAX_CHUNK : left;
+    ssize_t n = sendfile(dest_fptr->fd, src_fptr->fd, off_ptr, chunk);
+    if (n < 0) {
+      int e = errno;
+      if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
+
+      switchpoint_result = libev_wait_io(backend, dest, dest_fptr->fd, EV_WRITE);
+      if (TEST_EXCEPTION(switchpoint_result)) goto error;
+      continue;
+    }
+    if (n == 0) break; // EOF
+
+    total += n;
+    if (left > 0) left -= n;
+
+    switchpoint_result = libev_snooze_if_over_budget(backend);
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+  }
+
+  RB_GC_GUARD(switchpoint_result);
+  return LONG2NUM(total);
+error:
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// Receives up to max_msgs datagrams of up to max_len bytes each, waiting for
+// the socket to become readable if none are available. Returns an array of
+// strings.
+VALUE LibevBackend_recv_batch(VALUE self, VALUE io, VALUE max_msgs, VALUE max_len) {
+  LibevBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE switchpoint_result = Qnil;
+  VALUE tmp = 0;
+  struct mmsghdr *msgs;
+  int count = NUM2INT(max_msgs);
+  int n;
+
+  GetLibevBackend(self, backend);
+  io = libev_get_socket(io, &fptr);
+  msgs = mmsg_recv_setup(&tmp, count, NUM2LONG(max_len));
+
+  while (1) {
+    n = recvmmsg(fptr->fd, msgs, count, 0, NULL);
+    if (n >= 0) break;
+
+    int e = errno;
+    if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
+
+    switchpoint_result = libev_wait_io(backend, io, fptr->fd, EV_READ);
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+  }
+
+  switchpoint_result = libev_snooze_if_over_budget(backend);
+  if (TEST_EXCEPTION(switchpoint_result)) goto error;
+
+  VALUE result = mmsg_recv_result(msgs, n);
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(switchpoint_result);
+  return result;
+error:
+  ALLOCV_END(tmp);
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+// Sends the given array of strings as separate datagrams, waiting for the
+// socket to become writable as needed. Returns the number of messages sent.
+VALUE LibevBackend_send_batch(VALUE self, VALUE io, VALUE messages) {
+  LibevBackend_t *backend;
+  rb_io_t *fptr;
+  VALUE switchpoint_result = Qnil;
+  VALUE tmp = 0;
+  struct mmsghdr *msgs;
+  int count;
+  int sent = 0;
+  int waited = 0;
+
+  GetLibevBackend(self, backend);
+  io = libev_get_socket(io, &fptr);
+  msgs = mmsg_send_setup(&tmp, messages, &count);
+
+  while (sent < count) {
+    int n = sendmmsg(fptr->fd, msgs + sent, count - sent, 0);
+    if (n >= 0) {
+      sent += n;
+      continue;
+    }
+
+    int e = errno;
+    if ((e != EWOULDBLOCK && e != EAGAIN)) rb_syserr_fail(e, strerror(e));
+
+    switchpoint_result = libev_wait_io(backend, io, fptr->fd, EV_WRITE);
+    waited = 1;
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+  }
+
+  if (!waited) {
+    switchpoint_result = libev_snooze_if_over_budget(backend);
+    if (TEST_EXCEPTION(switchpoint_result)) goto error;
+  }
+
+  ALLOCV_END(tmp);
+  RB_GC_GUARD(messages);
+  RB_GC_GUARD(switchpoint_result);
+  return INT2NUM(sent);
+error:
+  ALLOCV_END(tmp);
+  return RAISE_EXCEPTION(switchpoint_result);
+}
+
+#endif /* __linux__ */
+
 VALUE LibevBackend_wait_io(VALUE self, VALUE io, VALUE write) {
   LibevBackend_t *backend;
   rb_io_t *fptr;
+  VALUE switchpoint_result;
   int events = RTEST(write) ? EV_WRITE : EV_READ;
   VALUE underlying_io = rb_iv_get(io, "@io");
   if (underlying_io != Qnil) io = underlying_io;
   GetLibevBackend(self, backend);
   GetOpenFile(io, fptr);
 
-  return libev_wait_fd(backend, fptr->fd, events, 1);
+  switchpoint_result = libev_wait_io(backend, io, fptr->fd, events);
+  TEST_RESUME_EXCEPTION(switchpoint_result);
+  RB_GC_GUARD(switchpoint_result);
+  return switchpoint_result;
 }
 
 struct libev_timer {
@@ -782,11 +1434,206 @@ VALUE LibevBackend_sleep(VALUE self, VALUE duration) {
 
   ev_timer_stop(backend->ev_loop, &watcher.timer);
   TEST_RESUME_EXCEPTION(switchpoint_result);
-  RB_GC_GUARD(watcher.fiber);
   RB_GC_GUARD(switchpoint_result);
   return switchpoint_result;
 }
 
+struct libev_timer_loop {
+  struct ev_timer timer;
+  LibevBackend_t *backend;
+  VALUE fiber;
+  int waiting;
+  int fired;
+};
+
+void LibevBackend_timer_loop_callback(EV_P_ ev_timer *w, int revents)
+{
+  struct libev_timer_loop *watcher = (struct libev_timer_loop *)w;
+  watcher->fired = 1;
+  // the fiber is resumed only if it's waiting for the next tick, and not e.g.
+  // doing I/O inside the loop body
+  if (watcher->waiting) Fiber_make_runnable(watcher->fiber, Qnil);
+}
+
+static VALUE libev_timer_loop_body(VALUE arg) {
+  struct libev_timer_loop *watcher = (struct libev_timer_loop *)arg;
+  VALUE switchpoint_result = Qnil;
+
+  while (1) {
+    while (!watcher->fired) {
+      watcher->waiting = 1;
+      switchpoint_result = libev_await(watcher->backend);
+      watcher->waiting = 0;
+      TEST_RESUME_EXCEPTION(switchpoint_result);
+    }
+    watcher->fired = 0;
+    rb_yield(Qnil);
+  }
+
+  RB_GC_GUARD(switchpoint_result);
+  return Qnil;
+}
+
+static VALUE libev_timer_loop_ensure(VALUE arg) {
+  struct libev_timer_loop *watcher = (struct libev_timer_loop *)arg;
+  ev_timer_stop(watcher->backend->ev_loop, &watcher->timer);
+  return Qnil;
+}
+
+// Runs the given block at a fixed rate, every interval seconds, using a
+// single repeating timer watcher. Ticks are scheduled on the monotonic clock,
+// each one interval after the previous one, so the loop does not drift and is
+// not affected by changes to the system time. If the block takes longer than
+// the interval, missed ticks are coalesced into a single tick, which is run
+// right away.
+VALUE LibevBackend_timer_loop(VALUE self, VALUE interval) {
+  LibevBackend_t *backend;
+  struct libev_timer_loop watcher;
+  double secs = NUM2DBL(interval);
+
+  if (secs <= 0) rb_raise(rb_eArgError, "interval must be positive");
+  rb_need_block();
+  GetLibevBackend(self, backend);
+
+  watcher.backend = backend;
+  watcher.fiber = rb_fiber_current();
+  watcher.waiting = 0;
+  watcher.fired = 0;
+  ev_timer_init(&watcher.timer, LibevBackend_timer_loop_callback, secs, secs);
+  ev_timer_start(backend->ev_loop, &watcher.timer);
+
+  return rb_ensure(libev_timer_loop_body, (VALUE) &watcher, libev_timer_loop_ensure, (VALUE) &watcher);
+}
+
+struct libev_timeout {
+  struct ev_timer timer;
+  struct ev_loop *ev_loop;
+  VALUE fiber;
+  VALUE exception;
+  VALUE value;
+};
+
+void LibevBackend_timeout_callback(EV_P_ ev_timer *w, int revents)
+{
+  struct libev_timeout *watcher = (struct libev_timeout *)w;
+  VALUE exception = backend_timeout_exception(watcher->exception, watcher->value);
+  Fiber_make_runnable(watcher->fiber, exception);
+}
+
+static VALUE libev_timeout_ensure(VALUE arg) {
+  struct libev_timeout *watcher = (struct libev_timeout *)arg;
+  ev_timer_stop(watcher->ev_loop, &watcher->timer);
+  return Qnil;
+}
+
+// Runs the given block, raising an exception in the current fiber if the block
+// has not completed within the given duration. The exception is either given
+// as an exception instance, or as an exception class, instantiated (with the
+// given value, if not nil) only if the timeout expires. No fiber is spun for
+// tracking the timeout, just a timer that's stopped once the block completes.
+VALUE LibevBackend_timeout(int argc, VALUE *argv, VALUE self) {
+  LibevBackend_t *backend;
+  struct libev_timeout watcher;
+  VALUE duration, exception, value;
+  VALUE result;
+
+  rb_scan_args(argc, argv, "21", &duration, &exception, &value);
+  rb_need_block();
+  GetLibevBackend(self, backend);
+
+  watcher.ev_loop = backend->ev_loop;
+  watcher.fiber = rb_fiber_current();
+  watcher.exception = exception;
+  watcher.value = value;
+  ev_timer_init(&watcher.timer, LibevBackend_timeout_callback, NUM2DBL(duration), 0.);
+  ev_timer_start(backend->ev_loop, &watcher.timer);
+
+  result = rb_ensure(rb_yield, Qnil, libev_timeout_ensure, (VALUE) &watcher);
+
+  RB_GC_GUARD(exception);
+  RB_GC_GUARD(value);
+  return result;
+}
+
+struct libev_select {
+  backend_select_t select;
+  LibevBackend_t *backend;
+  struct libev_io *watchers;
+  long io_count;
+  struct libev_timer timer;
+  int timer_started;
+};
+
+static VALUE libev_select_body(VALUE arg) {
+  struct libev_select *s = (struct libev_select *)arg;
+  VALUE fiber = rb_fiber_current();
+  VALUE result;
+
+  s->watchers = ALLOC_N(struct libev_io, RARRAY_LEN(s->select.ios) + 1);
+  for (long i = 0; i < RARRAY_LEN(s->select.ios); i++) {
+    VALUE io = RARRAY_AREF(s->select.ios, i);
+    VALUE underlying_io = rb_iv_get(io, "@io");
+    rb_io_t *fptr;
+    if (underlying_io != Qnil) io = underlying_io;
+    GetOpenFile(io, fptr);
+
+    s->watchers[i].fiber = fiber;
+    s->watchers[i].fired = 0;
+    ev_io_init(&s->watchers[i].io, LibevBackend_io_callback, fptr->fd, EV_READ);
+    ev_io_start(s->backend->ev_loop, &s->watchers[i].io);
+    s->io_count++;
+  }
+
+  while (1) {
+    result = backend_select_queues(&s->select);
+    if (result != Qnil) return result;
+
+    for (long i = 0; i < s->io_count; i++)
+      if (s->watchers[i].fired)
+        return rb_ary_new_from_args(2, RARRAY_AREF(s->select.ios, i), Qnil);
+
+    if (s->timer_started && !ev_is_active(&s->timer.timer)) return Qnil;
+
+    VALUE switchpoint_result = libev_await(s->backend);
+    TEST_RESUME_EXCEPTION(switchpoint_result);
+    RB_GC_GUARD(switchpoint_result);
+  }
+}
+
+static VALUE libev_select_ensure(VALUE arg) {
+  struct libev_select *s = (struct libev_select *)arg;
+
+  for (long i = 0; i < s->io_count; i++)
+    ev_io_stop(s->backend->ev_loop, &s->watchers[i].io);
+  if (s->timer_started) ev_timer_stop(s->backend->ev_loop, &s->timer.timer);
+  if (s->watchers) xfree(s->watchers);
+  backend_select_done(&s->select);
+  return Qnil;
+}
+
+// Waits for a value to be available on any of the given queues, or for any of
+// the given IOs to become readable. Returns a [queue, value] pair with the
+// value shifted from the queue, or an [io, nil] pair. If a timeout is given
+// and expires first, returns nil. No fibers are spun for waiting.
+VALUE LibevBackend_select(VALUE self, VALUE queues, VALUE ios, VALUE timeout) {
+  struct libev_select s;
+  double secs = timeout == Qnil ? 0. : NUM2DBL(timeout);
+
+  GetLibevBackend(self, s.backend);
+  backend_select_init(&s.select, queues, ios);
+  s.watchers = NULL;
+  s.io_count = 0;
+  s.timer_started = 0;
+  if (timeout != Qnil) {
+    s.timer.fiber = rb_fiber_current();
+    ev_timer_init(&s.timer.timer, LibevBackend_timer_callback, secs, 0.);
+    ev_timer_start(s.backend->ev_loop, &s.timer.timer);
+    s.timer_started = 1;
+  }
+
+  return rb_ensure(libev_select_body, (VALUE) &s, libev_select_ensure, (VALUE) &s);
+}
+
 struct libev_child {
   struct ev_child child;
   VALUE fiber;
@@ -816,7 +1663,6 @@ VALUE LibevBackend_waitpid(VALUE self, VALUE pid) {
 
   ev_child_stop(backend->ev_loop, &watcher.child);
   TEST_RESUME_EXCEPTION(switchpoint_result);
-  RB_GC_GUARD(watcher.fiber);
   RB_GC_GUARD(switchpoint_result);
   return switchpoint_result;
 }
@@ -850,9 +1696,11 @@ VALUE LibevBackend_wait_event(VALUE self, VALUE raise) {
 void Init_LibevBackend() {
   rb_require("socket");
   cTCPSocket = rb_const_get(rb_cObject, rb_intern("TCPSocket"));
+  cAddrinfo = rb_const_get(rb_cObject, rb_intern("Addrinfo"));
 
   VALUE cBackend = rb_define_class_under(mPolyphony, "Backend", rb_cData);
   rb_define_alloc_func(cBackend, LibevBackend_allocate);
+  rb_define_const(cBackend, "KIND", ID2SYM(rb_intern("libev")));
 
   rb_define_method(cBackend, "initialize", LibevBackend_initialize, 0);
   rb_define_method(cBackend, "finalize", LibevBackend_finalize, 0);
@@ -865,19 +1713,38 @@ void Init_LibevBackend() {
   rb_define_method(cBackend, "poll", LibevBackend_poll, 3);
   rb_define_method(cBackend, "break", LibevBackend_wakeup, 0);
 
-  rb_define_method(cBackend, "read", LibevBackend_read, 4);
-  rb_define_method(cBackend, "read_loop", LibevBackend_read_loop, 1);
+  rb_define_method(cBackend, "read", LibevBackend_read, -1);
+  rb_define_method(cBackend, "read_loop", LibevBackend_read_loop, -1);
   rb_define_method(cBackend, "write", LibevBackend_write_m, -1);
   rb_define_method(cBackend, "accept", LibevBackend_accept, 1);
-  rb_define_method(cBackend, "accept_loop", LibevBackend_accept_loop, 1);
+  rb_define_method(cBackend, "accept_loop", LibevBackend_accept_loop, -1);
   rb_define_method(cBackend, "connect", LibevBackend_connect, 3);
   rb_define_method(cBackend, "wait_io", LibevBackend_wait_io, 2);
+  rb_define_method(cBackend, "release_io", LibevBackend_release_io, 1);
+  rb_define_method(cBackend, "recv", LibevBackend_recv, -1);
+  rb_define_method(cBackend, "recvmsg", LibevBackend_recvmsg, -1);
+  rb_define_method(cBackend, "send", LibevBackend_send, -1);
+  rb_define_method(cBackend, "sendmsg", LibevBackend_sendmsg, -1);
+#ifdef __linux__
+  rb_define_method(cBackend, "splice", LibevBackend_splice, 3);
+  rb_define_method(cBackend, "splice_to_eof", LibevBackend_splice_to_eof, 3);
+  rb_define_method(cBackend, "tee", LibevBackend_tee, 3);
+  rb_define_method(cBackend, "sendfile", LibevBackend_sendfile, 4);
+  rb_define_method(cBackend, "recv_batch", LibevBackend_recv_batch, 3);
+  rb_define_method(cBackend, "send_batch", LibevBackend_send_batch, 2);
+#endif
   rb_define_method(cBackend, "sleep", LibevBackend_sleep, 1);
+  rb_define_method(cBackend, "timeout", LibevBackend_timeout, -1);
+  rb_define_method(cBackend, "select", LibevBackend_select, 3);
+  rb_define_method(cBackend, "timer_loop", LibevBackend_timer_loop, 1);
+  rb_define_method(cBackend, "now", LibevBackend_now, 0);
   rb_define_method(cBackend, "waitpid", LibevBackend_waitpid, 1);
   rb_define_method(cBackend, "wait_event", LibevBackend_wait_event, 1);
 
   ID_ivar_is_nonblocking = rb_intern("@is_nonblocking");
+  ID_ivar_watcher_token = rb_intern("@__watcher_token");
 
+  __BACKEND__.now             = LibevBackend_now;
   __BACKEND__.pending_count   = LibevBackend_pending_count;
   __BACKEND__.poll            = LibevBackend_poll;
   __BACKEND__.ref             = LibevBackend_ref;
@@ -887,3 +1754,5 @@ void Init_LibevBackend() {
   __BACKEND__.wait_event      = LibevBackend_wait_event;
   __BACKEND__.wakeup          = LibevBackend_wakeup;
 }
+
+#endif /* POLYPHONY_BACKEND_LIBEV */
@@ -10,9 +10,7 @@ ID ID_inspect;
 ID ID_invoke;
 ID ID_new;
 ID ID_ivar_running;
-ID ID_ivar_thread;
-ID ID_runnable;
-ID ID_runnable_value;
+ID ID_sched;
 ID ID_size;
 ID ID_signal;
 ID ID_switch_fiber;
@@ -42,6 +40,14 @@ static VALUE Polyphony_suspend(VALUE self) {
   return ret;
 }
 
+// Returns the current thread's event loop time, in seconds on the monotonic
+// clock, which is updated once per event loop iteration. This is cheaper than
+// reading the clock, and gives all fibers running in the same iteration the
+// same notion of the current time.
+static VALUE Polyphony_now(VALUE self) {
+  return __BACKEND__.now(THREAD_BACKEND(rb_thread_current()));
+}
+
 VALUE Polyphony_trace(VALUE self, VALUE enabled) {
   __tracing_enabled__ = RTEST(enabled) ? 1 : 0;
   return Qnil;
@@ -51,6 +57,7 @@ void Init_Polyphony() {
   mPolyphony = rb_define_module("Polyphony");
 
   rb_define_singleton_method(mPolyphony, "trace", Polyphony_trace, 1);
+  rb_define_singleton_method(mPolyphony, "now", Polyphony_now, 0);
 
   rb_define_global_function("snooze", Polyphony_snooze, 0);
   rb_define_global_function("suspend", Polyphony_suspend, 0);
@@ -62,10 +69,8 @@ void Init_Polyphony() {
   ID_inspect        = rb_intern("inspect");
   ID_invoke         = rb_intern("invoke");
   ID_ivar_running   = rb_intern("@running");
-  ID_ivar_thread    = rb_intern("@thread");
   ID_new            = rb_intern("new");
-  ID_runnable       = rb_intern("runnable");
-  ID_runnable_value = rb_intern("runnable_value");
+  ID_sched          = rb_intern("__sched__");
   ID_signal         = rb_intern("signal");
   ID_size           = rb_intern("size");
   ID_switch_fiber   = rb_intern("switch_fiber");
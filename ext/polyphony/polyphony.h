@@ -5,6 +5,7 @@
 #include "ruby/io.h"
 #include "libev.h"
 #include "backend.h"
+#include "fiber_list.h"
 
 // debugging
 #define OBJ_ID(obj) (NUM2LONG(rb_funcall(obj, rb_intern("object_id"), 0)))
@@ -19,6 +20,12 @@
 
 #define TEST_EXCEPTION(ret) (RTEST(rb_obj_is_kind_of(ret, rb_eException)))
 
+#ifdef HAVE_RB_FIBER_TRANSFER
+#define FIBER_TRANSFER(fiber, value) rb_fiber_transfer(fiber, 1, &(value))
+#else
+#define FIBER_TRANSFER(fiber, value) rb_funcall(fiber, ID_transfer, 1, value)
+#endif
+
 #define RAISE_EXCEPTION(e) rb_funcall(e, ID_invoke, 0);
 #define TEST_RESUME_EXCEPTION(ret) if (RTEST(rb_obj_is_kind_of(ret, rb_eException))) { \
   return RAISE_EXCEPTION(ret); \
@@ -38,13 +45,10 @@ extern ID ID_each;
 extern ID ID_fiber_trace;
 extern ID ID_inspect;
 extern ID ID_invoke;
-extern ID ID_ivar_backend;
 extern ID ID_ivar_running;
-extern ID ID_ivar_thread;
 extern ID ID_new;
 extern ID ID_raise;
-extern ID ID_runnable;
-extern ID ID_runnable_value;
+extern ID ID_sched;
 extern ID ID_signal;
 extern ID ID_size;
 extern ID ID_switch_fiber;
@@ -66,8 +70,68 @@ enum {
   FIBER_STATE_SCHEDULED     = 2
 };
 
+// Scheduling state is kept in C structs attached to threads and fibers (as
+// hidden ivars), so scheduling and switching fibers only involves a single ivar
+// lookup per object.
+// Fibers scheduled from other threads are pushed onto the target thread's
+// inbox, a lock-free multi-producer/single-consumer stack, which is drained by
+// the owning thread when switching fibers.
+typedef struct inbox_entry {
+  struct inbox_entry *next;
+  VALUE fiber;
+  VALUE value;
+  int priority;
+} inbox_entry_t;
+
+// I/O operations that complete without having to wait do not switch fibers.
+// To maintain fairness, the running fiber is given a budget of operations and
+// of running time, after which it yields if other fibers are runnable. The
+// budget is reset whenever the thread switches fibers.
+typedef struct backend_budget {
+  unsigned int ops;
+  unsigned long long start;
+} backend_budget_t;
+
+static inline void backend_budget_reset(backend_budget_t *budget) {
+  budget->ops = 0;
+  budget->start = 0;
+}
+
+typedef struct thread_sched {
+  fiber_list_t run_queue;
+  VALUE backend;
+  inbox_entry_t *inbox;
+  // entries taken from the inbox that have not yet been scheduled
+  inbox_entry_t *draining;
+  // set once the owning thread has been woken up for the entries currently in
+  // the inbox, so a burst of remote schedules causes a single wakeup
+  int wakeup_pending;
+  // corked IOs with buffered data, flushed when switching fibers
+  VALUE corked;
+  // corked IOs whose flush could not be completed when switching fibers, and
+  // the fiber finishing their flush (see cork.c)
+  VALUE cork_flushes;
+  VALUE cork_flusher;
+  int cork_flusher_waiting;
+  backend_budget_t budget;
+} thread_sched_t;
+
+typedef struct fiber_sched {
+  VALUE thread;
+  thread_sched_t *thread_sched;
+  VALUE runnable_value;
+  // the fiber is runnable while run_node is in a run queue
+  fiber_node_t run_node;
+  // used for waiting on a queue
+  fiber_node_t wait_node;
+} fiber_sched_t;
+
+#define FIBER_SCHED_RUNNABLE(sched) ((sched)->run_node.list != NULL)
+
+fiber_sched_t *Fiber_sched(VALUE fiber);
 VALUE Fiber_auto_watcher(VALUE self);
 void Fiber_make_runnable(VALUE fiber, VALUE value);
+VALUE Fiber_set_thread(VALUE self, VALUE thread);
 
 VALUE Queue_push(VALUE self, VALUE value);
 VALUE Queue_unshift(VALUE self, VALUE value);
@@ -77,8 +141,18 @@ VALUE Queue_shift_no_wait(VALUE self);
 VALUE Queue_clear(VALUE self);
 VALUE Queue_delete(VALUE self, VALUE value);
 long Queue_len(VALUE self);
+int Queue_select_shift(VALUE self, VALUE *value);
+void Queue_select_wait(VALUE self, fiber_node_t *node);
+void Queue_select_done(VALUE self, fiber_node_t *node, int shifted);
 void Queue_trace(VALUE self);
 
+void Cork_flush_pending(thread_sched_t *sched);
+void Cork_clear_pending(thread_sched_t *sched);
+
+thread_sched_t *Thread_sched(VALUE thread);
+#define THREAD_BACKEND(thread) (Thread_sched(thread)->backend)
+
+void Thread_schedule_fiber_sched(fiber_sched_t *sched, VALUE fiber, VALUE value);
 VALUE Thread_schedule_fiber(VALUE thread, VALUE fiber, VALUE value);
 VALUE Thread_switch_fiber(VALUE thread);
 
@@ -2,9 +2,17 @@
 
 void Init_Fiber();
 void Init_Polyphony();
+#ifdef POLYPHONY_BACKEND_LIBEV
 void Init_LibevBackend();
+#else
+void Init_IOUringBackend();
+#endif
 void Init_Queue();
 void Init_Event();
+void Init_Sync();
+void Init_Caller();
+void Init_IOReader();
+void Init_Cork();
 void Init_Thread();
 void Init_Tracing();
 
@@ -13,9 +21,17 @@ void Init_polyphony_ext() {
 
   Init_Polyphony();
 
+#ifdef POLYPHONY_BACKEND_LIBEV
   Init_LibevBackend();
+#else
+  Init_IOUringBackend();
+#endif
   Init_Queue();
   Init_Event();
+  Init_Sync();
+  Init_Caller();
+  Init_IOReader();
+  Init_Cork();
   Init_Fiber();
   Init_Thread();
   Init_Tracing();
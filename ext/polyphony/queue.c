@@ -1,9 +1,16 @@
 #include "polyphony.h"
 #include "ring_buffer.h"
 
+// Queues are safe to use across threads: all access to the queue state happens
+// while holding the GVL, and fibers waiting on a queue in another thread are
+// scheduled through that thread's inbox. A queue may be given a capacity, in
+// which case pushing to a full queue suspends the pushing fiber until a value
+// is shifted.
 typedef struct queue {
   ring_buffer values;
-  ring_buffer shift_queue;
+  fiber_list_t shift_queue;
+  fiber_list_t push_queue;
+  unsigned int capacity;
 } Queue_t;
 
 VALUE cQueue = Qnil;
@@ -11,13 +18,13 @@ VALUE cQueue = Qnil;
 static void Queue_mark(void *ptr) {
   Queue_t *queue = ptr;
   ring_buffer_mark(&queue->values);
-  ring_buffer_mark(&queue->shift_queue);
+  fiber_list_mark(&queue->shift_queue);
+  fiber_list_mark(&queue->push_queue);
 }
 
 static void Queue_free(void *ptr) {
   Queue_t *queue = ptr;
   ring_buffer_free(&queue->values);
-  ring_buffer_free(&queue->shift_queue);
   xfree(ptr);
 }
 
@@ -41,24 +48,70 @@ static VALUE Queue_allocate(VALUE klass) {
 #define GetQueue(obj, queue) \
   TypedData_Get_Struct((obj), Queue_t, &Queue_type, (queue))
 
-static VALUE Queue_initialize(VALUE self) {
+static VALUE Queue_initialize(int argc, VALUE *argv, VALUE self) {
   Queue_t *queue;
+  VALUE capacity;
   GetQueue(self, queue);
 
+  rb_scan_args(argc, argv, "01", &capacity);
   ring_buffer_init(&queue->values);
-  ring_buffer_init(&queue->shift_queue);
+  fiber_list_init(&queue->shift_queue);
+  fiber_list_init(&queue->push_queue);
+  queue->capacity = 0;
+  if (capacity != Qnil) {
+    long n = NUM2LONG(capacity);
+    if (n <= 0 || n > UINT_MAX) rb_raise(rb_eArgError, "invalid queue capacity");
+    queue->capacity = (unsigned int) n;
+  }
 
   return self;
 }
 
+#define QUEUE_FULL_P(queue) \
+  ((queue)->capacity && (queue)->values.count >= (queue)->capacity)
+
+static inline void queue_schedule_first_waiter(fiber_list_t *list) {
+  if (list->count > 0) {
+    VALUE fiber = fiber_list_shift(list);
+    if (fiber != Qnil) Fiber_make_runnable(fiber, Qnil);
+  }
+}
+
+// Wakes up fibers waiting to push, up to the available capacity. Woken fibers
+// recheck the capacity, so waking too many is harmless.
+static inline void queue_schedule_pushers(Queue_t *queue) {
+  long room = (long) queue->capacity - queue->values.count;
+  while (room-- > 0 && queue->push_queue.count > 0)
+    queue_schedule_first_waiter(&queue->push_queue);
+}
+
+// Suspends the current fiber until the queue has room for another value.
+static void queue_await_capacity(Queue_t *queue) {
+  VALUE fiber = rb_fiber_current();
+  fiber_sched_t *sched = Fiber_sched(fiber);
+  VALUE backend = THREAD_BACKEND(rb_thread_current());
+
+  while (QUEUE_FULL_P(queue)) {
+    fiber_list_push(&queue->push_queue, &sched->wait_node);
+    VALUE switchpoint_result = __BACKEND__.wait_event(backend, Qnil);
+    fiber_list_delete(&queue->push_queue, &sched->wait_node);
+
+    if (RTEST(rb_obj_is_kind_of(switchpoint_result, rb_eException))) {
+      // pass the wakeup on, in case this fiber was woken up to push a value
+      if (!QUEUE_FULL_P(queue)) queue_schedule_first_waiter(&queue->push_queue);
+      RAISE_EXCEPTION(switchpoint_result);
+      return;
+    }
+    RB_GC_GUARD(switchpoint_result);
+  }
+}
+
 VALUE Queue_push(VALUE self, VALUE value) {
   Queue_t *queue;
   GetQueue(self, queue);
 
-  if (queue->shift_queue.count > 0) {
-    VALUE fiber = ring_buffer_shift(&queue->shift_queue);
-    if (fiber != Qnil) Fiber_make_runnable(fiber, Qnil);
-  }
+  if (QUEUE_FULL_P(queue)) queue_await_capacity(queue);
+  queue_schedule_first_waiter(&queue->shift_queue);
   ring_buffer_push(&queue->values, value);
   return self;
 }
@@ -66,44 +119,141 @@ VALUE Queue_push(VALUE self, VALUE value) {
 VALUE Queue_unshift(VALUE self, VALUE value) {
   Queue_t *queue;
   GetQueue(self, queue);
-  if (queue->shift_queue.count > 0) {
-    VALUE fiber = ring_buffer_shift(&queue->shift_queue);
-    if (fiber != Qnil) Fiber_make_runnable(fiber, Qnil);
-  }
+
+  if (QUEUE_FULL_P(queue)) queue_await_capacity(queue);
+  queue_schedule_first_waiter(&queue->shift_queue);
   ring_buffer_unshift(&queue->values, value);
   return self;
 }
 
+VALUE Queue_push_all(VALUE self, VALUE array) {
+  Queue_t *queue;
+  GetQueue(self, queue);
+  Check_Type(array, T_ARRAY);
+
+  // Each value wakes up at most one waiting fiber, so that pushing a batch of
+  // values schedules each consumer only once.
+  for (long i = 0; i < RARRAY_LEN(array); i++) {
+    if (QUEUE_FULL_P(queue)) queue_await_capacity(queue);
+    queue_schedule_first_waiter(&queue->shift_queue);
+    ring_buffer_push(&queue->values, RARRAY_AREF(array, i));
+  }
+  RB_GC_GUARD(array);
+  return self;
+}
+
+static inline VALUE queue_shift_value(Queue_t *queue) {
+  VALUE value = ring_buffer_shift(&queue->values);
+  if (queue->push_queue.count > 0) queue_schedule_first_waiter(&queue->push_queue);
+  return value;
+}
+
 VALUE Queue_shift(VALUE self) {
   Queue_t *queue;
   GetQueue(self, queue);
 
   VALUE fiber = rb_fiber_current();
+  fiber_sched_t *sched = Fiber_sched(fiber);
   VALUE thread = rb_thread_current();
-  VALUE backend = rb_ivar_get(thread, ID_ivar_backend);
+  VALUE backend = THREAD_BACKEND(thread);
 
   while (1) {
-    ring_buffer_push(&queue->shift_queue, fiber);
+    fiber_list_push(&queue->shift_queue, &sched->wait_node);
     if (queue->values.count > 0) Fiber_make_runnable(fiber, Qnil);
 
     VALUE switchpoint_result = __BACKEND__.wait_event(backend, Qnil);
-    ring_buffer_delete(&queue->shift_queue, fiber);
+    fiber_list_delete(&queue->shift_queue, &sched->wait_node);
 
     TEST_RESUME_EXCEPTION(switchpoint_result);
     RB_GC_GUARD(switchpoint_result);
 
     if (queue->values.count > 0)
-      return ring_buffer_shift(&queue->values);
+      return queue_shift_value(queue);
   }
 
   return Qnil;
 }
 
+// Waits for at least one value, then shifts up to max values from the queue,
+// returning them in an array.
+VALUE Queue_shift_n(VALUE self, VALUE max) {
+  Queue_t *queue;
+  long n = NUM2LONG(max);
+  GetQueue(self, queue);
+  if (n <= 0) rb_raise(rb_eArgError, "invalid count");
+
+  if (queue->values.count == 0) {
+    VALUE fiber = rb_fiber_current();
+    fiber_sched_t *sched = Fiber_sched(fiber);
+    VALUE backend = THREAD_BACKEND(rb_thread_current());
+
+    while (queue->values.count == 0) {
+      fiber_list_push(&queue->shift_queue, &sched->wait_node);
+      VALUE switchpoint_result = __BACKEND__.wait_event(backend, Qnil);
+      fiber_list_delete(&queue->shift_queue, &sched->wait_node);
+
+      TEST_RESUME_EXCEPTION(switchpoint_result);
+      RB_GC_GUARD(switchpoint_result);
+    }
+  }
+
+  if (n > queue->values.count) n = queue->values.count;
+  VALUE array = rb_ary_new_capa(n);
+  while (n-- > 0) rb_ary_push(array, ring_buffer_shift(&queue->values));
+  queue_schedule_pushers(queue);
+  return array;
+}
+
+// Shifts and yields the values currently in the queue, without allocating an
+// array. Values pushed while draining are left in the queue.
+VALUE Queue_drain(VALUE self) {
+  Queue_t *queue;
+  GetQueue(self, queue);
+
+  for (unsigned int n = queue->values.count; n > 0 && queue->values.count > 0; n--)
+    rb_yield(queue_shift_value(queue));
+  return self;
+}
+
+// The following are used by Backend#select for waiting on multiple queues at
+// once. Since a fiber's wait_node can be in a single list, the caller provides
+// a separate node for each queue.
+
+// Shifts a value from the queue into *value if available, returning true.
+int Queue_select_shift(VALUE self, VALUE *value) {
+  Queue_t *queue;
+  GetQueue(self, queue);
+
+  if (queue->values.count == 0) return 0;
+  *value = queue_shift_value(queue);
+  return 1;
+}
+
+void Queue_select_wait(VALUE self, fiber_node_t *node) {
+  Queue_t *queue;
+  GetQueue(self, queue);
+
+  if (!fiber_list_includes(&queue->shift_queue, node))
+    fiber_list_push(&queue->shift_queue, node);
+}
+
+// Removes the given node from the queue's waiters. If the node had already
+// been removed by a push, and the value was not shifted by the caller, the
+// wakeup is passed on to the next waiting fiber.
+void Queue_select_done(VALUE self, fiber_node_t *node, int shifted) {
+  Queue_t *queue;
+  GetQueue(self, queue);
+
+  if (node->list) fiber_list_delete(&queue->shift_queue, node);
+  else if (!shifted && queue->values.count > 0)
+    queue_schedule_first_waiter(&queue->shift_queue);
+}
+
 VALUE Queue_shift_no_wait(VALUE self) {
     Queue_t *queue;
   GetQueue(self, queue);
 
-  return ring_buffer_shift(&queue->values);
+  return queue_shift_value(queue);
 }
 
 VALUE Queue_delete(VALUE self, VALUE value) {
@@ -111,6 +261,7 @@ VALUE Queue_delete(VALUE self, VALUE value) {
   GetQueue(self, queue);
 
   ring_buffer_delete(&queue->values, value);
+  queue_schedule_pushers(queue);
   return self;
 }
 
@@ -119,6 +270,7 @@ VALUE Queue_clear(VALUE self) {
   GetQueue(self, queue);
 
   ring_buffer_clear(&queue->values);
+  queue_schedule_pushers(queue);
   return self;
 }
 
@@ -134,6 +286,7 @@ VALUE Queue_shift_each(VALUE self) {
   GetQueue(self, queue);
 
   ring_buffer_shift_each(&queue->values);
+  queue_schedule_pushers(queue);
   return self;
 }
 
@@ -141,7 +294,9 @@ VALUE Queue_shift_all(VALUE self) {
   Queue_t *queue;
   GetQueue(self, queue);
 
-  return ring_buffer_shift_all(&queue->values);
+  VALUE result = ring_buffer_shift_all(&queue->values);
+  queue_schedule_pushers(queue);
+  return result;
 }
 
 VALUE Queue_flush_waiters(VALUE self, VALUE value) {
@@ -149,7 +304,7 @@ VALUE Queue_flush_waiters(VALUE self, VALUE value) {
   GetQueue(self, queue);
 
   while(1) {
-    VALUE fiber = ring_buffer_shift(&queue->shift_queue);
+    VALUE fiber = fiber_list_shift(&queue->shift_queue);
     if (fiber == Qnil) return self;
 
     Fiber_make_runnable(fiber, value);
@@ -177,6 +332,20 @@ VALUE Queue_size_m(VALUE self) {
   return INT2NUM(queue->values.count);
 }
 
+VALUE Queue_capacity(VALUE self) {
+  Queue_t *queue;
+  GetQueue(self, queue);
+
+  return queue->capacity ? UINT2NUM(queue->capacity) : Qnil;
+}
+
+VALUE Queue_full_p(VALUE self) {
+  Queue_t *queue;
+  GetQueue(self, queue);
+
+  return QUEUE_FULL_P(queue) ? Qtrue : Qfalse;
+}
+
 void Queue_trace(VALUE self) {
   Queue_t *queue;
   GetQueue(self, queue);
@@ -188,20 +357,25 @@ void Init_Queue() {
   cQueue = rb_define_class_under(mPolyphony, "Queue", rb_cData);
   rb_define_alloc_func(cQueue, Queue_allocate);
 
-  rb_define_method(cQueue, "initialize", Queue_initialize, 0);
+  rb_define_method(cQueue, "initialize", Queue_initialize, -1);
   rb_define_method(cQueue, "push", Queue_push, 1);
   rb_define_method(cQueue, "<<", Queue_push, 1);
   rb_define_method(cQueue, "unshift", Queue_unshift, 1);
+  rb_define_method(cQueue, "push_all", Queue_push_all, 1);
 
   rb_define_method(cQueue, "shift", Queue_shift, 0);
   rb_define_method(cQueue, "pop", Queue_shift, 0);
+  rb_define_method(cQueue, "shift_n", Queue_shift_n, 1);
   rb_define_method(cQueue, "shift_no_wait", Queue_shift_no_wait, 0);
   rb_define_method(cQueue, "delete", Queue_delete, 1);
 
   rb_define_method(cQueue, "shift_each", Queue_shift_each, 0);
   rb_define_method(cQueue, "shift_all", Queue_shift_all, 0);
+  rb_define_method(cQueue, "drain", Queue_drain, 0);
   rb_define_method(cQueue, "flush_waiters", Queue_flush_waiters, 1);
   rb_define_method(cQueue, "empty?", Queue_empty_p, 0);
   rb_define_method(cQueue, "pending?", Queue_pending_p, 0);
   rb_define_method(cQueue, "size", Queue_size_m, 0);
+  rb_define_method(cQueue, "capacity", Queue_capacity, 0);
+  rb_define_method(cQueue, "full?", Queue_full_p, 0);
 }
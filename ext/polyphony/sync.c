@@ -0,0 +1,602 @@
+#include "polyphony.h"
+
+// Synchronization primitives. Waiting fibers are kept in intrusive lists using
+// their wait_node, so locking and unlocking never allocate, and an uncontended
+// lock or unlock never switches fibers. A fiber woken up by an unlock rechecks
+// the lock state, and if the lock has been taken in the meantime goes back to
+// the front of the waiters list.
+
+VALUE cMutex = Qnil;
+VALUE cConditionVariable = Qnil;
+VALUE cSemaphore = Qnil;
+VALUE cRWLock = Qnil;
+
+ID ID_timeout;
+// value a waiting fiber is resumed with when its wait times out
+VALUE SYM_wait_timeout;
+
+// Waits on the given list until woken up, returning the value the fiber was
+// resumed with.
+static VALUE sync_wait(fiber_list_t *list, int front) {
+  VALUE fiber = rb_fiber_current();
+  fiber_sched_t *sched = Fiber_sched(fiber);
+  VALUE backend = THREAD_BACKEND(rb_thread_current());
+
+  if (front) fiber_list_unshift(list, &sched->wait_node);
+  else fiber_list_push(list, &sched->wait_node);
+  VALUE switchpoint_result = __BACKEND__.wait_event(backend, Qnil);
+  fiber_list_delete(list, &sched->wait_node);
+
+  RB_GC_GUARD(switchpoint_result);
+  return switchpoint_result;
+}
+
+static inline void sync_wake_first(fiber_list_t *list) {
+  VALUE fiber = fiber_list_shift(list);
+  if (fiber != Qnil) Fiber_make_runnable(fiber, Qnil);
+}
+
+static inline void sync_wake_all(fiber_list_t *list) {
+  while (list->count > 0) sync_wake_first(list);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Mutex
+
+typedef struct mutex {
+  VALUE owner;
+  fiber_list_t waiters;
+} Mutex_t;
+
+static void Mutex_mark(void *ptr) {
+  Mutex_t *mutex = ptr;
+  rb_gc_mark(mutex->owner);
+  fiber_list_mark(&mutex->waiters);
+}
+
+static void Mutex_free(void *ptr) {
+  xfree(ptr);
+}
+
+static size_t Mutex_size(const void *ptr) {
+  return sizeof(Mutex_t);
+}
+
+static const rb_data_type_t Mutex_type = {
+  "Mutex",
+  {Mutex_mark, Mutex_free, Mutex_size,},
+  0, 0, 0
+};
+
+static VALUE Mutex_allocate(VALUE klass) {
+  Mutex_t *mutex;
+
+  mutex = ALLOC(Mutex_t);
+  return TypedData_Wrap_Struct(klass, &Mutex_type, mutex);
+}
+
+#define GetMutex(obj, mutex) \
+  TypedData_Get_Struct((obj), Mutex_t, &Mutex_type, (mutex))
+
+static VALUE Mutex_initialize(VALUE self) {
+  Mutex_t *mutex;
+  GetMutex(self, mutex);
+
+  mutex->owner = Qnil;
+  fiber_list_init(&mutex->waiters);
+
+  return self;
+}
+
+// Acquires the mutex for the given fiber. Returns the exception the fiber was
+// resumed with while waiting, or nil once the mutex is acquired.
+static VALUE mutex_lock(Mutex_t *mutex, VALUE fiber) {
+  int front = 0;
+
+  if (mutex->owner == Qnil && mutex->waiters.count == 0) {
+    mutex->owner = fiber;
+    return Qnil;
+  }
+
+  while (1) {
+    VALUE switchpoint_result = sync_wait(&mutex->waiters, front);
+    if (TEST_EXCEPTION(switchpoint_result)) {
+      // pass the wakeup on, in case this fiber was woken up by an unlock
+      if (mutex->owner == Qnil) sync_wake_first(&mutex->waiters);
+      return switchpoint_result;
+    }
+    if (mutex->owner == Qnil) {
+      mutex->owner = fiber;
+      return Qnil;
+    }
+    front = 1;
+  }
+}
+
+static inline void mutex_unlock(Mutex_t *mutex) {
+  mutex->owner = Qnil;
+  if (mutex->waiters.count > 0) sync_wake_first(&mutex->waiters);
+}
+
+VALUE Mutex_lock(VALUE self) {
+  Mutex_t *mutex;
+  VALUE fiber = rb_fiber_current();
+  GetMutex(self, mutex);
+
+  if (mutex->owner == fiber) rb_raise(rb_eThreadError, "deadlock; recursive locking");
+
+  VALUE ret = mutex_lock(mutex, fiber);
+  TEST_RESUME_EXCEPTION(ret);
+  return self;
+}
+
+VALUE Mutex_try_lock(VALUE self) {
+  Mutex_t *mutex;
+  GetMutex(self, mutex);
+
+  if (mutex->owner != Qnil || mutex->waiters.count > 0) return Qfalse;
+
+  mutex->owner = rb_fiber_current();
+  return Qtrue;
+}
+
+VALUE Mutex_unlock(VALUE self) {
+  Mutex_t *mutex;
+  GetMutex(self, mutex);
+
+  if (mutex->owner != rb_fiber_current())
+    rb_raise(rb_eThreadError, "Attempt to unlock a mutex which is not locked by the current fiber");
+
+  mutex_unlock(mutex);
+  return self;
+}
+
+static VALUE Mutex_synchronize_ensure(VALUE self) {
+  Mutex_t *mutex;
+  GetMutex(self, mutex);
+
+  // the mutex might not be held if reacquiring it in ConditionVariable#wait
+  // was interrupted
+  if (mutex->owner == rb_fiber_current()) mutex_unlock(mutex);
+  return Qnil;
+}
+
+VALUE Mutex_synchronize(VALUE self) {
+  Mutex_t *mutex;
+  VALUE fiber = rb_fiber_current();
+  GetMutex(self, mutex);
+
+  if (mutex->owner == fiber) return rb_yield(Qnil);
+
+  VALUE ret = mutex_lock(mutex, fiber);
+  TEST_RESUME_EXCEPTION(ret);
+  return rb_ensure(rb_yield, Qnil, Mutex_synchronize_ensure, self);
+}
+
+VALUE Mutex_locked_p(VALUE self) {
+  Mutex_t *mutex;
+  GetMutex(self, mutex);
+
+  return mutex->owner != Qnil ? Qtrue : Qfalse;
+}
+
+VALUE Mutex_owned_p(VALUE self) {
+  Mutex_t *mutex;
+  GetMutex(self, mutex);
+
+  return mutex->owner == rb_fiber_current() ? Qtrue : Qfalse;
+}
+
+//////////////////////////////////////////////////////////////////////
+// ConditionVariable
+
+typedef struct condition_variable {
+  fiber_list_t waiters;
+} ConditionVariable_t;
+
+static void ConditionVariable_mark(void *ptr) {
+  ConditionVariable_t *cv = ptr;
+  fiber_list_mark(&cv->waiters);
+}
+
+static void ConditionVariable_free(void *ptr) {
+  xfree(ptr);
+}
+
+static size_t ConditionVariable_size(const void *ptr) {
+  return sizeof(ConditionVariable_t);
+}
+
+static const rb_data_type_t ConditionVariable_type = {
+  "ConditionVariable",
+  {ConditionVariable_mark, ConditionVariable_free, ConditionVariable_size,},
+  0, 0, 0
+};
+
+static VALUE ConditionVariable_allocate(VALUE klass) {
+  ConditionVariable_t *cv;
+
+  cv = ALLOC(ConditionVariable_t);
+  return TypedData_Wrap_Struct(klass, &ConditionVariable_type, cv);
+}
+
+#define GetConditionVariable(obj, cv) \
+  TypedData_Get_Struct((obj), ConditionVariable_t, &ConditionVariable_type, (cv))
+
+static VALUE ConditionVariable_initialize(VALUE self) {
+  ConditionVariable_t *cv;
+  GetConditionVariable(self, cv);
+
+  fiber_list_init(&cv->waiters);
+
+  return self;
+}
+
+static VALUE condition_variable_wait_block(RB_BLOCK_CALL_FUNC_ARGLIST(_, cv_ptr)) {
+  return sync_wait(&((ConditionVariable_t *)cv_ptr)->waiters, 0);
+}
+
+// Releases the given mutex and waits for the condition variable to be
+// signalled, then reacquires the mutex. If a timeout is given, the wait ends
+// once it expires, using Backend#timeout.
+VALUE ConditionVariable_wait(int argc, VALUE *argv, VALUE self) {
+  ConditionVariable_t *cv;
+  Mutex_t *mutex;
+  VALUE fiber = rb_fiber_current();
+  VALUE mutex_obj, timeout;
+  VALUE switchpoint_result;
+
+  rb_scan_args(argc, argv, "11", &mutex_obj, &timeout);
+  GetConditionVariable(self, cv);
+  GetMutex(mutex_obj, mutex);
+
+  if (mutex->owner != fiber)
+    rb_raise(rb_eThreadError, "Attempt to wait on a mutex which is not locked by the current fiber");
+
+  mutex_unlock(mutex);
+  if (NIL_P(timeout))
+    switchpoint_result = sync_wait(&cv->waiters, 0);
+  else {
+    VALUE timeout_args[2] = { timeout, SYM_wait_timeout };
+    switchpoint_result = rb_block_call(
+      THREAD_BACKEND(rb_thread_current()), ID_timeout, 2, timeout_args,
+      condition_variable_wait_block, (VALUE)cv
+    );
+  }
+  VALUE ret = mutex_lock(mutex, fiber);
+
+  TEST_RESUME_EXCEPTION(ret);
+  TEST_RESUME_EXCEPTION(switchpoint_result);
+  RB_GC_GUARD(switchpoint_result);
+  return self;
+}
+
+VALUE ConditionVariable_signal(VALUE self) {
+  ConditionVariable_t *cv;
+  GetConditionVariable(self, cv);
+
+  sync_wake_first(&cv->waiters);
+  return self;
+}
+
+VALUE ConditionVariable_broadcast(VALUE self) {
+  ConditionVariable_t *cv;
+  GetConditionVariable(self, cv);
+
+  sync_wake_all(&cv->waiters);
+  return self;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Semaphore
+
+typedef struct semaphore {
+  long count;
+  fiber_list_t waiters;
+} Semaphore_t;
+
+static void Semaphore_mark(void *ptr) {
+  Semaphore_t *semaphore = ptr;
+  fiber_list_mark(&semaphore->waiters);
+}
+
+static void Semaphore_free(void *ptr) {
+  xfree(ptr);
+}
+
+static size_t Semaphore_size(const void *ptr) {
+  return sizeof(Semaphore_t);
+}
+
+static const rb_data_type_t Semaphore_type = {
+  "Semaphore",
+  {Semaphore_mark, Semaphore_free, Semaphore_size,},
+  0, 0, 0
+};
+
+static VALUE Semaphore_allocate(VALUE klass) {
+  Semaphore_t *semaphore;
+
+  semaphore = ALLOC(Semaphore_t);
+  return TypedData_Wrap_Struct(klass, &Semaphore_type, semaphore);
+}
+
+#define GetSemaphore(obj, semaphore) \
+  TypedData_Get_Struct((obj), Semaphore_t, &Semaphore_type, (semaphore))
+
+static VALUE Semaphore_initialize(VALUE self, VALUE count) {
+  Semaphore_t *semaphore;
+  GetSemaphore(self, semaphore);
+
+  semaphore->count = NUM2LONG(count);
+  if (semaphore->count < 0) rb_raise(rb_eArgError, "invalid semaphore count");
+  fiber_list_init(&semaphore->waiters);
+
+  return self;
+}
+
+VALUE Semaphore_acquire(VALUE self) {
+  Semaphore_t *semaphore;
+  int front = 0;
+  GetSemaphore(self, semaphore);
+
+  if (semaphore->count > 0 && semaphore->waiters.count == 0) {
+    semaphore->count--;
+    return self;
+  }
+
+  while (1) {
+    VALUE switchpoint_result = sync_wait(&semaphore->waiters, front);
+    if (TEST_EXCEPTION(switchpoint_result)) {
+      if (semaphore->count > 0) sync_wake_first(&semaphore->waiters);
+      return RAISE_EXCEPTION(switchpoint_result);
+    }
+    if (semaphore->count > 0) {
+      semaphore->count--;
+      return self;
+    }
+    front = 1;
+  }
+}
+
+VALUE Semaphore_try_acquire(VALUE self) {
+  Semaphore_t *semaphore;
+  GetSemaphore(self, semaphore);
+
+  if (semaphore->count == 0 || semaphore->waiters.count > 0) return Qfalse;
+
+  semaphore->count--;
+  return Qtrue;
+}
+
+VALUE Semaphore_release(VALUE self) {
+  Semaphore_t *semaphore;
+  GetSemaphore(self, semaphore);
+
+  semaphore->count++;
+  if (semaphore->waiters.count > 0) sync_wake_first(&semaphore->waiters);
+  return self;
+}
+
+VALUE Semaphore_synchronize(VALUE self) {
+  Semaphore_acquire(self);
+  return rb_ensure(rb_yield, Qnil, Semaphore_release, self);
+}
+
+VALUE Semaphore_available(VALUE self) {
+  Semaphore_t *semaphore;
+  GetSemaphore(self, semaphore);
+
+  return LONG2NUM(semaphore->count);
+}
+
+//////////////////////////////////////////////////////////////////////
+// RWLock
+
+// A reader/writer lock. Once a writer is waiting, new readers wait as well, so
+// that writers are not starved. Releasing the write lock wakes up all waiting
+// readers, or if there are none the first waiting writer.
+typedef struct rwlock {
+  long readers;
+  VALUE writer;
+  fiber_list_t read_waiters;
+  fiber_list_t write_waiters;
+} RWLock_t;
+
+static void RWLock_mark(void *ptr) {
+  RWLock_t *lock = ptr;
+  rb_gc_mark(lock->writer);
+  fiber_list_mark(&lock->read_waiters);
+  fiber_list_mark(&lock->write_waiters);
+}
+
+static void RWLock_free(void *ptr) {
+  xfree(ptr);
+}
+
+static size_t RWLock_size(const void *ptr) {
+  return sizeof(RWLock_t);
+}
+
+static const rb_data_type_t RWLock_type = {
+  "RWLock",
+  {RWLock_mark, RWLock_free, RWLock_size,},
+  0, 0, 0
+};
+
+static VALUE RWLock_allocate(VALUE klass) {
+  RWLock_t *lock;
+
+  lock = ALLOC(RWLock_t);
+  return TypedData_Wrap_Struct(klass, &RWLock_type, lock);
+}
+
+#define GetRWLock(obj, lock) \
+  TypedData_Get_Struct((obj), RWLock_t, &RWLock_type, (lock))
+
+static VALUE RWLock_initialize(VALUE self) {
+  RWLock_t *lock;
+  GetRWLock(self, lock);
+
+  lock->readers = 0;
+  lock->writer = Qnil;
+  fiber_list_init(&lock->read_waiters);
+  fiber_list_init(&lock->write_waiters);
+
+  return self;
+}
+
+// Wakes up waiting fibers once the lock is free
+static inline void rwlock_wake(RWLock_t *lock) {
+  if (lock->writer != Qnil) return;
+
+  if (lock->readers == 0 && lock->write_waiters.count > 0 && lock->read_waiters.count == 0)
+    sync_wake_first(&lock->write_waiters);
+  else if (lock->read_waiters.count > 0)
+    sync_wake_all(&lock->read_waiters);
+}
+
+VALUE RWLock_read_lock(VALUE self) {
+  RWLock_t *lock;
+  int front = 0;
+  GetRWLock(self, lock);
+
+  if (lock->writer == Qnil && lock->write_waiters.count == 0) {
+    lock->readers++;
+    return self;
+  }
+
+  while (1) {
+    VALUE switchpoint_result = sync_wait(&lock->read_waiters, front);
+    TEST_RESUME_EXCEPTION(switchpoint_result);
+    if (lock->writer == Qnil) {
+      lock->readers++;
+      return self;
+    }
+    front = 1;
+  }
+}
+
+VALUE RWLock_read_unlock(VALUE self) {
+  RWLock_t *lock;
+  GetRWLock(self, lock);
+
+  if (lock->readers == 0) rb_raise(rb_eThreadError, "RWLock is not read locked");
+
+  if (--lock->readers == 0 && lock->write_waiters.count > 0)
+    sync_wake_first(&lock->write_waiters);
+  return self;
+}
+
+VALUE RWLock_write_lock(VALUE self) {
+  RWLock_t *lock;
+  VALUE fiber = rb_fiber_current();
+  int front = 0;
+  GetRWLock(self, lock);
+
+  if (lock->writer == fiber) rb_raise(rb_eThreadError, "deadlock; recursive locking");
+
+  if (lock->writer == Qnil && lock->readers == 0 && lock->write_waiters.count == 0) {
+    lock->writer = fiber;
+    return self;
+  }
+
+  while (1) {
+    VALUE switchpoint_result = sync_wait(&lock->write_waiters, front);
+    if (TEST_EXCEPTION(switchpoint_result)) {
+      rwlock_wake(lock);
+      return RAISE_EXCEPTION(switchpoint_result);
+    }
+    if (lock->writer == Qnil && lock->readers == 0) {
+      lock->writer = fiber;
+      return self;
+    }
+    front = 1;
+  }
+}
+
+VALUE RWLock_write_unlock(VALUE self) {
+  RWLock_t *lock;
+  GetRWLock(self, lock);
+
+  if (lock->writer != rb_fiber_current())
+    rb_raise(rb_eThreadError, "RWLock is not write locked by the current fiber");
+
+  lock->writer = Qnil;
+  if (lock->read_waiters.count > 0)
+    sync_wake_all(&lock->read_waiters);
+  else if (lock->write_waiters.count > 0)
+    sync_wake_first(&lock->write_waiters);
+  return self;
+}
+
+VALUE RWLock_with_read_lock(VALUE self) {
+  RWLock_read_lock(self);
+  return rb_ensure(rb_yield, Qnil, RWLock_read_unlock, self);
+}
+
+VALUE RWLock_with_write_lock(VALUE self) {
+  RWLock_write_lock(self);
+  return rb_ensure(rb_yield, Qnil, RWLock_write_unlock, self);
+}
+
+VALUE RWLock_readers(VALUE self) {
+  RWLock_t *lock;
+  GetRWLock(self, lock);
+
+  return LONG2NUM(lock->readers);
+}
+
+VALUE RWLock_write_locked_p(VALUE self) {
+  RWLock_t *lock;
+  GetRWLock(self, lock);
+
+  return lock->writer != Qnil ? Qtrue : Qfalse;
+}
+
+void Init_Sync() {
+  ID_timeout = rb_intern("timeout");
+  SYM_wait_timeout = ID2SYM(rb_intern("wait_timeout"));
+
+  cMutex = rb_define_class_under(mPolyphony, "Mutex", rb_cData);
+  rb_define_alloc_func(cMutex, Mutex_allocate);
+
+  rb_define_method(cMutex, "initialize", Mutex_initialize, 0);
+  rb_define_method(cMutex, "lock", Mutex_lock, 0);
+  rb_define_method(cMutex, "try_lock", Mutex_try_lock, 0);
+  rb_define_method(cMutex, "unlock", Mutex_unlock, 0);
+  rb_define_method(cMutex, "synchronize", Mutex_synchronize, 0);
+  rb_define_method(cMutex, "locked?", Mutex_locked_p, 0);
+  rb_define_method(cMutex, "owned?", Mutex_owned_p, 0);
+
+  cConditionVariable = rb_define_class_under(mPolyphony, "ConditionVariable", rb_cData);
+  rb_define_alloc_func(cConditionVariable, ConditionVariable_allocate);
+
+  rb_define_method(cConditionVariable, "initialize", ConditionVariable_initialize, 0);
+  rb_define_method(cConditionVariable, "wait", ConditionVariable_wait, -1);
+  rb_define_method(cConditionVariable, "signal", ConditionVariable_signal, 0);
+  rb_define_method(cConditionVariable, "broadcast", ConditionVariable_broadcast, 0);
+
+  cSemaphore = rb_define_class_under(mPolyphony, "Semaphore", rb_cData);
+  rb_define_alloc_func(cSemaphore, Semaphore_allocate);
+
+  rb_define_method(cSemaphore, "initialize", Semaphore_initialize, 1);
+  rb_define_method(cSemaphore, "acquire", Semaphore_acquire, 0);
+  rb_define_method(cSemaphore, "try_acquire", Semaphore_try_acquire, 0);
+  rb_define_method(cSemaphore, "release", Semaphore_release, 0);
+  rb_define_method(cSemaphore, "synchronize", Semaphore_synchronize, 0);
+  rb_define_method(cSemaphore, "available", Semaphore_available, 0);
+
+  cRWLock = rb_define_class_under(mPolyphony, "RWLock", rb_cData);
+  rb_define_alloc_func(cRWLock, RWLock_allocate);
+
+  rb_define_method(cRWLock, "initialize", RWLock_initialize, 0);
+  rb_define_method(cRWLock, "read_lock", RWLock_read_lock, 0);
+  rb_define_method(cRWLock, "read_unlock", RWLock_read_unlock, 0);
+  rb_define_method(cRWLock, "write_lock", RWLock_write_lock, 0);
+  rb_define_method(cRWLock, "write_unlock", RWLock_write_unlock, 0);
+  rb_define_method(cRWLock, "with_read_lock", RWLock_with_read_lock, 0);
+  rb_define_method(cRWLock, "with_write_lock", RWLock_with_write_lock, 0);
+  rb_define_method(cRWLock, "readers", RWLock_readers, 0);
+  rb_define_method(cRWLock, "write_locked?", RWLock_write_locked_p, 0);
+}
@@ -1,44 +1,109 @@
 #include "polyphony.h"
 
 ID ID_deactivate_all_watchers_post_fork;
-ID ID_ivar_backend;
 ID ID_ivar_join_wait_queue;
 ID ID_ivar_main_fiber;
 ID ID_ivar_result;
 ID ID_ivar_terminated;
-ID ID_run_queue;
 ID ID_runnable_next;
 ID ID_stop;
 
-static VALUE Thread_setup_fiber_scheduling(VALUE self) {
-  VALUE queue = rb_funcall(cQueue, ID_new, 0);
+static void inbox_entries_mark(inbox_entry_t *entry) {
+  for (; entry; entry = entry->next) {
+    rb_gc_mark(entry->fiber);
+    rb_gc_mark(entry->value);
+  }
+}
+
+static void inbox_entries_free(inbox_entry_t *entry) {
+  while (entry) {
+    inbox_entry_t *next = entry->next;
+    free(entry);
+    entry = next;
+  }
+}
+
+static void ThreadSched_mark(void *ptr) {
+  thread_sched_t *sched = ptr;
+  fiber_list_mark(&sched->run_queue);
+  rb_gc_mark(sched->backend);
+  rb_gc_mark(sched->corked);
+  rb_gc_mark(sched->cork_flushes);
+  rb_gc_mark(sched->cork_flusher);
+  // entries are only ever prepended by producers and freed by the owning
+  // thread, so the inbox can be walked from a snapshot of its head
+  inbox_entries_mark(__atomic_load_n(&sched->inbox, __ATOMIC_ACQUIRE));
+  inbox_entries_mark(sched->draining);
+}
+
+static void ThreadSched_free(void *ptr) {
+  thread_sched_t *sched = ptr;
+  inbox_entries_free(sched->inbox);
+  inbox_entries_free(sched->draining);
+  xfree(ptr);
+}
+
+static const rb_data_type_t ThreadSched_type = {
+  "ThreadSched",
+  {ThreadSched_mark, ThreadSched_free, 0,},
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+// Returns the scheduling state for the given thread, creating it if needed
+thread_sched_t *Thread_sched(VALUE self) {
+  VALUE obj = rb_ivar_get(self, ID_sched);
+  thread_sched_t *sched;
+
+  if (obj != Qnil) return RTYPEDDATA_DATA(obj);
+
+  obj = TypedData_Make_Struct(0, thread_sched_t, &ThreadSched_type, sched);
+  fiber_list_init(&sched->run_queue);
+  sched->backend = Qnil;
+  sched->inbox = sched->draining = NULL;
+  sched->wakeup_pending = 0;
+  sched->corked = Qnil;
+  sched->cork_flushes = Qnil;
+  sched->cork_flusher = Qnil;
+  sched->cork_flusher_waiting = 0;
+  backend_budget_reset(&sched->budget);
+  rb_ivar_set(self, ID_sched, obj);
+  return sched;
+}
 
+static VALUE Thread_setup_fiber_scheduling(VALUE self) {
   rb_ivar_set(self, ID_ivar_main_fiber, rb_fiber_current());
-  rb_ivar_set(self, ID_run_queue, queue);
+  fiber_list_clear(&Thread_sched(self)->run_queue);
 
   return self;
 }
 
+static VALUE Thread_backend(VALUE self) {
+  return THREAD_BACKEND(self);
+}
+
+static VALUE Thread_set_backend(VALUE self, VALUE backend) {
+  Thread_sched(self)->backend = backend;
+  return backend;
+}
+
 int Thread_fiber_ref_count(VALUE self) {
-  VALUE backend = rb_ivar_get(self, ID_ivar_backend);
-  return NUM2INT(__BACKEND__.ref_count(backend));
+  return NUM2INT(__BACKEND__.ref_count(THREAD_BACKEND(self)));
 }
 
 inline void Thread_fiber_reset_ref_count(VALUE self) {
-  VALUE backend = rb_ivar_get(self, ID_ivar_backend);
-  __BACKEND__.reset_ref_count(backend);
+  __BACKEND__.reset_ref_count(THREAD_BACKEND(self));
 }
 
 static VALUE SYM_scheduled_fibers;
 static VALUE SYM_pending_watchers;
 
 static VALUE Thread_fiber_scheduling_stats(VALUE self) {
-  VALUE backend = rb_ivar_get(self,ID_ivar_backend);
+  thread_sched_t *sched = Thread_sched(self);
+  VALUE backend = sched->backend;
   VALUE stats = rb_hash_new();
-  VALUE queue = rb_ivar_get(self, ID_run_queue);
   long pending_count;
 
-  long scheduled_count = RARRAY_LEN(queue);
+  long scheduled_count = sched->run_queue.count;
   rb_hash_aset(stats, SYM_scheduled_fibers, INT2NUM(scheduled_count));
 
   pending_count = __BACKEND__.pending_count(backend);
@@ -47,131 +112,191 @@ static VALUE Thread_fiber_scheduling_stats(VALUE self) {
   return stats;
 }
 
-VALUE Thread_schedule_fiber(VALUE self, VALUE fiber, VALUE value) {
-  VALUE queue;
+static void thread_schedule_fiber(
+  thread_sched_t *sched, VALUE fiber, fiber_sched_t *fiber_sched, VALUE value
+) {
+  if (rb_fiber_alive_p(fiber) != Qtrue) return;
+
+  // If the fiber is already runnable and the runnable value is an exception,
+  // we don't update the value, in order to prevent a race condition where
+  // exceptions will be lost (see issue #33)
+  if (FIBER_SCHED_RUNNABLE(fiber_sched)) {
+    if (!TEST_EXCEPTION(fiber_sched->runnable_value))
+      fiber_sched->runnable_value = value;
+    return;
+  }
 
-  if (rb_fiber_alive_p(fiber) != Qtrue) return self;
+  fiber_sched->runnable_value = value;
+  fiber_list_push(&sched->run_queue, &fiber_sched->run_node);
+}
 
-  int already_runnable = rb_ivar_get(fiber, ID_runnable) != Qnil;
+static void thread_schedule_fiber_with_priority(
+  thread_sched_t *sched, VALUE fiber, fiber_sched_t *fiber_sched, VALUE value
+) {
+  if (rb_fiber_alive_p(fiber) != Qtrue) return;
 
-  if (already_runnable) {
-    VALUE current_runnable_value = rb_ivar_get(fiber, ID_runnable_value);
+  fiber_sched->runnable_value = value;
 
-    // If the fiber is already runnable and the runnable value is an exception,
-    // we don't update the value, in order to prevent a race condition where
-    // exceptions will be lost (see issue #33)
-    if (TEST_EXCEPTION(current_runnable_value)) return self;
-  }
+  // if fiber is already scheduled, remove it from the run queue
+  if (FIBER_SCHED_RUNNABLE(fiber_sched))
+    fiber_list_delete(fiber_sched->run_node.list, &fiber_sched->run_node);
 
-  rb_ivar_set(fiber, ID_runnable_value, value);
-  COND_TRACE(3, SYM_fiber_schedule, fiber, value);
+  // the fiber is given priority by putting it at the front of the run queue
+  fiber_list_unshift(&sched->run_queue, &fiber_sched->run_node);
+}
 
-  if (!already_runnable) {
-    queue = rb_ivar_get(self, ID_run_queue);
-    Queue_push(queue, fiber);
-    rb_ivar_set(fiber, ID_runnable, Qtrue);
-
-    if (rb_thread_current() != self) {
-      // If the fiber scheduling is done across threads, we need to make sure the
-      // target thread is woken up in case it is in the middle of running its
-      // event selector. Otherwise it's gonna be stuck waiting for an event to
-      // happen, not knowing that it there's already a fiber ready to run in its
-      // run queue.
-      VALUE backend = rb_ivar_get(self,ID_ivar_backend);
-      __BACKEND__.wakeup(backend);
-    }
-  }
-  return self;
+// Pushes a fiber scheduled from another thread onto the thread's inbox. The
+// thread is woken up only for the first entry pushed since the inbox was last
+// drained, in case it is in the middle of running its event loop. Otherwise
+// it's gonna be stuck waiting for an event to happen, not knowing that
+// there's already a fiber ready to run.
+static void thread_inbox_push(thread_sched_t *sched, VALUE fiber, VALUE value, int priority) {
+  inbox_entry_t *entry = malloc(sizeof(inbox_entry_t));
+  if (!entry) rb_memerror();
+
+  entry->fiber = fiber;
+  entry->value = value;
+  entry->priority = priority;
+  entry->next = __atomic_load_n(&sched->inbox, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(
+    &sched->inbox, &entry->next, entry, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED
+  ));
+
+  if (!__atomic_exchange_n(&sched->wakeup_pending, 1, __ATOMIC_ACQ_REL))
+    __BACKEND__.wakeup(sched->backend);
 }
 
-VALUE Thread_schedule_fiber_with_priority(VALUE self, VALUE fiber, VALUE value) {
-  VALUE queue;
+// Schedules all fibers pushed onto the thread's inbox, in the order they were
+// pushed. Called by the owning thread only.
+static void thread_inbox_drain(thread_sched_t *sched) {
+  inbox_entry_t *entry;
+
+  // reset the flag before taking the entries, so that any entry pushed after
+  // the inbox is taken will cause another wakeup. The flag is reset even if
+  // the inbox is empty, since a producer whose entry was taken by a previous
+  // drain may have set it afterwards.
+  __atomic_exchange_n(&sched->wakeup_pending, 0, __ATOMIC_ACQ_REL);
+  entry = __atomic_exchange_n(&sched->inbox, NULL, __ATOMIC_ACQUIRE);
+  if (!entry) return;
+
+  // the inbox is a stack, so the entries are reversed
+  while (entry) {
+    inbox_entry_t *next = entry->next;
+    entry->next = sched->draining;
+    sched->draining = entry;
+    entry = next;
+  }
+
+  while ((entry = sched->draining)) {
+    fiber_sched_t *fiber_sched = Fiber_sched(entry->fiber);
+    if (entry->priority)
+      thread_schedule_fiber_with_priority(sched, entry->fiber, fiber_sched, entry->value);
+    else
+      thread_schedule_fiber(sched, entry->fiber, fiber_sched, entry->value);
+    sched->draining = entry->next;
+    free(entry);
+  }
+}
 
-  if (rb_fiber_alive_p(fiber) != Qtrue) return self;
+// Schedules the fiber on its own thread, using the thread's scheduling state
+// referenced by the fiber's scheduling state.
+void Thread_schedule_fiber_sched(fiber_sched_t *fiber_sched, VALUE fiber, VALUE value) {
+  VALUE thread = fiber_sched->thread;
 
   COND_TRACE(3, SYM_fiber_schedule, fiber, value);
-  rb_ivar_set(fiber, ID_runnable_value, value);
-
-  queue = rb_ivar_get(self, ID_run_queue);
+  if (rb_thread_current() != thread)
+    thread_inbox_push(fiber_sched->thread_sched, fiber, value, 0);
+  else
+    thread_schedule_fiber(fiber_sched->thread_sched, fiber, fiber_sched, value);
+}
 
-  // if fiber is already scheduled, remove it from the run queue
-  if (rb_ivar_get(fiber, ID_runnable) != Qnil) {
-    Queue_delete(queue, fiber);
-  } else {
-    rb_ivar_set(fiber, ID_runnable, Qtrue);
-  }
+VALUE Thread_schedule_fiber(VALUE self, VALUE fiber, VALUE value) {
+  COND_TRACE(3, SYM_fiber_schedule, fiber, value);
+  if (rb_thread_current() != self)
+    thread_inbox_push(Thread_sched(self), fiber, value, 0);
+  else
+    thread_schedule_fiber(Thread_sched(self), fiber, Fiber_sched(fiber), value);
+  return self;
+}
 
-  // the fiber is given priority by putting it at the front of the run queue
-  Queue_unshift(queue, fiber);
-
-  if (rb_thread_current() != self) {
-    // if the fiber scheduling is done across threads, we need to make sure the
-    // target thread is woken up in case it is in the middle of running its
-    // event loop. Otherwise it's gonna be stuck waiting for an event to
-    // happen, not knowing that it there's already a fiber ready to run in its
-    // run queue.
-    VALUE backend = rb_ivar_get(self, ID_ivar_backend);
-    __BACKEND__.wakeup(backend);
-  }
+VALUE Thread_schedule_fiber_with_priority(VALUE self, VALUE fiber, VALUE value) {
+  COND_TRACE(3, SYM_fiber_schedule, fiber, value);
+  if (rb_thread_current() != self)
+    thread_inbox_push(Thread_sched(self), fiber, value, 1);
+  else
+    thread_schedule_fiber_with_priority(Thread_sched(self), fiber, Fiber_sched(fiber), value);
   return self;
 }
 
 VALUE Thread_switch_fiber(VALUE self) {
+  thread_sched_t *sched = Thread_sched(self);
+  fiber_sched_t *fiber_sched;
   VALUE current_fiber = rb_fiber_current();
-  VALUE queue = rb_ivar_get(self, ID_run_queue);
+  VALUE backend = sched->backend;
   VALUE next_fiber;
   VALUE value;
-  VALUE backend = rb_ivar_get(self, ID_ivar_backend);
   int ref_count;
   int backend_was_polled = 0;
 
   if (__tracing_enabled__ && (rb_ivar_get(current_fiber, ID_ivar_running) != Qfalse))
     TRACE(2, SYM_fiber_switchpoint, current_fiber);
 
+  if (sched->corked != Qnil && RARRAY_LEN(sched->corked) > 0)
+    Cork_flush_pending(sched);
+  backend_budget_reset(&sched->budget);
+
   ref_count = __BACKEND__.ref_count(backend);
   while (1) {
-    next_fiber = Queue_shift_no_wait(queue);
-    if (next_fiber != Qnil) {
+    thread_inbox_drain(sched);
+    if (sched->run_queue.count > 0) {
+      // The next fiber is taken from the run queue only after polling, so
+      // that a fiber scheduled by the poll is not added to the run queue
+      // a second time.
       if (backend_was_polled == 0 && ref_count > 0) {
         // this prevents event starvation in case the run queue never empties
-        __BACKEND__.poll(backend, Qtrue, current_fiber, queue);
+        __BACKEND__.poll(backend, Qtrue, current_fiber, LONG2NUM(sched->run_queue.count - 1));
       }
+      next_fiber = fiber_list_shift(&sched->run_queue);
       break;
     }
+    next_fiber = Qnil;
     if (ref_count == 0) break;
 
-    __BACKEND__.poll(backend, Qnil, current_fiber, queue);
+    __BACKEND__.poll(backend, Qnil, current_fiber, LONG2NUM(sched->run_queue.count));
     backend_was_polled = 1;
   }
 
   if (next_fiber == Qnil) return Qnil;
 
   // run next fiber
-  value = rb_ivar_get(next_fiber, ID_runnable_value);
+  fiber_sched = Fiber_sched(next_fiber);
+  value = fiber_sched->runnable_value;
   COND_TRACE(3, SYM_fiber_run, next_fiber, value);
 
-  rb_ivar_set(next_fiber, ID_runnable, Qnil);
+  fiber_sched->runnable_value = Qnil;
   RB_GC_GUARD(next_fiber);
   RB_GC_GUARD(value);
   return (next_fiber == current_fiber) ?
-    value : rb_funcall(next_fiber, ID_transfer, 1, value);
+    value : FIBER_TRANSFER(next_fiber, value);
 }
 
 VALUE Thread_run_queue_trace(VALUE self) {
-  VALUE queue = rb_ivar_get(self, ID_run_queue);
-  Queue_trace(queue);
+  printf("run queue count: %ld\n", Thread_sched(self)->run_queue.count);
   return self;
 }
 
 VALUE Thread_reset_fiber_scheduling(VALUE self) {
-  VALUE queue = rb_ivar_get(self, ID_run_queue);
-  Queue_clear(queue);
+  thread_sched_t *sched = Thread_sched(self);
+  fiber_list_clear(&sched->run_queue);
+  inbox_entries_free(__atomic_exchange_n(&sched->inbox, NULL, __ATOMIC_ACQUIRE));
+  __atomic_store_n(&sched->wakeup_pending, 0, __ATOMIC_RELEASE);
+  Cork_clear_pending(sched);
   Thread_fiber_reset_ref_count(self);
   return self;
 }
 
 VALUE Thread_fiber_break_out_of_ev_loop(VALUE self, VALUE fiber, VALUE resume_obj) {
-  VALUE backend = rb_ivar_get(self, ID_ivar_backend);
+  VALUE backend = THREAD_BACKEND(self);
   if (fiber != Qnil) {
     Thread_schedule_fiber_with_priority(self, fiber, resume_obj);
   }
@@ -192,6 +317,8 @@ VALUE Thread_debug(VALUE self) {
 void Init_Thread() {
   rb_define_method(rb_cThread, "setup_fiber_scheduling", Thread_setup_fiber_scheduling, 0);
   rb_define_method(rb_cThread, "reset_fiber_scheduling", Thread_reset_fiber_scheduling, 0);
+  rb_define_method(rb_cThread, "backend", Thread_backend, 0);
+  rb_define_method(rb_cThread, "backend=", Thread_set_backend, 1);
   rb_define_method(rb_cThread, "fiber_scheduling_stats", Thread_fiber_scheduling_stats, 0);
   rb_define_method(rb_cThread, "break_out_of_ev_loop", Thread_fiber_break_out_of_ev_loop, 2);
 
@@ -204,12 +331,10 @@ void Init_Thread() {
   rb_define_method(rb_cThread, "debug!", Thread_debug, 0);
 
   ID_deactivate_all_watchers_post_fork = rb_intern("deactivate_all_watchers_post_fork");
-  ID_ivar_backend               = rb_intern("@backend");
   ID_ivar_join_wait_queue     = rb_intern("@join_wait_queue");
   ID_ivar_main_fiber          = rb_intern("@main_fiber");
   ID_ivar_result              = rb_intern("@result");
   ID_ivar_terminated          = rb_intern("@terminated");
-  ID_run_queue                = rb_intern("run_queue");
   ID_runnable_next            = rb_intern("runnable_next");
   ID_stop                     = rb_intern("stop");
 
@@ -0,0 +1,124 @@
+#ifdef POLYPHONY_BACKEND_IO_URING
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static inline int uring_setup_syscall(unsigned entries, struct io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int uring_enter_syscall(
+  int fd, unsigned to_submit, unsigned min_complete, unsigned flags
+) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_unmap_rings(uring_t *ring) {
+  if (ring->sq.sqes) munmap(ring->sq.sqes, ring->sq.sqes_size);
+  if (ring->cq.ring_ptr && ring->cq.ring_ptr != ring->sq.ring_ptr)
+    munmap(ring->cq.ring_ptr, ring->cq.ring_size);
+  if (ring->sq.ring_ptr) munmap(ring->sq.ring_ptr, ring->sq.ring_size);
+}
+
+// Sets up a ring with the given number of SQ entries. Returns 0 on success or
+// a negative errno value on failure.
+int uring_init(uring_t *ring, unsigned entries) {
+  struct io_uring_params p;
+  struct uring_sq *sq = &ring->sq;
+  struct uring_cq *cq = &ring->cq;
+  void *ptr;
+  int e;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&p, 0, sizeof(p));
+
+  ring->ring_fd = uring_setup_syscall(entries, &p);
+  if (ring->ring_fd < 0) return -errno;
+
+  ring->features = p.features;
+  sq->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq->ring_size > sq->ring_size) sq->ring_size = cq->ring_size;
+    cq->ring_size = sq->ring_size;
+  }
+
+  ptr = mmap(0, sq->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    ring->ring_fd, IORING_OFF_SQ_RING);
+  if (ptr == MAP_FAILED) goto error;
+  sq->ring_ptr = ptr;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    cq->ring_ptr = sq->ring_ptr;
+  else {
+    ptr = mmap(0, cq->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->ring_fd, IORING_OFF_CQ_RING);
+    if (ptr == MAP_FAILED) goto error;
+    cq->ring_ptr = ptr;
+  }
+
+  sq->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ptr = mmap(0, sq->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    ring->ring_fd, IORING_OFF_SQES);
+  if (ptr == MAP_FAILED) goto error;
+  sq->sqes = ptr;
+
+  sq->khead         = (unsigned *)((char *)sq->ring_ptr + p.sq_off.head);
+  sq->ktail         = (unsigned *)((char *)sq->ring_ptr + p.sq_off.tail);
+  sq->kring_mask    = (unsigned *)((char *)sq->ring_ptr + p.sq_off.ring_mask);
+  sq->kring_entries = (unsigned *)((char *)sq->ring_ptr + p.sq_off.ring_entries);
+  sq->array         = (unsigned *)((char *)sq->ring_ptr + p.sq_off.array);
+
+  cq->khead         = (unsigned *)((char *)cq->ring_ptr + p.cq_off.head);
+  cq->ktail         = (unsigned *)((char *)cq->ring_ptr + p.cq_off.tail);
+  cq->kring_mask    = (unsigned *)((char *)cq->ring_ptr + p.cq_off.ring_mask);
+  cq->cqes          = (struct io_uring_cqe *)((char *)cq->ring_ptr + p.cq_off.cqes);
+
+  return 0;
+error:
+  e = errno;
+  uring_unmap_rings(ring);
+  close(ring->ring_fd);
+  ring->ring_fd = -1;
+  return -e;
+}
+
+void uring_exit(uring_t *ring) {
+  if (ring->ring_fd < 0) return;
+
+  uring_unmap_rings(ring);
+  close(ring->ring_fd);
+  ring->ring_fd = -1;
+}
+
+// Makes all prepared SQEs visible to the kernel, returning the number of SQEs
+// waiting to be submitted.
+unsigned uring_flush_sq(uring_t *ring) {
+  struct uring_sq *sq = &ring->sq;
+  unsigned mask = *sq->kring_mask;
+  unsigned tail = *sq->ktail;
+
+  if (sq->sqe_head != sq->sqe_tail) {
+    while (sq->sqe_head != sq->sqe_tail) {
+      sq->array[tail & mask] = sq->sqe_head & mask;
+      tail++;
+      sq->sqe_head++;
+    }
+    uring_store_release(sq->ktail, tail);
+  }
+
+  return tail - uring_load_acquire(sq->khead);
+}
+
+// Submits up to to_submit SQEs and optionally waits for min_complete CQEs.
+// Returns the number of SQEs consumed or a negative errno value.
+int uring_enter(uring_t *ring, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  int ret = uring_enter_syscall(ring->ring_fd, to_submit, min_complete, flags);
+  return (ret < 0) ? -errno : ret;
+}
+
+#endif /* POLYPHONY_BACKEND_IO_URING */
@@ -0,0 +1,107 @@
+#ifndef URING_H
+#define URING_H
+
+#include <string.h>
+#include <linux/io_uring.h>
+
+// A minimal io_uring interface along the lines of liburing. It talks directly
+// to the kernel using the io_uring_setup/io_uring_enter syscalls, so there's no
+// external library dependency.
+
+struct uring_sq {
+  unsigned *khead;
+  unsigned *ktail;
+  unsigned *kring_mask;
+  unsigned *kring_entries;
+  unsigned *array;
+  struct io_uring_sqe *sqes;
+
+  // SQEs between sqe_head and sqe_tail have been prepared but not yet made
+  // visible to the kernel
+  unsigned sqe_head;
+  unsigned sqe_tail;
+
+  void *ring_ptr;
+  size_t ring_size;
+  size_t sqes_size;
+};
+
+struct uring_cq {
+  unsigned *khead;
+  unsigned *ktail;
+  unsigned *kring_mask;
+  struct io_uring_cqe *cqes;
+
+  void *ring_ptr;
+  size_t ring_size;
+};
+
+typedef struct uring {
+  struct uring_sq sq;
+  struct uring_cq cq;
+  int ring_fd;
+  unsigned features;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned entries);
+void uring_exit(uring_t *ring);
+unsigned uring_flush_sq(uring_t *ring);
+int uring_enter(uring_t *ring, unsigned to_submit, unsigned min_complete, unsigned flags);
+
+#define uring_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define uring_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// Returns a free SQE, or NULL if the submission queue is full
+static inline struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+  struct uring_sq *sq = &ring->sq;
+  unsigned head = uring_load_acquire(sq->khead);
+  struct io_uring_sqe *sqe;
+
+  if (sq->sqe_tail - head >= *sq->kring_entries) return NULL;
+
+  sqe = &sq->sqes[sq->sqe_tail & *sq->kring_mask];
+  sq->sqe_tail++;
+  return sqe;
+}
+
+// Returns the next available CQE, or NULL if the completion queue is empty
+static inline struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+  struct uring_cq *cq = &ring->cq;
+  unsigned head = *cq->khead;
+
+  if (head == uring_load_acquire(cq->ktail)) return NULL;
+
+  return &cq->cqes[head & *cq->kring_mask];
+}
+
+static inline void uring_cqe_seen(uring_t *ring) {
+  uring_store_release(ring->cq.khead, *ring->cq.khead + 1);
+}
+
+static inline unsigned uring_cq_ready(uring_t *ring) {
+  return uring_load_acquire(ring->cq.ktail) - *ring->cq.khead;
+}
+
+static inline void uring_prep_rw(
+  int op, struct io_uring_sqe *sqe, int fd, const void *addr, unsigned len,
+  __u64 offset
+) {
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = (unsigned long) addr;
+  sqe->len = len;
+}
+
+// Prepares a splice or tee operation from fd_in to fd_out. An offset of -1 means the current file position (must be -1 for pipes).
+static inline void uring_prep_splice(
+  int op, struct io_uring_sqe *sqe, int fd_in, __u64 off_in, int fd_out,
+  __u64 off_out, unsigned nbytes
+) {
+  uring_prep_rw(op, sqe, fd_out, NULL, nbytes, off_out);
+  sqe->splice_fd_in = fd_in;
+  sqe->splice_off_in = off_in;
+}
+
+#endif /* URING_H */
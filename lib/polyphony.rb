@@ -13,7 +13,7 @@ Thread.current.backend = Polyphony::Backend.new
 
 require_relative './polyphony/core/global_api'
 require_relative './polyphony/core/resource_pool'
-require_relative './polyphony/core/sync'
+require_relative './polyphony/core/fiber_pool'
 require_relative './polyphony/net'
 require_relative './polyphony/adapters/process'
 
@@ -52,6 +52,7 @@ module Polyphony
 
     def run_forked_block(&block)
       Thread.current.setup
+      Thread.current.fiber_pool&.clear
       Fiber.current.setup_main_fiber
       Thread.current.backend.post_fork
 
@@ -71,6 +72,14 @@ module Polyphony
       exit
     end
 
+    # Waits for a value to become available on any of the given queues, or for
+    # any of the given IOs to become readable, without spinning any fibers.
+    # Returns a `[queue, value]` pair, with the value shifted from the queue, or
+    # an `[io, nil]` pair. Returns nil if the timeout expires first.
+    def select(queues: nil, ios: nil, timeout: nil)
+      Thread.current.backend.select(queues, ios, timeout)
+    end
+
     def watch_process(cmd = nil, &block)
       Polyphony::Process.watch(cmd, &block)
     end
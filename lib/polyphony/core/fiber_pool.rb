@@ -0,0 +1,90 @@
+# frozen_string_literal: true
+
+module Polyphony
+  # Implements a per-thread pool of idle fibers, reused by `spin` instead of
+  # creating a new fiber (and machine stack) for each spun block. The pool is
+  # opt-in:
+  #
+  #   Thread.current.fiber_pool = Polyphony::FiberPool.new(max_size: 1000)
+  #
+  # Once a pooled fiber has terminated, it is parked in the pool until reused
+  # by a subsequent call to `spin`. Therefore, references to terminated fibers
+  # should not be kept, since the fiber may already be running another block.
+  # Fibers that have been idle longer than `idle_timeout` seconds are dropped
+  # from the pool. Idle time is measured using the monotonic loop time
+  # (`Polyphony.now`), so it is not affected by changes to the system time.
+  class FiberPool
+    attr_reader :max_size, :idle_timeout
+
+    def initialize(max_size: 256, idle_timeout: 60)
+      @max_size = max_size
+      @idle_timeout = idle_timeout
+      @idle = []
+    end
+
+    # Returns the number of idle fibers
+    def size
+      @idle.size
+    end
+
+    def checkout
+      fiber = @idle.pop
+      return new_fiber unless fiber
+
+      fiber.pool_reset
+      fiber
+    end
+
+    # Parks the given terminated fiber in the pool. Returns false if the pool
+    # is full, in which case the fiber should terminate.
+    def park(fiber)
+      trim
+      return false if @idle.size >= @max_size
+
+      fiber.pool_idle_since = Polyphony.now
+      @idle << fiber
+      true
+    end
+
+    # Switches away from the given parked fiber, returning once the fiber is
+    # checked out. If no other fiber is runnable, control is passed to the
+    # thread's main fiber, as it would be by a terminating fiber.
+    def await_checkout(fiber)
+      loop do
+        value = Thread.current.switch_fiber
+        if value.nil? && fiber.pool_idle_since
+          value = Thread.current.main_fiber.transfer
+        end
+        return value unless fiber.pool_idle_since
+      end
+    end
+
+    def trim
+      return if @idle.empty?
+
+      cutoff = Polyphony.now - @idle_timeout
+      @idle.shift while @idle.first && @idle.first.pool_idle_since < cutoff
+    end
+
+    def clear
+      @idle.clear
+    end
+
+    private
+
+    def new_fiber
+      pool = self
+      fiber = Fiber.new do |value|
+        loop do
+          fiber.run(value)
+          break unless pool.park(fiber)
+
+          value = pool.await_checkout(fiber)
+        end
+        Thread.current.switch_fiber
+      end
+      fiber.pool = pool
+      fiber
+    end
+  end
+end
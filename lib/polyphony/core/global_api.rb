@@ -16,13 +16,14 @@ module Polyphony
     end
 
     def cancel_after(interval, with_exception: Polyphony::Cancel, &block)
+      return cancel_after_with_block(interval, with_exception, &block) if block
+
       fiber = ::Fiber.current
-      canceller = spin do
+      spin do
         sleep interval
         exception = cancel_exception(with_exception)
         fiber.schedule exception
       end
-      block ? cancel_after_wrap_block(canceller, &block) : canceller
     end
 
     def cancel_exception(exception)
@@ -31,61 +32,46 @@ module Polyphony
       RuntimeError.new(exception)
     end
 
-    def cancel_after_wrap_block(canceller, &block)
-      block.call
-    ensure
-      canceller.stop
+    def cancel_after_with_block(interval, exception, &block)
+      if exception.is_a?(Class)
+        Thread.current.backend.timeout(interval, exception, &block)
+      else
+        Thread.current.backend.timeout(interval, RuntimeError, exception, &block)
+      end
     end
 
     def spin(tag = nil, &block)
-      Fiber.current.spin(tag, caller, &block)
+      Fiber.current.spin(tag, Polyphony.capture_caller, &block)
     end
 
     def spin_loop(tag = nil, rate: nil, &block)
       if rate
-        Fiber.current.spin(tag, caller) do
+        Fiber.current.spin(tag, Polyphony.capture_caller) do
           throttled_loop(rate, &block)
         end
       else
-        Fiber.current.spin(tag, caller) { loop(&block) }
+        Fiber.current.spin(tag, Polyphony.capture_caller) { loop(&block) }
       end
     end
 
-    def every(interval)
-      next_time = ::Process.clock_gettime(::Process::CLOCK_MONOTONIC) + interval
-      loop do
-        now = ::Process.clock_gettime(::Process::CLOCK_MONOTONIC)
-        Thread.current.backend.sleep(next_time - now)
-        yield
-        loop do
-          next_time += interval
-          break if next_time > now
-        end
-      end
+    def every(interval, &block)
+      Thread.current.backend.timer_loop(interval, &block)
     end
 
     def move_on_after(interval, with_value: nil, &block)
+      return move_on_after_with_block(interval, with_value, &block) if block
+
       fiber = ::Fiber.current
-      unless block
-        return spin do
-          sleep interval
-          fiber.schedule with_value
-        end
+      spin do
+        sleep interval
+        fiber.schedule with_value
       end
-
-      move_on_after_with_block(fiber, interval, with_value, &block)
     end
 
-    def move_on_after_with_block(fiber, interval, with_value, &block)
-      canceller = spin do
-        sleep interval
-        fiber.schedule Polyphony::MoveOn.new(with_value)
-      end
-      block.call
+    def move_on_after_with_block(interval, with_value, &block)
+      Thread.current.backend.timeout(interval, Polyphony::MoveOn, with_value, &block)
     rescue Polyphony::MoveOn => e
       e.value
-    ensure
-      canceller.stop
     end
 
     def receive
@@ -115,10 +101,15 @@ module Polyphony
 
     def throttled_loop(rate = nil, **opts, &block)
       throttler = Polyphony::Throttler.new(rate || opts)
-      if opts[:count]
-        opts[:count].times { |_i| throttler.(&block) }
-      else
-        loop { throttler.(&block) }
+      count = opts[:count]
+      return if count&.zero?
+
+      block.(throttler)
+      return if count == 1
+
+      Thread.current.backend.timer_loop(throttler.interval) do
+        block.(throttler)
+        break if count && (count -= 1) == 1
       end
     ensure
       throttler&.stop
@@ -3,14 +3,20 @@
 module Polyphony
   # Implements general-purpose throttling
   class Throttler
+    attr_reader :rate
+
     def initialize(rate)
       @rate = rate_from_argument(rate)
       @min_dt = 1.0 / @rate
-      @next_time = ::Process.clock_gettime(::Process::CLOCK_MONOTONIC)
+      @next_time = Polyphony.now
+    end
+
+    def interval
+      @min_dt
     end
 
     def call
-      now = ::Process.clock_gettime(::Process::CLOCK_MONOTONIC)
+      now = Polyphony.now
       delta = @next_time - now
       Thread.current.backend.sleep(delta) if delta > 0
       yield self
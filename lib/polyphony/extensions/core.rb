@@ -141,6 +141,8 @@ module ::Kernel
   end
 
   def pipe_to_eof(src, dest)
+    return IO.copy_stream(src, dest) if dest.is_a?(IO)
+
     src.read_loop { |data| dest << data }
   end
 
@@ -175,11 +177,16 @@ def signal_exception(block, command)
   end
 end
 
-# Override Timeout to use cancel scope
+# Override Timeout to use a backend timeout
 module ::Timeout
   def self.timeout(sec, klass = nil, message = nil, &block)
-    cancel_after(sec, &block)
+    return yield(sec) if sec.nil? || sec.zero?
+
+    cancel = Polyphony::Cancel.new
+    Thread.current.backend.timeout(sec, cancel, &block)
   rescue Polyphony::Cancel => e
+    raise unless e.equal?(cancel)
+
     error = klass ? klass.new(message) : ::Timeout::Error.new
     error.set_backtrace(e.backtrace)
     raise error
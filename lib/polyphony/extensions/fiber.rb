@@ -173,8 +173,9 @@ module Polyphony
       (@children ||= {}).keys
     end
 
-    def spin(tag = nil, orig_caller = Kernel.caller, &block)
-      f = Fiber.new { |v| f.run(v) }
+    def spin(tag = nil, orig_caller = Polyphony.capture_caller, &block)
+      pool = Thread.current.fiber_pool
+      f = pool ? pool.checkout : Fiber.new { |v| f.run(v) }
       f.prepare(tag, block, orig_caller, self)
       (@children ||= {})[f] = true
       f
@@ -214,7 +215,7 @@ module Polyphony
   # Fiber life cycle methods
   module FiberLifeCycle
     def prepare(tag, block, caller, parent)
-      @thread = Thread.current
+      self.thread = Thread.current
       @tag = tag
       @parent = parent
       @caller = caller
@@ -247,17 +248,28 @@ module Polyphony
     # fiber terminates after it has already been created. Calling #setup_raw
     # allows the fiber to be scheduled and to receive messages.
     def setup_raw
-      @thread = Thread.current
+      self.thread = Thread.current
     end
 
     def setup_main_fiber
       @main = true
       @tag = :main
-      @thread = Thread.current
+      self.thread = Thread.current
       @running = true
       @children&.clear
     end
 
+    # Resets the state of a terminated pooled fiber before it is reused
+    def pool_reset
+      @pool_idle_since = nil
+      @running = nil
+      @result = nil
+      @mailbox = nil
+      @when_done_procs = nil
+      @waiting_fibers = nil
+      @on_child_done = nil
+    end
+
     def restart_self(first_value)
       @mailbox = nil
       @when_done_procs = nil
@@ -272,7 +284,8 @@ module Polyphony
       @running = false
       inform_dependants(result, uncaught_exception)
     ensure
-      Thread.current.switch_fiber
+      # pooled fibers are parked by the pool (see FiberPool#await_checkout)
+      Thread.current.switch_fiber unless @pool
     end
 
     # Shuts down all children of the current fiber. If any exception occurs while
@@ -313,7 +326,7 @@ class ::Fiber
 
   extend Polyphony::FiberControlClassMethods
 
-  attr_accessor :tag, :thread, :parent
+  attr_accessor :tag, :parent, :pool, :pool_idle_since
   attr_reader :result, :mailbox
 
   def running?
@@ -329,8 +342,9 @@ class ::Fiber
     @caller ? @caller[0] : '(root)'
   end
 
+  # The spin caller may be captured lazily (see Polyphony.caller_capture=)
   def caller
-    spin_caller = @caller || []
+    spin_caller = @caller ? @caller.to_a : []
     if @parent
       spin_caller + @parent.caller
     else
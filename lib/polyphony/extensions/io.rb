@@ -23,20 +23,15 @@ class ::IO
 
     EMPTY_HASH = {}.freeze
 
-    # alias_method :orig_foreach, :foreach
-    # def foreach(_name, _sep = $/, _limit = nil, _getline_args = EMPTY_HASH,
-    #             &_block)
-    #   # IO.orig_read(name).each_line(&block)
-    #   raise NotImplementedError
-
-    #   # if sep.is_a?(Integer)
-    #   #   sep = $/
-    #   #   limit = sep
-    #   # end
-    #   # File.open(name, 'r') do |f|
-    #   #   f.each_line(sep, limit, getline_args, &block)
-    #   # end
-    # end
+    alias_method :orig_foreach, :foreach
+    def foreach(name, sep = $/, limit = nil, chomp: false, &block)
+      return enum_for(:foreach, name, sep, limit, chomp: chomp) unless block
+
+      File.open(name, 'r') do |f|
+        f.each_line(sep, limit, chomp: chomp, &block)
+      end
+      nil
+    end
 
     alias_method :orig_read, :read
     def read(name, length = nil, offset = nil, opt = EMPTY_HASH)
@@ -50,12 +45,12 @@ class ::IO
       end
     end
 
-    # alias_method :orig_readlines, :readlines
-    # def readlines(name, sep = $/, limit = nil, getline_args = EMPTY_HASH)
-    #   File.open(name, 'r') do |f|
-    #     f.readlines(sep, limit, getline_args)
-    #   end
-    # end
+    alias_method :orig_readlines, :readlines
+    def readlines(name, sep = $/, limit = nil, chomp: false)
+      File.open(name, 'r') do |f|
+        f.readlines(sep, limit, chomp: chomp)
+      end
+    end
 
     alias_method :orig_write, :write
     def write(name, string, offset = nil, opt = EMPTY_HASH)
@@ -65,6 +60,60 @@ class ::IO
       end
     end
 
+    SPLICE_CHUNK_SIZE = 1 << 16
+
+    alias_method :orig_copy_stream, :copy_stream
+    def copy_stream(src, dst, copy_length = nil, src_offset = nil)
+      backend = Thread.current.backend
+      unless src.is_a?(IO) && dst.is_a?(IO) && backend.respond_to?(:splice)
+        return orig_copy_stream(src, dst, copy_length, src_offset)
+      end
+
+      # data buffered by the source's reader precedes the data copied by the
+      # backend (an explicit src_offset reads the file regardless of position)
+      buffered = src_offset ? nil : src.__send__(:consume_buffered, copy_length)
+      if buffered
+        dst.write(buffered)
+        copy_length -= buffered.bytesize if copy_length
+      end
+      dst.flush
+      return buffered.bytesize if buffered && copy_length == 0
+
+      copied = copy_stream_unbuffered(backend, src, dst, copy_length, src_offset)
+      buffered ? buffered.bytesize + copied : copied
+    end
+
+    private def copy_stream_unbuffered(backend, src, dst, copy_length, src_offset)
+      if src.stat.file?
+        backend.sendfile(src, dst, src_offset, copy_length)
+      elsif src_offset
+        raise ArgumentError, 'cannot specify src_offset for non-seekable IO'
+      elsif src.stat.pipe? || dst.stat.pipe?
+        splice_stream(backend, src, dst, copy_length)
+      else
+        # splice requires one of the fds to be a pipe
+        IO.pipe do |r, w|
+          splice_stream(backend, src, dst, copy_length, r, w)
+        end
+      end
+    end
+
+    private def splice_stream(backend, src, dst, length, pipe_r = nil, pipe_w = nil)
+      total = 0
+      while !length || total < length
+        chunk = length ? [length - total, SPLICE_CHUNK_SIZE].min : SPLICE_CHUNK_SIZE
+        len = backend.splice(src, pipe_w || dst, chunk)
+        break if len == 0
+
+        if pipe_r
+          left = len
+          left -= backend.splice(pipe_r, dst, left) while left > 0
+        end
+        total += len
+      end
+      total
+    end
+
     alias_method :orig_popen, :popen
     def popen(cmd, mode = 'r')
       return orig_popen(cmd, mode) unless block_given?
@@ -76,10 +125,20 @@ end
 
 # IO instance method patches
 class ::IO
-  # def each(sep = $/, limit = nil, chomp: nil)
-  #   sep, limit = $/, sep if sep.is_a?(Integer)
-  # end
-  # alias_method :each_line, :each
+  alias_method :orig_each, :each
+  def each(sep = $/, limit = nil, chomp: false)
+    return enum_for(:each, sep, limit, chomp: chomp) unless block_given?
+
+    sep, limit = $/, sep if sep.is_a?(Integer)
+    reader = io_reader
+    while (line = reader.gets(sep, limit, chomp))
+      yield line
+    end
+    self
+  end
+
+  alias_method :orig_each_line, :each_line
+  alias_method :each_line, :each
 
   # def each_byte
   # end
@@ -92,77 +151,90 @@ class ::IO
 
   alias_method :orig_getbyte, :getbyte
   def getbyte
-    char = getc
-    char ? char.getbyte(0) : nil
+    io_reader.getbyte
   end
 
   alias_method :orig_getc, :getc
   def getc
-    return @read_buffer.slice!(0) if @read_buffer && !@read_buffer.empty?
-    
-    @read_buffer ||= +''
-    Thread.current.backend.read(self, @read_buffer, 8192, false)
-    return @read_buffer.slice!(0) if !@read_buffer.empty?
-
-    nil
+    io_reader.getc
   end
 
   alias_method :orig_read, :read
   def read(len = nil)
-    @read_buffer ||= +''
-    result = Thread.current.backend.read(self, @read_buffer, len, true)
-    return nil unless result
+    buffered = @io_reader&.consume(len)
+    return Thread.current.backend.read(self, +'', len, true) unless buffered
+    return buffered if len && buffered.bytesize == len
 
-    already_read = @read_buffer
-    @read_buffer = +''
-    already_read
+    rest = Thread.current.backend.read(self, +'', len && len - buffered.bytesize, true)
+    rest ? buffered << rest : buffered
   end
 
   alias_method :orig_readpartial, :read
   def readpartial(len, str = nil)
-    @read_buffer ||= +''
-    result = Thread.current.backend.read(self, @read_buffer, len, false)
-    raise EOFError unless result
+    data = @io_reader&.consume(len) || Thread.current.backend.read(self, nil, len, false)
+    raise EOFError unless data
 
-    if str
-      str << @read_buffer
-    else
-      str = @read_buffer
-    end
-    @read_buffer = +''
-    str
+    str ? str << data : data
   end
 
   alias_method :orig_write, :write
   def write(str, *args)
+    return @cork.write(str, *args) if @cork
+
     Thread.current.backend.write(self, str, *args)
   end
 
   alias_method :orig_write_chevron, :<<
   def <<(str)
-    Thread.current.backend.write(self, str)
+    @cork ? @cork.write(str) : Thread.current.backend.write(self, str)
     self
   end
 
-  alias_method :orig_gets, :gets
-  def gets(sep = $/, _limit = nil, _chomp: nil)
-    if sep.is_a?(Integer)
-      sep = $/
-      _limit = sep
+  # Coalesces subsequent writes into a buffer, which is written out once it
+  # reaches the given threshold (16KB by default), on #flush or #uncork, or
+  # once the writing fiber reaches a switchpoint. If a block is given, the IO
+  # is uncorked once the block returns.
+  def cork(threshold = nil)
+    @cork ||= Polyphony::Cork.new(self, threshold)
+    return self unless block_given?
+
+    begin
+      yield self
+    ensure
+      uncork
     end
-    sep_size = sep.bytesize
+  end
 
-    @read_buffer ||= +''
+  def uncork
+    return self unless @cork
 
-    loop do
-      idx = @read_buffer.index(sep)
-      return @read_buffer.slice!(0, idx + sep_size) if idx
+    @cork.flush
+    @cork = nil
+    self
+  end
 
-      data = readpartial(8192)
-      @read_buffer << data
-    rescue EOFError
-      return nil
-    end
+  def corked?
+    !!@cork
+  end
+
+  alias_method :orig_flush, :flush
+  def flush
+    @cork&.flush
+    orig_flush
+  end
+
+  alias_method :orig_close, :close
+  def close
+    uncork if @cork
+  ensure
+    Thread.current.backend.release_io(self) unless closed?
+    orig_close
+  end
+
+  alias_method :orig_gets, :gets
+  def gets(sep = $/, limit = nil, chomp: false)
+    sep, limit = $/, sep if sep.is_a?(Integer)
+    io_reader.gets(sep, limit, chomp)
   end
 
   # def print(*args)
@@ -206,11 +278,15 @@ class ::IO
   # def readchar
   # end
 
-  # def readline(sep = $/, limit = nil, chomp: nil)
-  # end
+  alias_method :orig_readline, :readline
+  def readline(sep = $/, limit = nil, chomp: false)
+    gets(sep, limit, chomp: chomp) || raise(EOFError, 'end of file reached')
+  end
 
-  # def readlines(sep = $/, limit = nil, chomp: nil)
-  # end
+  alias_method :orig_readlines, :readlines
+  def readlines(sep = $/, limit = nil, chomp: false)
+    each_line(sep, limit, chomp: chomp).to_a
+  end
 
   alias_method :orig_write_nonblock, :write_nonblock
   def write_nonblock(string, _options = {})
@@ -222,8 +298,10 @@ class ::IO
     buf ? readpartial(maxlen, buf) : readpartial(maxlen)
   end
 
-  def read_loop(&block)
-    Thread.current.backend.read_loop(self, &block)
+  def read_loop(buffer = nil, **opts, &block)
+    buffered = @io_reader&.consume
+    opts = opts.merge(initial: buffered) if buffered
+    Thread.current.backend.read_loop(self, buffer, **opts, &block)
   end
 
   # alias_method :orig_read, :read
@@ -239,6 +317,14 @@ class ::IO
   #   outbuf
   # end
 
+  private def io_reader
+    @io_reader ||= Polyphony::IOReader.new(self)
+  end
+
+  private def consume_buffered(len = nil)
+    @io_reader&.consume(len)
+  end
+
   def wait_readable(timeout = nil)
     if timeout
       move_on_after(timeout) do
@@ -11,37 +11,33 @@ class ::Socket
     Thread.current.backend.accept(self)
   end
 
-  NO_EXCEPTION = { exception: false }.freeze
-
   def connect(addr)
     addr = Addrinfo.new(addr) if addr.is_a?(String)
     Thread.current.backend.connect(self, addr.ip_address, addr.ip_port)
   end
 
   def recv(maxlen, flags = 0, outbuf = nil)
-    outbuf ||= +''
-    loop do
-      result = recv_nonblock(maxlen, flags, outbuf, **NO_EXCEPTION)
-      case result
-      when nil then raise IOError
-      when :wait_readable then Thread.current.backend.wait_io(self, false)
-      else
-        return result
-      end
-    end
+    Thread.current.backend.recv(self, maxlen, flags, outbuf)
   end
 
   def recvfrom(maxlen, flags = 0)
-    @read_buffer ||= +''
-    loop do
-      result = recvfrom_nonblock(maxlen, flags, @read_buffer, **NO_EXCEPTION)
-      case result
-      when nil then raise IOError
-      when :wait_readable then Thread.current.backend.wait_io(self, false)
-      else
-        return result
-      end
-    end
+    data, addrinfo, = Thread.current.backend.recvmsg(self, maxlen, flags)
+    data && [data, addrinfo]
+  end
+
+  DEFAULT_RECVMSG_LEN = 65_536
+
+  def recvmsg(maxlen = nil, flags = 0)
+    Thread.current.backend.recvmsg(self, maxlen || DEFAULT_RECVMSG_LEN, flags)
+  end
+
+  def send(mesg, flags = 0, dest = nil)
+    backend = Thread.current.backend
+    dest ? backend.sendmsg(self, mesg, flags, dest) : backend.send(self, mesg, flags)
+  end
+
+  def sendmsg(mesg, flags = 0, dest = nil)
+    Thread.current.backend.sendmsg(self, mesg, flags, dest)
   end
 
   ZERO_LINGER = [0, 0].pack('ii').freeze
@@ -89,9 +85,9 @@ class ::TCPSocket
     @io.connect(addr)
   end
 
-  alias_method :orig_close, :close
   def close
-    @io ? @io.close : orig_close
+    uncork if @cork
+    @io ? @io.close : super
   end
 
   alias_method :orig_setsockopt, :setsockopt
@@ -134,7 +130,7 @@ class ::TCPServer
   def initialize(hostname = nil, port = 0)
     @io = Socket.new Socket::AF_INET, Socket::SOCK_STREAM
     @io.bind(Addrinfo.tcp(hostname, port))
-    @io.listen(0)
+    @io.listen(Socket::SOMAXCONN)
   end
 
   alias_method :orig_accept, :accept
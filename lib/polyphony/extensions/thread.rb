@@ -5,6 +5,7 @@ require_relative '../core/exceptions'
 # Thread extensions
 class ::Thread
   attr_reader :main_fiber, :result
+  attr_accessor :fiber_pool
 
   alias_method :orig_initialize, :initialize
   def initialize(*args, &block)
@@ -18,7 +19,7 @@ class ::Thread
   def execute
     # backend must be created in the context of the new thread, therefore it
     # cannot be created in Thread#initialize
-    @backend = Polyphony::Backend.new
+    self.backend = Polyphony::Backend.new
     setup
     @ready = true
     result = @block.(*@args)
@@ -31,8 +32,6 @@ class ::Thread
     finalize(result)
   end
 
-  attr_accessor :backend
-
   def setup
     @main_fiber = Fiber.current
     @main_fiber.setup_main_fiber
@@ -49,7 +48,7 @@ class ::Thread
       @result = result
       signal_waiters(result)
     end
-    @backend.finalize
+    backend.finalize
   end
 
   def signal_waiters(result)
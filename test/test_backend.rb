@@ -1,6 +1,7 @@
 # frozen_string_literal: true
 
 require_relative 'helper'
+require 'polyphony/adapters/trace'
 
 class BackendTest < MiniTest::Test
   def setup
@@ -71,6 +72,86 @@ class BackendTest < MiniTest::Test
     assert_equal return_value, buf
   end
 
+  def test_writev
+    i, o = IO.pipe
+    reader = spin { i.read }
+
+    # more strings than IOV_MAX, with partial writes on the full pipe
+    strs = (1..3000).map { |n| "#{n}," }
+    assert_equal strs.join.bytesize, @backend.write(o, *strs)
+
+    # an array of strings, including empty ones
+    assert_equal 6, @backend.write(o, ['foo', '', 'bar'])
+    assert_equal 0, @backend.write(o, [])
+    o.close
+    assert_equal strs.join + 'foobar', reader.await
+    assert_raises(ArgumentError) { @backend.write(o) }
+  end
+
+  def test_fd_mode_unchanged
+    skip unless Polyphony::Backend::KIND == :io_uring
+
+    i, o = IO.pipe
+    i.nonblock = false
+    o.nonblock = true
+    @backend.write(o, 'foo')
+    assert_equal true, o.nonblock?
+    assert_equal false, i.nonblock?
+    assert_equal 'foo', @backend.read(i, +'', 3, false)
+    assert_equal false, i.nonblock?
+  ensure
+    i&.close
+    o&.close
+  end
+
+  def test_wait_io_after_close
+    a, b = UNIXSocket.pair
+    reader = spin { @backend.read(b, +'', 3, false) }
+    snooze
+    @backend.write(a, 'foo')
+    assert_equal 'foo', reader.await
+    a.close
+    b.close
+
+    # on the main thread, the new backend shares the event loop with @backend,
+    # and the new sockets reuse the closed fds
+    backend = Polyphony::Backend.new
+    Thread.current.backend = backend
+    a, b = UNIXSocket.pair
+    backend.wait_io(b, true)
+    backend.sleep(0)
+    b.close
+    backend.sleep(0)
+  ensure
+    a&.close
+    b&.close
+    backend&.finalize
+  end
+
+  def test_wait_io_after_unreleased_close
+    a, b = UNIXSocket.pair
+    reader = spin { @backend.read(b, +'', 3, false) }
+    snooze
+    @backend.write(a, 'foo')
+    assert_equal 'foo', reader.await
+
+    # the watchers stay active after the wait, and are not released when the
+    # fd is closed bypassing IO#close
+    fd = b.fileno
+    b.__send__(:orig_close)
+    c, d = UNIXSocket.pair
+    assert_includes [c.fileno, d.fileno], fd
+
+    reader = spin { @backend.read(d, +'', 3, false) }
+    snooze
+    @backend.write(c, 'bar')
+    assert_equal 'bar', reader.await
+    d.close
+    @backend.sleep(0)
+  ensure
+    [a, c, d].each { |io| io&.close }
+  end
+
   def test_waitpid
     pid = fork do
       @backend.post_fork
@@ -81,27 +162,362 @@ class BackendTest < MiniTest::Test
     assert_equal [pid, 42], result
   end
 
+  def test_read_from_reused_fd
+    # prevent fds from being freed by GC in the meantime
+    GC.disable
+    i, o = IO.pipe
+    spin { o << 'foo' }
+    assert_equal 'foo', @backend.read(i, +'', 3, false)
+    fd = i.fileno
+    i.close
+    o.close
+
+    # the new pipe reuses the lowest available fd numbers
+    i, o = IO.pipe
+    assert_equal fd, i.fileno
+    spin { snooze; o << 'bar' }
+    assert_equal 'bar', @backend.read(i, +'', 3, false)
+  ensure
+    GC.enable
+    i&.close
+    o&.close
+  end
+
+  def test_read_buffer_pos
+    i, o = IO.pipe
+    buf = +'abc'
+    o << 'foo'
+    assert_equal 'abcfoo', @backend.read(i, buf, 3, false, -1)
+    o << 'bar'
+    assert_equal 'abbar', @backend.read(i, buf, 3, false, 2)
+    o << 'baz'
+    assert_equal 'baz', @backend.read(i, buf, 3, false, 0)
+    assert_raises(ArgumentError) { @backend.read(i, buf, 3, false, 4) }
+
+    o.close
+    assert_nil @backend.read(i, buf, 3, false, -1)
+    assert_equal 'baz', buf
+  ensure
+    i&.close
+    o&.close
+  end
+
   def test_read_loop
     i, o = IO.pipe
 
     buf = []
-    spin do
+    f = spin do
       buf << :ready
       @backend.read_loop(i) { |d| buf << d }
       buf << :done
     end
 
-    # writing always causes snoozing
     o << 'foo'
+    # writing does not snooze (unless the fiber has used up its budget)
+    snooze
     o << 'bar'
     o.close
 
-    # read_loop will snooze after every read
-    6.times { snooze }
+    f.await
 
     assert_equal [:ready, 'foo', 'bar', :done], buf
   end
 
+  def test_kind
+    assert_includes [:libev, :io_uring], Polyphony::Backend::KIND
+  end
+
+  def test_concurrent_reads
+    pipes = 4.times.map { IO.pipe }
+    results = []
+    readers = pipes.map do |i, _o|
+      spin { results << @backend.read(i, +'', 8192, false) }
+    end
+    snooze
+
+    pipes.each_with_index { |(_i, o), idx| o << "msg#{idx}" }
+    readers.each(&:await)
+
+    assert_equal %w[msg0 msg1 msg2 msg3], results.sort
+  ensure
+    pipes&.each { |i, o| i.close; o.close }
+  end
+
+  def test_io_op_budget
+    i, o = IO.pipe
+    counter = 0
+    counter_fiber = spin { loop { counter += 1; snooze } }
+    snooze
+    counter = 0
+
+    1000.times { o << 'x' }
+    assert_equal 1000, i.readpartial(1000).bytesize
+
+    # other fibers get to run, but not after every single operation
+    assert counter > 0
+    assert counter < 100 if Polyphony::Backend::KIND == :libev
+  ensure
+    counter_fiber&.stop
+    snooze
+    i&.close
+    o&.close
+  end
+
+  def test_io_op_budget_without_runnable_fibers
+    i, o = IO.pipe
+    switchpoints = 0
+    t = Polyphony::Trace.new(:fiber_all) do |r|
+      switchpoints += 1 if r[:event] == :fiber_switchpoint
+    end
+    Polyphony.trace(true)
+    t.enable
+
+    1000.times { o << 'x' }
+    t.disable
+    assert_equal 1000, i.readpartial(1000).bytesize
+
+    # a fiber that has used up its budget keeps running if nothing else can
+    assert_equal 0, switchpoints if Polyphony::Backend::KIND == :libev
+  ensure
+    t&.disable
+    Polyphony.trace(nil)
+    i&.close
+    o&.close
+  end
+
+  def test_splice
+    i1, o1 = IO.pipe
+    i2, o2 = IO.pipe
+
+    spin { o1 << 'foobar'; o1.close }
+    assert_equal 3, @backend.splice(i1, o2, 3)
+    assert_equal 3, @backend.splice_to_eof(i1, o2, 1000)
+    o2.close
+    assert_equal 'foobar', i2.read
+  ensure
+    [i1, o1, i2, o2].each { |io| io&.close }
+  end
+
+  def test_tee
+    i1, o1 = IO.pipe
+    i2, o2 = IO.pipe
+
+    spin { o1 << 'foobar' }
+    assert_equal 6, @backend.tee(i1, o2, 1000)
+    o1.close
+    o2.close
+    assert_equal 'foobar', i1.read
+    assert_equal 'foobar', i2.read
+  ensure
+    [i1, o1, i2, o2].each { |io| io&.close }
+  end
+
+  def test_sendfile
+    i, o = IO.pipe
+    File.open(__FILE__, 'rb') do |f|
+      assert_equal 12, @backend.sendfile(f, o, 2, 12)
+      assert_equal 5, @backend.sendfile(f, o, nil, 5)
+    end
+    o.close
+    assert_equal 'frozen_strin# fro', i.read
+  ensure
+    i&.close
+    o&.close
+  end
+
+  def test_timeout
+    buffer = []
+    assert_raises(Polyphony::Cancel) do
+      @backend.timeout(0.01, Polyphony::Cancel) do
+        assert_equal [], Fiber.current.children
+        buffer << 1
+        @backend.sleep 1
+        buffer << 2
+      end
+    end
+    assert_equal [1], buffer
+
+    e = assert_raises(RuntimeError) { @backend.timeout(0.01, RuntimeError, 'foo') { @backend.sleep 1 } }
+    assert_equal 'foo', e.message
+
+    assert_equal :bar, @backend.timeout(0.01, Polyphony::Cancel) { :bar }
+    # a timeout cancelled on completion should not interrupt the fiber later on
+    @backend.timeout(0.01, Polyphony::Cancel) { @backend.sleep 0.005 }
+    @backend.sleep 0.02
+  end
+
+  def test_timer_loop
+    buffer = []
+    t0 = Time.now
+    f = spin do
+      @backend.timer_loop(0.01) { buffer << 1 }
+    end
+    @backend.sleep 0.1
+    f.stop
+    f.await
+    elapsed = Time.now - t0
+    expected = (elapsed / 0.01).to_i
+    assert buffer.size >= expected - 2 && buffer.size <= expected + 2
+
+    # missed ticks are coalesced
+    buffer = []
+    f = spin do
+      @backend.timer_loop(0.01) { buffer << 1; @backend.sleep 0.035 }
+    end
+    @backend.sleep 0.1
+    f.stop
+    f.await
+    assert (2..3).include?(buffer.size)
+
+    assert_raises(ArgumentError) { @backend.timer_loop(0) {} }
+  end
+
+  def test_now
+    t = @backend.now
+    assert_in_delta Process.clock_gettime(Process::CLOCK_MONOTONIC), t, 0.1
+    assert_equal t, Polyphony.now
+
+    @backend.sleep 0.01
+    assert Polyphony.now > t
+  end
+
+  def test_recv_send_batch
+    server = Socket.new(:INET, :DGRAM)
+    server.bind(Addrinfo.udp('127.0.0.1', 0))
+    client = Socket.new(:INET, :DGRAM)
+    client.connect(server.local_address)
+
+    reader = spin { @backend.recv_batch(server, 8, 16) }
+    snooze
+    assert_equal 3, @backend.send_batch(client, %w[foo bar bazbazbazbazbazbaz])
+    assert_equal %w[foo bar bazbazbazbazbazb], reader.await
+
+    @backend.send_batch(client, %w[a b c])
+    assert_equal %w[a b], @backend.recv_batch(server, 2, 16)
+    assert_equal %w[c], @backend.recv_batch(server, 2, 16)
+
+    assert_raises(ArgumentError) { @backend.recv_batch(server, 0, 16) }
+  ensure
+    server&.close
+    client&.close
+  end
+
+  def test_read_loop_with_buffer
+    i, o = IO.pipe
+    buffer = +''
+
+    chunks = []
+    f = spin do
+      @backend.read_loop(i, buffer) do |d|
+        chunks << [d.equal?(buffer), d.dup]
+      end
+    end
+
+    o << 'foo'
+    snooze
+    o << 'barbaz'
+    o.close
+    f.await
+
+    assert_equal [[true, 'foo'], [true, 'barbaz']], chunks
+    assert_equal 'barbaz', buffer
+  end
+
+  def test_read_loop_chunk_size
+    i, o = IO.pipe
+    data = '*' * 200_000
+
+    sizes = []
+    f = spin { @backend.read_loop(i) { |d| sizes << d.bytesize } }
+    o << data
+    o.close
+    f.await
+
+    assert_equal data.bytesize, sizes.sum
+    # chunk size grows when reads fill the buffer
+    assert sizes.max > 8192
+  end
+
+  def test_read_loop_length_framing
+    i, o = IO.pipe
+
+    frames = []
+    f = spin { @backend.read_loop(i, length_header: 2) { |d| frames << d } }
+    o << "\x00\x03foo\x00\x00\x00"
+    snooze
+    o << "\x06bar"
+    snooze
+    assert_equal ['foo', ''], frames
+
+    o << "baz\x00\x01"
+    o.close
+    f.await
+    assert_equal ['foo', '', 'barbaz'], frames
+
+    i, o = IO.pipe
+    spin do
+      o << [3].pack('V') + 'foo' + [0x10000].pack('V') + '*' * 0x10000
+      o.close
+    end
+    frames = []
+    @backend.read_loop(i, length_header: 4, endian: :little) { |d| frames << d.bytesize }
+    assert_equal [3, 0x10000], frames
+  end
+
+  def test_read_loop_delimiter_framing
+    i, o = IO.pipe
+    buffer = +''
+
+    frames = []
+    f = spin do
+      @backend.read_loop(i, buffer, delimiter: "\r\n") do |d|
+        frames << [d.equal?(buffer), d.dup]
+      end
+    end
+    o << "foo\r\nbar\r"
+    snooze
+    o << "\n\r\nbaz"
+    o.close
+    f.await
+    assert_equal [[true, 'foo'], [true, 'bar'], [true, '']], frames
+  end
+
+  def test_read_loop_max_frame_length
+    i, o = IO.pipe
+    o << "\x00\x03foo\x00\x05"
+    frames = []
+    assert_raises(IOError) do
+      @backend.read_loop(i, length_header: 2, max_frame_length: 4) { |d| frames << d }
+    end
+    assert_equal ['foo'], frames
+    i.close
+    o.close
+
+    i, o = IO.pipe
+    o << "foo\nbarbaz"
+    frames = []
+    assert_raises(IOError) do
+      @backend.read_loop(i, delimiter: "\n", max_frame_length: 4) { |d| frames << d }
+    end
+    assert_equal ['foo'], frames
+
+    assert_raises(ArgumentError) { @backend.read_loop(i, delimiter: "\n", max_frame_length: 0) {} }
+  ensure
+    i&.close
+    o&.close
+  end
+
+  def test_read_loop_framing_args
+    i, o = IO.pipe
+    assert_raises(ArgumentError) { @backend.read_loop(i, length_header: 3) {} }
+    assert_raises(ArgumentError) { @backend.read_loop(i, length_header: 2, endian: :middle) {} }
+    assert_raises(ArgumentError) { @backend.read_loop(i, delimiter: '') {} }
+    assert_raises(ArgumentError) { @backend.read_loop(i, length_header: 2, delimiter: "\n") {} }
+  ensure
+    i&.close
+    o&.close
+  end
+
   def test_accept_loop
     server = TCPServer.new('127.0.0.1', 1234)
 
@@ -127,4 +543,31 @@ class BackendTest < MiniTest::Test
     snooze
     server&.close
   end
+
+  def test_accept_loop_batch
+    server = Socket.new(:INET, :STREAM)
+    server.bind(Addrinfo.tcp('127.0.0.1', 1235))
+    server.listen(16)
+    clients = (1..5).map { TCPSocket.new('127.0.0.1', 1235) }
+
+    accepted = []
+    server_fiber = spin do
+      @backend.accept_loop(server, 2) { |c| accepted << c }
+    end
+
+    snooze
+    # with libev, pending connections are accepted in batches
+    assert_equal 2, accepted.size if Polyphony::Backend::KIND == :libev
+    10.times { snooze }
+    assert_equal 5, accepted.size
+    assert accepted.all?(&:close_on_exec?)
+
+    assert_raises(ArgumentError) { @backend.accept_loop(server, 0) {} } if Polyphony::Backend::KIND == :libev
+  ensure
+    (clients || []).each(&:close)
+    (accepted || []).each(&:close)
+    server_fiber&.stop
+    snooze
+    server&.close
+  end
 end
@@ -57,4 +57,73 @@ class EventTest < MiniTest::Test
       f.await
     end
   end
+
+  def test_multiple_waiters
+    e = Polyphony::Event.new
+    fibers = (1..3).map { |i| spin { [i, e.await] } }
+    snooze
+    assert_equal 3, e.waiting_count
+
+    e.signal(:foo)
+    snooze
+    assert_equal 2, e.waiting_count
+
+    e.broadcast(:bar)
+    assert_equal [[1, :foo], [2, :bar], [3, :bar]], Fiber.await(*fibers)
+    assert_equal 0, e.waiting_count
+
+    # signals are not kept by default
+    e.signal(:baz)
+    assert !e.signalled?
+  end
+
+  def test_auto_reset
+    e = Polyphony::Event.new(:auto)
+    e.signal(:foo)
+    assert e.signalled?
+    assert_equal :foo, e.await
+    assert !e.signalled?
+
+    f = spin { e.await }
+    snooze
+    e.signal(:bar)
+    assert_equal :bar, f.await
+    assert !e.signalled?
+  end
+
+  def test_manual_reset
+    e = Polyphony::Event.new(:manual)
+    fibers = (1..3).map { spin { e.await } }
+    snooze
+
+    e.signal(:foo)
+    assert_equal [:foo] * 3, Fiber.await(*fibers)
+    assert e.signalled?
+    assert_equal :foo, e.await
+
+    e.reset
+    assert !e.signalled?
+    f = spin { e.await }
+    snooze
+    assert_equal 1, e.waiting_count
+    e.broadcast(:bar)
+    assert_equal :bar, f.await
+  end
+
+  def test_invalid_mode
+    assert_raises(ArgumentError) { Polyphony::Event.new(:foo) }
+  end
+end
+
+class FiberPoolEventTest < EventTest
+  def setup
+    super
+    Thread.current.fiber_pool = Polyphony::FiberPool.new(max_size: 4)
+  end
+
+  def teardown
+    super
+  ensure
+    Thread.current.fiber_pool = nil
+  end
 end
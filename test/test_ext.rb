@@ -193,4 +193,24 @@ class TimeoutTest < MiniTest::Test
     assert_kind_of MyTimeout, e
     assert_equal 'foo', e.message
   end
+
+  def test_that_timeout_is_not_rescued_as_standard_error
+    assert_raises(Timeout::Error) do
+      Timeout.timeout(0.05) do
+        begin
+          sleep 0.2
+        rescue => e
+          :swallowed
+        end
+      end
+    end
+  end
+
+  def test_nested_timeouts
+    assert_raises(Timeout::Error) do
+      Timeout.timeout(0.05) do
+        Timeout.timeout(1) { sleep 0.2 }
+      end
+    end
+  end
 end
@@ -529,6 +529,56 @@ class FiberTest < MiniTest::Test
     assert f.location =~ location
   end
 
+  def test_lazy_caller_capture
+    Polyphony.caller_capture = :lazy
+    location = /^#{__FILE__}:#{__LINE__ + 1}:in `test_lazy_caller_capture'/
+    f = spin { sleep 0.01 }
+    g_location = /^#{__FILE__}:#{__LINE__ + 1}/
+    g = Fiber.current.spin { sleep 0.01 }
+    snooze
+
+    assert_kind_of Polyphony::Caller, f.instance_variable_get(:@caller)
+    assert_match location, f.location
+    assert_match location, f.caller[0]
+    assert_match g_location, g.location
+
+    # only C frames, which Kernel#caller also reports, are left out
+    h, expected = lazy_caller_spin_outer
+    assert_equal expected[0..1], h.caller[0..1]
+    assert_equal caller(0).last[/^.+:\d+:/], f.caller.last[/^.+:\d+:/]
+    assert f.caller.size <= caller(0).size
+    assert f.caller.none? { |l| l =~ /:0:in/ }
+  ensure
+    Polyphony.caller_capture = :full
+    f&.stop
+    g&.stop
+    h&.stop
+  end
+
+  def lazy_caller_spin_outer
+    lazy_caller_spin_inner
+  end
+
+  def lazy_caller_spin_inner
+    expected = caller(0)
+    expected[0] = expected[0].sub(/:\d+:/, ":#{__LINE__ + 1}:")
+    [spin { sleep 0.01 }, expected]
+  end
+
+  def test_caller_capture_off
+    Polyphony.caller_capture = :off
+    f = spin { sleep 0.01 }
+    snooze
+
+    assert_nil f.instance_variable_get(:@caller)
+    assert_equal [], f.caller[0...1]
+    assert_raises(ArgumentError) { Polyphony.caller_capture = :foo }
+    assert_equal :off, Polyphony.caller_capture
+  ensure
+    Polyphony.caller_capture = :full
+    f&.stop
+  end
+
   def test_when_done
     flag = nil
     values = []
@@ -1003,3 +1053,67 @@ class RestartTest < MiniTest::Test
     assert_equal [f, 'foo', 'bar', :done, f2, 'baz', 42, :done], buffer
   end
 end
+
+class FiberPoolTest < MiniTest::Test
+  def setup
+    super
+    @pool = Polyphony::FiberPool.new(max_size: 2, idle_timeout: 60)
+    Thread.current.fiber_pool = @pool
+  end
+
+  def teardown
+    Thread.current.fiber_pool = nil
+    super
+  end
+
+  def test_fiber_reuse
+    f1 = spin { :foo }
+    assert_equal :foo, f1.await
+    assert_equal 1, @pool.size
+
+    f2 = spin { :bar }
+    assert_equal f1, f2
+    assert_equal 0, @pool.size
+    assert_equal :bar, f2.await
+
+    f3 = spin { raise 'baz' }
+    assert_raises(RuntimeError) { f3.await }
+    assert_equal 1, @pool.size
+
+    buf = []
+    f4 = spin { buf << receive }
+    assert_equal f1, f4
+    f4 << :qux
+    f4.await
+    assert_equal [:qux], buf
+  end
+
+  def test_max_size
+    fibers = (1..4).map { |i| spin { snooze; i } }
+    assert_equal [1, 2, 3, 4], Fiber.await(*fibers)
+    assert_equal 2, @pool.size
+  end
+
+  def test_spin_suspend
+    buf = []
+    spin { sleep 0.01; buf << :done }
+    suspend
+    assert_equal [:done], buf
+    assert_equal 1, @pool.size
+
+    spin { buf << :again }
+    suspend
+    assert_equal [:done, :again], buf
+  end
+
+  def test_idle_trimming
+    pool = Polyphony::FiberPool.new(max_size: 10, idle_timeout: 0.02)
+    Thread.current.fiber_pool = pool
+    Fiber.await(*(1..3).map { spin { } })
+    assert_equal 3, pool.size
+
+    sleep 0.05
+    pool.trim
+    assert_equal 0, pool.size
+  end
+end
@@ -110,6 +110,14 @@ class MoveOnAfterTest < MiniTest::Test
     assert_nil v
   end
 
+  def test_move_on_after_does_not_spin_fiber
+    v = move_on_after(0.01, with_value: :bar) do
+      assert_equal [], Fiber.current.children
+      sleep 1
+    end
+    assert_equal :bar, v
+  end
+
   def test_move_on_after_with_value
     t0 = Time.now
     v = move_on_after(0.01, with_value: :bar) do
@@ -349,4 +357,65 @@ class GlobalAPIEtcTest < MiniTest::Test
 
     assert_equal [0, 1, 2], values
   end
-end
\ No newline at end of file
+end
+
+class SelectTest < MiniTest::Test
+  def test_select_queues
+    q1 = Polyphony::Queue.new
+    q2 = Polyphony::Queue.new
+
+    q2 << :foo
+    assert_equal [q2, :foo], Polyphony.select(queues: [q1, q2])
+
+    spin { q1 << :bar }
+    assert_equal [q1, :bar], Polyphony.select(queues: [q1, q2])
+    assert !q1.pending?
+    assert !q2.pending?
+  end
+
+  def test_select_ios
+    q = Polyphony::Queue.new
+    i, o = IO.pipe
+
+    spin { o << 'foo' }
+    assert_equal [i, nil], Polyphony.select(queues: [q], ios: [i])
+    assert_equal 'foo', i.readpartial(3)
+    assert !q.pending?
+  end
+
+  def test_select_timeout
+    q = Polyphony::Queue.new
+    i, _o = IO.pipe
+
+    t0 = Time.now
+    assert_nil Polyphony.select(queues: [q], ios: [i], timeout: 0.05)
+    assert_in_delta 0.05, Time.now - t0, 0.02
+    assert !q.pending?
+  end
+
+  def test_select_passes_on_wakeups
+    q1 = Polyphony::Queue.new
+    q2 = Polyphony::Queue.new
+    f = spin { Polyphony.select(queues: [q1, q2]) }
+    g = spin { q2.shift }
+    snooze
+
+    # both pushes happen before the selecting fiber runs, so the value pushed
+    # to q2 should be passed on to the other waiting fiber
+    q1 << :foo
+    q2 << :bar
+    assert_equal [q1, :foo], f.await
+    assert_equal :bar, g.await
+  end
+
+  def test_select_interrupted
+    q = Polyphony::Queue.new
+    f = spin { Polyphony.select(queues: [q]) }
+    snooze
+    assert q.pending?
+
+    f.stop
+    f.await
+    assert !q.pending?
+  end
+end
@@ -134,6 +134,200 @@ class IOTest < MiniTest::Test
     assert_equal [102, 103], buf
   end
 
+  def test_gets
+    i, o = IO.pipe
+
+    buf = []
+    f = spin do
+      while (l = i.gets)
+        buf << l
+      end
+    end
+
+    snooze
+    assert_equal [], buf
+
+    o << "fab\nc"
+    sleep 0.01
+    assert_equal ["fab\n"], buf
+
+    o << "ulous\ndef"
+    o.close
+    f.await
+    assert_equal ["fab\n", "culous\n", 'def'], buf
+  end
+
+  def test_gets_with_args
+    i, o = IO.pipe
+    o << "foo\r\nbar--baz--qux\n\n\n\nquux\nabcdef"
+    o.close
+
+    assert_equal 'foo', i.gets(chomp: true)
+    assert_equal 'bar--', i.gets('--')
+    assert_equal 'baz', i.gets('--', chomp: true)
+    assert_equal "qux\n\n", i.gets('')
+    assert_equal 'quu', i.gets(3)
+    assert_equal "x\n", i.gets(nil, 2)
+    assert_equal 'abcdef', i.gets(nil)
+    assert_nil i.gets
+  end
+
+  def test_gets_paragraph_mode
+    i, o = IO.pipe
+    f = spin { 3.times.map { i.gets('') } }
+
+    o << "\n\nfoo\nbar\n\n"
+    snooze
+    o << "\n\nbaz\n"
+    o.close
+    assert_equal ["foo\nbar\n\n", "baz\n", nil], f.await
+  end
+
+  def test_gets_with_straddling_separator
+    i, o = IO.pipe
+
+    f = spin { i.gets('---') }
+    snooze
+    o << 'abc--'
+    snooze
+    o << '-def'
+    assert_equal 'abc---', f.await
+
+    o.close
+    assert_equal 'def', i.read
+  end
+
+  def test_readline
+    i, o = IO.pipe
+    o << "foo\nbar"
+    o.close
+
+    assert_equal "foo\n", i.readline
+    assert_equal 'bar', i.readline(chomp: true)
+    assert_raises(EOFError) { i.readline }
+  end
+
+  def test_each_line
+    i, o = IO.pipe
+    spin do
+      o << "foo\nbar\n"
+      snooze
+      o << "baz\n"
+      o.close
+    end
+
+    lines = []
+    assert_equal i, i.each_line(chomp: true) { |l| lines << l }
+    assert_equal %w[foo bar baz], lines
+  end
+
+  def test_readlines
+    i, o = IO.pipe
+    o << "foo\nbar\nbaz"
+    o.close
+
+    assert_equal ["foo\n", "bar\n", 'baz'], i.readlines
+  end
+
+  def test_getc_multibyte
+    i, o = IO.pipe
+    i.set_encoding('UTF-8')
+
+    f = spin { [i.getc, i.getc] }
+    snooze
+    o << "\xD7".b
+    snooze
+    o << "\x90b".b
+    o.close
+    assert_equal ['א', 'b'], f.await
+    assert_equal Encoding::UTF_8, f.result[0].encoding
+  end
+
+  def test_buffered_data_and_read
+    i, o = IO.pipe
+    o << "foo\nbarbaz"
+
+    assert_equal "foo\n", i.gets
+    assert_equal 'bar', i.readpartial(3)
+    o << 'qux'
+    o.close
+    assert_equal 'bazqux', i.read
+  end
+
+  def test_cork
+    i, o = IO.pipe
+
+    assert_equal o, o.cork
+    assert o.corked?
+    o << 'foo'
+    assert_equal 6, o.write('bar', 'baz')
+    assert_equal :wait_readable, i.orig_read_nonblock(100, exception: false)
+
+    # buffered data is flushed at the next switchpoint
+    assert_equal 'foobarbaz', i.readpartial(100)
+
+    o.uncork
+    assert !o.corked?
+    o << 'qux'
+    assert_equal 'qux', i.orig_read_nonblock(100, exception: false)
+  end
+
+  def test_cork_threshold
+    i, o = IO.pipe
+
+    o.cork(4)
+    o << 'ab'
+    assert_equal :wait_readable, i.orig_read_nonblock(100, exception: false)
+    o << 'cde'
+    assert_equal 'abcde', i.orig_read_nonblock(100, exception: false)
+    o << 'f'
+    o.flush
+    assert_equal 'f', i.orig_read_nonblock(100, exception: false)
+  end
+
+  def test_cork_with_block
+    i, o = IO.pipe
+
+    o.cork do
+      o << 'foo'
+      o << 'bar'
+      assert_equal :wait_readable, i.orig_read_nonblock(100, exception: false)
+    end
+    assert !o.corked?
+    assert_equal 'foobar', i.orig_read_nonblock(100, exception: false)
+  end
+
+  def test_cork_large_write
+    i, o = IO.pipe
+    data = '*' * 200_000
+    # corking leaves the fd mode untouched
+    o.nonblock = false
+
+    o.cork(1 << 20)
+    assert !o.nonblock?
+    o << data
+    reader = spin { i.read }
+    # buffered data for non-socket fds is flushed by the thread's cork flusher
+    snooze
+    o.close
+    assert_equal data, reader.await
+  end
+
+  def test_cork_large_socket_write
+    i, o = UNIXSocket.pair
+    data = '*' * 1_000_000
+
+    o.cork(1 << 21)
+    o << data
+    reader = spin { i.read }
+    # the socket buffer fills up, so the flush is finished by the thread's cork
+    # flusher, which is not a child of the main fiber
+    snooze
+    assert_equal [reader], Fiber.current.children
+    o.close
+    assert_equal data, reader.await
+  end
+
   # see https://github.com/digital-fabric/polyphony/issues/30
   def test_reopened_tempfile
     file = Tempfile.new
@@ -178,11 +372,13 @@ class IOClassMethodsTest < MiniTest::Test
   end
 
   def test_foreach
-    skip "IO.foreach is not yet implemented"
     lines = []
     IO.foreach(__FILE__) { |l| lines << l }
     assert_equal "# frozen_string_literal: true\n", lines[0]
     assert_equal "end\n", lines[-1]
+
+    lines = IO.foreach(__FILE__, chomp: true).first(2)
+    assert_equal ['# frozen_string_literal: true', ''], lines
   end
 
   def test_read_class_method
@@ -218,6 +414,79 @@ class IOClassMethodsTest < MiniTest::Test
     assert_equal WRITE_DATA, s
   end
 
+  def test_copy_stream
+    src = IO.binread(__FILE__)
+
+    # file to pipe (sendfile)
+    i, o = IO.pipe
+    reader = spin { i.read }
+    File.open(__FILE__, 'rb') { |f| assert_equal src.bytesize, IO.copy_stream(f, o) }
+    o.close
+    assert_equal src, reader.await.b
+
+    # file with length and offset
+    i, o = IO.pipe
+    File.open(__FILE__, 'rb') { |f| assert_equal 10, IO.copy_stream(f, o, 10, 2) }
+    o.close
+    assert_equal src[2, 10], i.read
+
+    # socket to socket (splice through a pipe)
+    s1, s2 = UNIXSocket.pair
+    d1, d2 = UNIXSocket.pair
+    spin { s1 << 'foobar'; s1.close }
+    assert_equal 6, IO.copy_stream(s2, d1)
+    d1.close
+    assert_equal 'foobar', d2.read
+  ensure
+    [i, o, s1, s2, d1, d2].each { |io| io&.close }
+  end
+
+  def test_read_loop_after_gets
+    i, o = IO.pipe
+    o << "line\nbody"
+    o.close
+    assert_equal "line\n", i.gets
+
+    buf = []
+    i.read_loop { |d| buf << d }
+    assert_equal ['body'], buf
+
+    i, o = IO.pipe
+    o << "header\n\x00\x03foo\x00\x03bar"
+    o.close
+    assert_equal "header\n", i.gets
+
+    frames = []
+    i.read_loop(length_header: 2) { |d| frames << d }
+    assert_equal ['foo', 'bar'], frames
+  ensure
+    [i, o].each { |io| io&.close }
+  end
+
+  def test_copy_stream_after_gets
+    i, o = IO.pipe
+    o << "line\nbody"
+    o.close
+    assert_equal "line\n", i.gets
+
+    d1, d2 = UNIXSocket.pair
+    assert_equal 4, IO.copy_stream(i, d1)
+    d1.close
+    assert_equal 'body', d2.read
+
+    File.open(__FILE__, 'rb') do |f|
+      line = f.gets
+      rest = IO.binread(__FILE__)[line.bytesize..]
+      i, o = IO.pipe
+      reader = spin { i.read }
+      assert_equal rest.bytesize, IO.copy_stream(f, o)
+      o.close
+      assert_equal rest, reader.await.b
+    end
+  ensure
+    [i, o, d1, d2].each { |io| io&.close }
+  end
+
   def test_popen
     counter = 0
     timer = spin { throttled_loop(200) { counter += 1 } }
@@ -129,4 +129,89 @@ class QueueTest < MiniTest::Test
 
     assert_equal 0, @queue.size
   end
-end
\ No newline at end of file
+
+  def test_capacity
+    assert_nil @queue.capacity
+    assert_raises(ArgumentError) { Polyphony::Queue.new(0) }
+
+    queue = Polyphony::Queue.new(2)
+    assert_equal 2, queue.capacity
+    buf = []
+    f = spin {
+      (1..5).each { |i| queue << i; buf << i }
+    }
+    snooze
+    assert_equal [1, 2], buf
+    assert queue.full?
+
+    assert_equal 1, queue.shift
+    snooze
+    assert_equal [1, 2, 3], buf
+
+    assert_equal [2, 3], queue.shift_all
+    snooze
+    assert_equal [1, 2, 3, 4, 5], buf
+    f.await
+    assert_equal [4, 5], queue.shift_all
+  end
+
+  def test_capacity_multi_thread
+    queue = Polyphony::Queue.new(10)
+    producers = (1..4).map { |i|
+      Thread.new { 100.times { |j| queue << [i, j] } }
+    }
+    values = []
+    400.times {
+      values << queue.shift
+      assert queue.size <= 10
+    }
+    producers.each(&:join)
+    assert_equal 400, values.size
+    (1..4).each do |i|
+      assert_equal (0..99).to_a, values.select { |v| v[0] == i }.map(&:last)
+    end
+  end
+
+  def test_push_all
+    a = spin { @queue.shift }
+    b = spin { @queue.shift }
+    snooze
+
+    @queue.push_all([1, 2, 3])
+    assert_equal [1, 2], Fiber.await(a, b)
+    assert_equal [3], @queue.shift_all
+
+    queue = Polyphony::Queue.new(2)
+    f = spin { queue.push_all([1, 2, 3, 4]) }
+    snooze
+    assert_equal [1, 2], queue.shift_all
+    f.await
+    assert_equal [3, 4], queue.shift_all
+  end
+
+  def test_shift_n
+    f = spin { @queue.shift_n(3) }
+    snooze
+    @queue << 1
+    assert_equal [1], f.await
+
+    @queue.push_all([1, 2, 3, 4])
+    assert_equal [1, 2, 3], @queue.shift_n(3)
+    assert_equal [4], @queue.shift_n(3)
+    assert_raises(ArgumentError) { @queue.shift_n(0) }
+  end
+
+  def test_drain
+    @queue.push_all([1, 2, 3])
+    buf = []
+    @queue.drain { |v| buf << v; @queue << v * 10 if v < 3 }
+    assert_equal [1, 2, 3], buf
+    assert_equal [10, 20], @queue.shift_all
+
+    @queue.push_all([1, 2, 3])
+    buf = []
+    @queue.drain { |v| buf << v; break if v == 2 }
+    assert_equal [1, 2], buf
+    assert_equal [3], @queue.shift_all
+  end
+end
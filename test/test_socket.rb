@@ -31,6 +31,51 @@ class SocketTest < MiniTest::Test
     server_fiber&.await
     server&.close
   end
+
+  def test_recv_send
+    a, b = Socket.pair(:UNIX, :STREAM)
+
+    reader = spin { b.recv(100) }
+    snooze
+    assert_equal 5, a.send('hello', 0)
+    assert_equal 'hello', reader.await
+
+    a.send('world', 0)
+    assert_equal 'wor', b.recv(3, Socket::MSG_PEEK)
+    buf = +''
+    assert_equal 'world', b.recv(100, 0, buf)
+    assert_equal 'world', buf
+
+    assert_raises(IO::EAGAINWaitReadable) { b.recv(100, Socket::MSG_DONTWAIT) }
+
+    a.close
+    assert_nil b.recv(100)
+  ensure
+    a&.close
+    b&.close
+  end
+
+  def test_recvmsg_sendmsg
+    server = Socket.new(:INET, :DGRAM)
+    server.bind(Addrinfo.udp('127.0.0.1', 0))
+    client = Socket.new(:INET, :DGRAM)
+    client.bind(Addrinfo.udp('127.0.0.1', 0))
+
+    reader = spin { server.recvmsg(100) }
+    snooze
+    assert_equal 3, client.sendmsg('foo', 0, server.local_address)
+    data, addrinfo, _flags = reader.await
+    assert_equal 'foo', data
+    assert_equal client.local_address.ip_port, addrinfo.ip_port
+
+    server.send('bar', 0, addrinfo)
+    data, addrinfo = client.recvfrom(100)
+    assert_equal 'bar', data
+    assert_equal server.local_address.ip_port, addrinfo.ip_port
+  ensure
+    server&.close
+    client&.close
+  end
 end
 
 class HTTPClientTest < MiniTest::Test
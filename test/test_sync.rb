@@ -49,4 +49,171 @@ class MutexTest < MiniTest::Test
     Fiber.current.await_all_children
     assert_equal [:bar, :foo], buf
   end
-end
\ No newline at end of file
+
+  def test_mutex_lock_unlock
+    lock = Polyphony::Mutex.new
+    assert !lock.locked?
+
+    lock.lock
+    assert lock.locked?
+    assert lock.owned?
+    assert_raises(ThreadError) { lock.lock }
+    assert !lock.try_lock
+
+    f = spin { lock.owned? }
+    assert_equal false, f.await
+    f = spin { lock.unlock }
+    assert_raises(ThreadError) { f.await }
+
+    lock.unlock
+    assert !lock.locked?
+    assert lock.try_lock
+    lock.unlock
+  end
+
+  def test_mutex_reentrant_synchronize
+    lock = Polyphony::Mutex.new
+    result = lock.synchronize { lock.synchronize { :foo } }
+    assert_equal :foo, result
+    assert !lock.locked?
+  end
+
+  def test_mutex_interrupted_waiter
+    buf = []
+    lock = Polyphony::Mutex.new
+    lock.lock
+    f1 = spin { lock.synchronize { buf << 1 } }
+    f2 = spin { lock.synchronize { buf << 2 } }
+    snooze
+
+    lock.unlock
+    f1.stop
+    f2.await
+    assert_equal [2], buf
+    assert !lock.locked?
+  end
+
+  def test_condition_variable_broadcast
+    buf = []
+    lock = Polyphony::Mutex.new
+    cond = Polyphony::ConditionVariable.new
+    fibers = (1..3).map do |i|
+      spin do
+        lock.synchronize do
+          cond.wait(lock)
+          buf << i
+        end
+      end
+    end
+    snooze
+    assert_equal [], buf
+
+    lock.synchronize { cond.broadcast }
+    Fiber.await(*fibers)
+    assert_equal [1, 2, 3], buf
+    assert !lock.locked?
+  end
+
+  def test_condition_variable_wait_timeout
+    lock = Polyphony::Mutex.new
+    cond = Polyphony::ConditionVariable.new
+
+    t0 = Time.now
+    lock.synchronize do
+      cond.wait(lock, 0.05)
+      assert lock.owned?
+    end
+    elapsed = Time.now - t0
+    assert elapsed >= 0.04
+    assert elapsed < 0.3
+    assert !lock.locked?
+
+    buf = []
+    f = spin do
+      lock.synchronize do
+        cond.wait(lock, 10)
+        buf << :signalled
+      end
+    end
+    snooze
+    lock.synchronize { cond.signal }
+    f.await
+    assert_equal [:signalled], buf
+  end
+end
+
+class SemaphoreTest < MiniTest::Test
+  def test_semaphore
+    sem = Polyphony::Semaphore.new(2)
+    assert_equal 2, sem.available
+
+    max = 0
+    count = 0
+    fibers = (1..6).map do
+      spin do
+        sem.synchronize do
+          count += 1
+          max = count if count > max
+          sleep 0.01
+          count -= 1
+        end
+      end
+    end
+    Fiber.await(*fibers)
+    assert_equal 2, max
+    assert_equal 2, sem.available
+  end
+
+  def test_semaphore_try_acquire
+    sem = Polyphony::Semaphore.new(1)
+    assert sem.try_acquire
+    assert !sem.try_acquire
+    sem.release
+    assert_equal 1, sem.available
+  end
+end
+
+class RWLockTest < MiniTest::Test
+  def test_rwlock
+    lock = Polyphony::RWLock.new
+    buf = []
+
+    readers = (1..3).map do |i|
+      spin do
+        lock.with_read_lock do
+          buf << "r#{i}"
+          snooze
+          buf << lock.readers
+        end
+      end
+    end
+    writer = spin do
+      lock.with_write_lock do
+        buf << :w
+        assert_equal 0, lock.readers
+        assert lock.write_locked?
+      end
+    end
+    Fiber.await(*readers, writer)
+
+    assert_equal ['r1', 'r2', 'r3', 3, 2, 1, :w], buf
+    assert !lock.write_locked?
+    assert_equal 0, lock.readers
+  end
+
+  def test_rwlock_writer_blocks_new_readers
+    lock = Polyphony::RWLock.new
+    buf = []
+
+    lock.read_lock
+    writer = spin { lock.with_write_lock { buf << :w } }
+    snooze
+    reader = spin { lock.with_read_lock { buf << :r } }
+    snooze
+    assert_equal [], buf
+
+    lock.read_unlock
+    Fiber.await(writer, reader)
+    assert_equal [:w, :r], buf
+  end
+end
@@ -39,6 +39,24 @@ class ThreadTest < MiniTest::Test
     t&.join
   end
 
+  def test_blocking_poll_releases_gvl
+    t = Thread.new { sleep 0.2 }
+    sleep 0.01
+
+    # a thread blocked on its event loop should not prevent other threads from
+    # running
+    t0 = Time.now
+    count = 0
+    count += 1 while Time.now - t0 < 0.05
+    elapsed = Time.now - t0
+
+    assert count > 0
+    assert elapsed < 0.15
+  ensure
+    t&.kill
+    t&.join
+  end
+
   def test_thread_join_with_timeout
     buffer = []
     spin { (1..3).each { |i| snooze; buffer << i } }
@@ -167,4 +185,46 @@ class ThreadTest < MiniTest::Test
     t&.kill
     t&.join
   end
+  def test_thread_backend_and_fiber_thread
+    t = Thread.new do
+      f = spin { suspend }
+      snooze
+      [Thread.current.backend, f.thread]
+    end
+    backend, thread = t.await
+    refute_nil backend
+    refute_equal Thread.current.backend, backend
+    assert_equal t, thread
+    assert_equal Thread.current, Fiber.current.thread
+  ensure
+    t&.kill
+    t&.join
+  end
+  def test_schedule_fiber_with_priority
+    buffer = []
+    fibers = (1..3).map { |i| spin { buffer << [i, suspend] } }
+    snooze
+    fibers.each { |f| f.schedule(:normal) }
+    assert_equal [:runnable] * 3, fibers.map(&:state)
+
+    # an already runnable fiber is moved to the front of the run queue
+    Thread.current.schedule_fiber_with_priority(fibers[2], :priority)
+    Fiber.await(*fibers)
+    assert_equal [[3, :priority], [1, :normal], [2, :normal]], buffer
+  end
+  def test_cross_thread_scheduling
+    buffer = []
+    fibers = (1..100).map { spin { buffer << suspend } }
+    snooze
+    t = Thread.new do
+      fibers.each_with_index { |f, i| f.schedule(i) }
+    end
+    t.join
+    t = nil
+    snooze while buffer.size < 100
+    assert_equal (0..99).to_a, buffer
+  ensure
+    t&.kill
+    t&.join
+  end
 end